@@ -26,11 +26,13 @@ Notes:
 
     Individual recordings (programs) are extracted,
     honouring any splits and/or deletes.
-    Merged programs are not handled yet though as
-    I would need to fully parse the higher level program set info.
+    Merged programs and other user defined program sets (playlists)
+    can be extracted with --playlist, though the layout of that
+    info in the IFO is a guess, so it's ignored if not as expected.
     Note the VOBs output from this program can be trivially
     concatenated with the unix cat command for example
-    (note there will be timestamp jumps which may be problematic).
+    (note there will be timestamp jumps which may be problematic,
+    unless --rebase-time is used).
 
     While extracting the DVD data, this program instructs the system
     to not cache the data so that existing cached data is not affected.
@@ -44,10 +46,12 @@ Notes:
     It might be useful to provide a FUSE module using this logic,
     to present the logical structure of a DVD-VR, maybe even present as DVD-Video?
 
-    Doesn't parse play list index
-    Doesn't parse still image info
-    Doesn't parse chapters
-    Doesn't fixup MPEG time data
+    Playlist cells are extracted on VOBU boundaries
+    Stills are extracted as vob files (--stills), not converted to images
+    Chapters are split on VOBU boundaries (--chapters=split)
+    Only fixes up MPEG time data in pack and PES headers (--rebase-time)
+    NAV packs (--nav) are generated from the IFO VOBU map,
+    with VOBU times and reference pictures from the video of each VOBU
 
 
 Requirements:
@@ -216,6 +220,8 @@ static int touch(const char* filename, struct tm* tm)
 }
 
 typedef void (*process_func_t)(uint8_t* buf, unsigned int bs, void* context);
+/* Write the data to fd in some form, returning 0 on success */
+typedef int (*output_func_t)(int fd, const uint8_t* buf, unsigned int len);
 
 /*
   Copy data between file descriptors while not
@@ -245,7 +251,8 @@ typedef void (*process_func_t)(uint8_t* buf, unsigned int bs, void* context);
  */
 
 static int stream_data(int src_fd, int dst_fd, uint32_t blocks, uint16_t block_size,
-                       process_func_t process_func, void* process_context)
+                       process_func_t process_func, void* process_context,
+                       output_func_t output_func)
 {
 #define AUTO
 #define BLOCKS_PER_OP 1
@@ -293,7 +300,12 @@ static int stream_data(int src_fd, int dst_fd, uint32_t blocks, uint16_t block_s
                 process_func(buf+(pblock*block_size), block_size, process_context);
             }
         }
-        if (write(dst_fd, buf, trans_size) != trans_size) {
+        if (output_func) {
+            if (output_func(dst_fd, buf, trans_size)) {
+                fprintf(stderr, "Error writing to DST [%s]\n", strerror(errno));
+                return -2;
+            }
+        } else if (write(dst_fd, buf, trans_size) != trans_size) {
             fprintf(stderr, "Error writing to DST [%s]\n", strerror(errno));
             return -2;
         }
@@ -405,11 +417,12 @@ static const char* get_charset(void)
     return codeset;
 }
 
-static bool text_convert(const char *src, size_t srclen, char *dst, size_t dstlen)
+static bool text_convert(const char *src, size_t srclen, char *dst, size_t dstlen,
+                         const char* from_charset, const char* to_charset)
 {
     bool ret=false;
 #ifdef HAVE_ICONV
-    iconv_t cd = iconv_open (sys_charset, disc_charset);
+    iconv_t cd = iconv_open (to_charset, from_charset);
     if (cd != (iconv_t)-1) {
         if (iconv (cd, (ICONV_CONST char**)&src, &srclen, &dst, &dstlen) != (size_t)-1) {
             if (iconv (cd, NULL, NULL, &dst, &dstlen) != (size_t)-1) { /* terminate string */
@@ -417,16 +430,16 @@ static bool text_convert(const char *src, size_t srclen, char *dst, size_t dstle
             }
         } else {
             fprintf(stderr, "Error converting text from %s to %s\n",
-                    disc_charset, sys_charset);
+                    from_charset, to_charset);
         }
         iconv_close (cd);
     } else {
         fprintf(stderr, "Error converting text from %s to %s. Not supported\n",
-                disc_charset, sys_charset);
+                from_charset, to_charset);
     }
 #else
     /* avoid warnings (__attribute__ ((unused)) is too verbose/non standard) */
-    (void)src; (void)dst; (void)srclen; (void)dstlen;
+    (void)src; (void)dst; (void)srclen; (void)dstlen; (void)from_charset; (void)to_charset;
     fprintf(stderr, "Error converting text. libiconv missing\n");
 #endif
     return ret;
@@ -440,9 +453,27 @@ typedef struct {
     int aspect;
     int width;
     int height;
+    bool mpeg1;
+    uint8_t unused;
+    uint16_t attr; /* as in the IFO */
 } p_video_attr_t;
 p_video_attr_t* ifo_video_attrs;
 
+typedef enum {
+    AUDIO_AC3=0,
+    AUDIO_MPEG1=2,
+    AUDIO_MPEG2EXT=3,
+    AUDIO_LPCM=4
+} audio_coding_t;
+
+#define MAX_AUDIO_STREAMS 2 /* audio_attr0 and audio_attr1 */
+typedef struct {
+    int nr_of_streams;
+    int coding[MAX_AUDIO_STREAMS];
+    int channels[MAX_AUDIO_STREAMS]; /* 0 if unknown */
+} p_audio_attr_t;
+p_audio_attr_t* ifo_audio_attrs;
+
 typedef enum {
     SCRAMBLED_UNSET=-1,
     UNSCRAMBLED=0,
@@ -499,7 +530,7 @@ typedef struct {
         uint8_t  zero_226[30];
         /* 256 */
         uint32_t pgit_sa;        /* program info table start address */
-        uint32_t info_260_sa;    /* ? start address */
+        uint32_t s_avfit_sa;     /* still picture info table start address? */
         uint8_t  zero_264[3];
         struct {
             uint8_t supported;   /* Encrypted Title Key Status */
@@ -509,7 +540,7 @@ typedef struct {
         /* 304 */
         uint32_t def_psi_sa;     /* default program set info start address */
         uint32_t info_308_sa;    /* ? start address */
-        uint32_t info_312_sa;    /* user defined program set info start address? */
+        uint32_t ud_pgcit_sa;    /* user defined program set (playlist) info start address? */
         uint32_t info_316_sa;    /* ? start address */
         uint8_t  zero_320[32];
         uint32_t txt_attr_sa;    /* extra attributes for programs (chan id etc.) */
@@ -550,7 +581,8 @@ typedef struct {
     uint32_t vob_offset;
 } PACKED vobu_map_t;
 typedef struct {
-    uint8_t  data[7];
+    uint8_t  data[3];  /* type:1, VOBU number:10, time diff:11, ?:2 */
+    uint32_t vobu_adr; /* sector offset of the VOBU within the VOB */
 } PACKED time_info_t;
 typedef struct {
     uint8_t  data1;
@@ -596,647 +628,6062 @@ typedef struct  {
     char     data3[6];
 } PACKED psi_t;
 
-static const char* parse_txt_encoding(uint8_t txt_encoding)
-{
-/* from the VideoTextDataUsage.pdf available at dvdforum.org we have:
-     01h : ISO 646
-     10h : JIS Roman[14]*and JIS Kanji1990[168]*
-     11h : ISO 8859-1
-     12h : JIS Roman[14]*and JIS Katakana[13]*including Shift JIS Kanji
-   Also Nero generates discs with 00h, so I'll assume this is ASCII.
+typedef struct {
+    uint8_t  data1;
+    uint8_t  nr_of_playlists;
+    uint16_t zero1;
+    uint32_t ud_pgcit_ea;
+} PACKED ud_pgcit_t; /* User Defined ProGram Chain Info Table (playlists) */
+
+typedef struct {
+    uint8_t  data1;
+    uint8_t  nr_of_programs;  /* 0 for playlists */
+    uint16_t nr_of_cells;
+} PACKED pgc_gi_t; /* global info for a ProGram Chain */
+
+typedef struct {
+    uint8_t  cell_type;       /* 0 for movie. Others for stills? */
+    uint8_t  data1;
+    uint16_t vob_id;          /* program number (from 1) */
+    uint16_t nr_of_entry_points;
+    ptm_t    start_ptm;       /* video start and end time within the program */
+    ptm_t    end_ptm;
+} PACKED cell_t;
+
+typedef struct {
+    uint16_t zero1;
+    uint8_t  nr_of_s_avfi;    /* 0 if there's no VR_STILL.VRO */
+    uint8_t  nr_of_vob_formats;
+    uint32_t s_avfit_ea;
+} PACKED s_avfiti_t; /* info for Still picture AV File Info Table */
+
+typedef struct {
+    uint16_t video_attr;
+    uint8_t  nr_of_audio_streams;
+    uint8_t  data1;
+    audio_attr_t audio_attr0;
+    uint8_t  data2[9];
+} PACKED s_vob_format_t;
+
+typedef struct {
+    uint16_t nr_of_vogs;
+} PACKED s_avfi_gi_t; /* global info for the stills in VR_STILL.VRO */
+
+typedef struct {
+    uint16_t nr_of_stills;
+    uint8_t  vob_format_id;
+    uint8_t  data1;
+    pgtm_t   timestamp;
+    uint8_t  data2;
+    uint32_t vob_offset;      /* sectors within VR_STILL.VRO of the first still */
+} PACKED s_vogi_t; /* info for a group of stills */
+
+typedef struct {
+    uint8_t  ent_type;        /* top 2 bits: 0 = video only, 1 = followed by audio size */
+    uint8_t  data1;
+    uint16_t video_sectors;
+} PACKED s_vob_ent_t; /* entry for a still */
+
+#define ENTRY_POINT_TEXT_LEN 128
+typedef struct {
+    uint8_t  ep_type;         /* top 2 bits: 0 = no text, 1 = followed by text */
+    uint8_t  data1;
+    ptm_t    ptm;
+} PACKED entry_point_t; /* chapter mark within a cell */
+
+/*********************************************************************************
+ *                          The parsed IFO
+ *********************************************************************************/
+
+/*
+The IFO is decoded once into these host order structures, before anything
+is printed or extracted. The IFO mapping is read-only and is closed once
+parsed, so the rest of the processing doesn't need to worry about the
+byte order or the lifetime of the mapping, and can visit the data
+as often as needed.
 */
 
-    const char* charset="Unknown";
+typedef struct {
+    uint16_t sectors;       /* size of the VOBU */
+    uint8_t  fields;        /* duration in video fields? The bits above the size */
+    uint8_t  data1;
+} ifo_vobu_t;
 
-    switch (txt_encoding) {
-    case 0x00: charset="ASCII"; break;
-    case 0x01: charset="ISO646-JP"; break; /* ?? */
-    case 0x10: charset="JIS_C6220-1969-RO"; break; /* ?? */
-    case 0x11: charset="ISO_8859-1"; break;
-    case 0x12: charset="SHIFT_JIS"; break;
-    }
+typedef struct {
+    uint16_t     video_attr;
+    uint8_t      nr_of_audio_streams;
+    uint8_t      unused;
+    audio_attr_t audio_attr[MAX_AUDIO_STREAMS];
+} ifo_vob_format_t;
 
-    if (STREQ("Unknown", charset)) {
-        fprintf(stdinfo, "text encoding: %s", charset);
-        fprintf(stdinfo, ". (%02X). Please report this number and actual text encoding.\n", txt_encoding );
-        charset="ISO_8859-15"; /* Shouldn't give an error at least */
-    }
+typedef struct {
+    char     label[64];     /* ASCII. Might not be NUL terminated */
+    char     title[64];     /* Could be same as label, NUL, or another charset */
+    uint16_t nr_of_programs;
+    uint16_t first_prog_id;
+    uint16_t start_prog_num;  /* number of the first program in the set */
+} ifo_psi_t;
 
-    return charset;
-}
+/* An entry in the time map, which is every TIME_MAP_UNIT seconds */
+typedef struct {
+    uint16_t vobu;          /* the VOBU containing the entry time */
+    uint16_t time_diff;     /* fields from the start of that VOBU to the entry time */
+} ifo_time_entry_t;
 
+typedef struct {
+    ifo_vobu_t*       vobus;
+    ifo_time_entry_t* time_entries; /* NULL if the time map isn't consistent with the VOBUs */
+    uint32_t*         entry_points; /* start times of the chapters after the first, ascending */
+    uint32_t          vvobi_sa;     /* for debugging */
+    uint32_t          vob_offset;   /* sectors within the VRO */
+    uint32_t          start_ptm;    /* video start and end time */
+    uint32_t          end_ptm;
+    uint32_t          total_fields; /* sum of the VOBU durations, or 0 if not recorded */
+    uint16_t          vob_attr;
+    uint16_t          nr_of_vobus;
+    uint16_t          nr_of_time_infos;
+    uint16_t          time_offset;  /* fields? */
+    uint16_t          nr_of_entry_points;
+    pgtm_t            timestamp;
+    uint8_t           vob_format_id;
+    uint8_t           pgi;          /* VRO info table (from 0) listing the program */
+    uint8_t           unused[3];
+} ifo_program_t;
 
-static bool parse_audio_attr(audio_attr_t audio_attr0)
-{
-    int coding   = (audio_attr0.audio_attr[0] & 0xE0)>>5;
-    int channels = (audio_attr0.audio_attr[1] & 0x0F);
-    /* audio_attr0.audio_attr[2] = 7 for my camcorder. Is this 192Kbit? */
-    /* audio_attr0.audio_attr[2] = 9 for Masato Nunokawa's disc? */
+typedef struct {
+    uint16_t program;       /* index of the program the cell plays from */
+    uint16_t unused;
+    uint32_t start_ptm;
+    uint32_t end_ptm;
+} ifo_cell_t;
 
-    if (channels < 8) {
-        fprintf(stdinfo, "audio_channs: %d\n",channels+1);
-    } else if (channels == 9) {
-        /* According to Masato Nunokawa's disc */
-        fprintf(stdinfo, "audio_channs: 2 (mono)\n");
-    } else {
-        return false;
+typedef struct {
+    ifo_cell_t* cells;
+    uint16_t    nr_of_cells;
+    uint8_t     unused[6];
+} ifo_playlist_t;
+
+typedef struct {
+    uint16_t video_sectors;
+    uint16_t audio_sectors; /* 0 if there's no audio for the still */
+} ifo_still_t;
+
+typedef struct {
+    ifo_still_t* stills;
+    uint32_t     vob_offset;    /* sectors within VR_STILL.VRO */
+    uint16_t     nr_of_stills;
+    pgtm_t       timestamp;
+    uint8_t      unused[5];
+} ifo_still_group_t;
+
+typedef struct {
+    ifo_vob_format_t* vob_formats;
+    ifo_psi_t*        psis;         /* default program sets */
+    ifo_program_t*    programs;
+    uint8_t*          program_psis; /* program set number (from 1) of each program, or 0 */
+    ifo_playlist_t*   playlists;    /* user defined program sets */
+    ifo_still_group_t* still_groups;
+    uint32_t          pgit_ea;
+    uint32_t          nr_of_indexed_programs;
+    uint16_t          version;
+    uint16_t          nr_of_programs;
+    uint16_t          nr_of_psi_programs;
+    uint8_t           nr_of_pgi;
+    uint8_t           nr_of_vob_formats;
+    uint8_t           nr_of_psi;
+    uint8_t           txt_encoding;
+    bool              cprm_supported;
+    uint8_t           nr_of_playlists;
+    uint16_t          nr_of_still_groups;
+    uint8_t           unused[2];
+    char              disc_info1[64];
+    char              disc_info2[64];
+} ifo_t;
+
+/* Return a pointer to len bytes at offset within the mapped IFO, or NULL if out of range */
+static const uint8_t* ifo_data(const uint8_t* map, size_t map_size, size_t offset, size_t len)
+{
+    if (offset > map_size || len > map_size - offset) {
+        return NULL;
     }
+    return map + offset;
+}
 
-    const char* coding_name="Unknown";
-    switch (coding) {
-    case 0: coding_name="Dolby AC-3"; break;
-    case 2: coding_name="MPEG-1"; break;
-    case 3: coding_name="MPEG-2ext"; break;
-    case 4: coding_name="Linear PCM"; break;
+static void free_ifo(ifo_t* ifo)
+{
+    if (ifo->programs) {
+        unsigned int program;
+        for (program=0; program<ifo->nr_of_programs; program++) {
+            free(ifo->programs[program].vobus);
+            free(ifo->programs[program].time_entries);
+            free(ifo->programs[program].entry_points);
+        }
     }
-    fprintf(stdinfo, "audio_coding: %s",coding_name);
-    if (STREQ("Unknown", coding_name)) {
-        fprintf(stdinfo, ". (%d). Please report this number and actual audio encoding.\n", coding );
-    } else {
-        putc('\n', stdinfo);
+    free(ifo->programs);
+    if (ifo->playlists) {
+        unsigned int playlist;
+        for (playlist=0; playlist<ifo->nr_of_playlists; playlist++) {
+            free(ifo->playlists[playlist].cells);
+        }
     }
+    free(ifo->playlists);
+    if (ifo->still_groups) {
+        unsigned int group;
+        for (group=0; group<ifo->nr_of_still_groups; group++) {
+            free(ifo->still_groups[group].stills);
+        }
+    }
+    free(ifo->still_groups);
+    free(ifo->program_psis);
+    free(ifo->psis);
+    free(ifo->vob_formats);
+    memset(ifo, 0, sizeof(*ifo));
+}
 
+/*
+The time map has an entry every TIME_MAP_UNIT seconds of the program,
+giving the address of the VOBU playing at that time, and how far into
+that VOBU the time is. The layout is as per the DVD-VR spec as far as
+I can tell, so the entries are only used if each address matches
+the start of a VOBU. Return false on allocation failure.
+*/
+static bool parse_time_map(const time_info_t* time_info, ifo_program_t* program)
+{
+    program->time_entries = NULL;
+    if (!program->nr_of_time_infos) {
+        return true;
+    }
+    ifo_time_entry_t* entries = malloc(program->nr_of_time_infos * sizeof(ifo_time_entry_t));
+    if (!entries) {
+        fprintf(stderr, "Error allocating space for the time map\n");
+        return false;
+    }
+    unsigned int vobu = 0;
+    uint32_t sector = 0;
+    unsigned int entry;
+    for (entry=0; entry<program->nr_of_time_infos; entry++) {
+        const uint8_t* data = time_info[entry].data;
+        uint32_t vobu_adr = ntohl(time_info[entry].vobu_adr);
+        while (vobu < program->nr_of_vobus && sector < vobu_adr) {
+            sector += program->vobus[vobu++].sectors;
+        }
+        if (sector != vobu_adr || vobu == program->nr_of_vobus) {
+#ifndef NDEBUG
+            fprintf(stderr, "Warning: ignoring the time map, as entry %u doesn't match a VOBU\n",
+                    entry+1);
+#endif//NDEBUG
+            free(entries);
+            return true;
+        }
+        entries[entry].vobu = vobu;
+        entries[entry].time_diff = ((data[1] & 0x1F) << 6) | (data[2] >> 2);
+    }
+    program->time_entries = entries;
     return true;
 }
 
-static bool parse_video_attr(uint16_t video_attr, p_video_attr_t* p_video_attr)
+/* Decode the program info for a VVOB, and set the offset of the end of it.
+ * Return false if it's invalid. */
+static bool parse_ifo_program(const uint8_t* map, size_t map_size, uint32_t pgit_sa,
+                              uint32_t vvobi_sa, uint8_t nr_of_vob_formats,
+                              ifo_program_t* program, size_t* info_end)
 {
-    int resolution  = (video_attr & 0x0038) >>  3;
-    int aspect      = (video_attr & 0x0C00) >> 10;
-    int tv_sys      = (video_attr & 0x3000) >> 12;
-    int compression = (video_attr & 0xC000) >> 14;
-
-    p_video_attr->aspect = p_video_attr->width = p_video_attr->height = -1;
-
-    int vert_resolution  = 0;
-    int horiz_resolution = 0;
-    const char* tv_system = "Unknown";
-    switch (tv_sys) {
-    case 0:
-        tv_system = "NTSC";
-        vert_resolution=480;
-        break;
-    case 1:
-        tv_system = "PAL";
-        vert_resolution=576;
-        break;
+    size_t offset = (size_t)pgit_sa + vvobi_sa;
+    const vvob_t* vvob = (const vvob_t*) ifo_data(map, map_size, offset, sizeof(vvob_t));
+    if (!vvob) {
+        return false;
     }
-    fprintf(stdinfo, "tv_system   : %s", tv_system);
-    if (STREQ("Unknown", tv_system)) {
-        fprintf(stdinfo, ". (%d). Please report this number and actual TV system.\n", tv_sys );
-    } else {
-        putc('\n', stdinfo);
+    program->vvobi_sa = vvobi_sa;
+    program->vob_attr = ntohs(vvob->vob_attr);
+    program->timestamp = vvob->vob_timestamp;
+    program->vob_format_id = vvob->vob_format_id;
+    if (!program->vob_format_id || program->vob_format_id > nr_of_vob_formats) {
+        return false; /* would index beyond the VOB formats */
     }
+    program->start_ptm = ntohl(vvob->vob_v_s_ptm.ptm);
+    program->end_ptm = ntohl(vvob->vob_v_e_ptm.ptm);
 
-    switch (resolution) {
-    case 0: horiz_resolution=720; break;
-    case 1: horiz_resolution=704; break;
-    case 2: horiz_resolution=352; break;
-    case 3: horiz_resolution=352; vert_resolution/=2; break;
-    case 4: horiz_resolution=544; break; /* this is a google inspired guess. */
-    case 5: horiz_resolution=480; break; /* from Aaron Binns' disc */
+    offset += sizeof(vvob_t);
+    if (program->vob_attr & 0x80) {
+        offset += sizeof(adj_vob_t); /* skip adjacent VOB info */
     }
-    if (horiz_resolution && vert_resolution) {
-        fprintf(stdinfo, "resolution  : %dx%d\n", horiz_resolution, vert_resolution);
-        p_video_attr->width = horiz_resolution;
-        p_video_attr->height = vert_resolution;
-    } else if (!horiz_resolution) {
-        fprintf(stdinfo, "resolution  : Unknown (%d). Please report this number and actual resolution.\n", resolution );
+    offset += sizeof(uint16_t); /* ?? */
+    const vobu_map_t* vobu_map = (const vobu_map_t*) ifo_data(map, map_size, offset, sizeof(vobu_map_t));
+    if (!vobu_map) {
+        return false;
     }
-
-    const char* aspect_ratio = "Unknown";
-    switch (aspect) {
-    case 0: aspect_ratio="4:3"; break;
-    case 1: aspect_ratio="16:9"; break;
+    program->nr_of_time_infos = ntohs(vobu_map->nr_of_time_info);
+    program->nr_of_vobus = ntohs(vobu_map->nr_of_vobu_info);
+    program->time_offset = ntohs(vobu_map->time_offset);
+    program->vob_offset = ntohl(vobu_map->vob_offset);
+    offset += sizeof(vobu_map_t);
+
+    const time_info_t* time_info = (const time_info_t*)
+        ifo_data(map, map_size, offset, program->nr_of_time_infos * sizeof(time_info_t));
+    offset += program->nr_of_time_infos * sizeof(time_info_t);
+    const vobu_info_t* vobu_info = (const vobu_info_t*)
+        ifo_data(map, map_size, offset, program->nr_of_vobus * sizeof(vobu_info_t));
+    if (!time_info || !vobu_info) {
+        return false;
     }
-    fprintf(stdinfo, "aspect_ratio: %s", aspect_ratio );
-    if (STREQ("Unknown", aspect_ratio)) {
-        fprintf(stdinfo, ". (%d). Please report this number and actual aspect ratio.\n", aspect );
-    } else {
-        putc('\n', stdinfo);
-        p_video_attr->aspect = aspect + 2; /* DVD-Video aspect encoding */
+    *info_end = offset + program->nr_of_vobus * sizeof(vobu_info_t);
+    program->vobus = malloc(program->nr_of_vobus * sizeof(ifo_vobu_t) + 1);
+    if (!program->vobus) {
+        fprintf(stderr, "Error allocating space for VOBU info\n");
+        return false;
     }
+    unsigned int vobu;
+    for (vobu=0; vobu<program->nr_of_vobus; vobu++) {
+        uint16_t vobu_size = ntohs(vobu_info[vobu].vobu_size);
+        program->vobus[vobu].sectors = vobu_size & 0x03FF;
+        program->vobus[vobu].fields = vobu_size >> 10;
+        program->vobus[vobu].data1 = vobu_info[vobu].data1;
+        program->total_fields += program->vobus[vobu].fields;
+    }
+    return parse_time_map(time_info, program);
+}
 
-    const char* mode = "Unknown";
-    switch (compression) {
-    case 0: mode="MPEG1"; break;
-    case 1: mode="MPEG2"; break;
+/*
+ * Index the program set of each program, so that it can be looked up directly.
+ * We need to maintain a program count as first_prog_id is often not stored,
+ * as is the case for LG and "CIRRUS LOGIC" V1.1 discs for example (it's 0 or 0xFFFF).
+ * Also I noticed a Sony disc that had programs sets with 2 programs in them, which
+ * sometimes set the first_prog_id to the second program in the set.  Perhaps
+ * this field identifies the prog to start playing, as the first program in those
+ * sets was a single VOBU that was generated due to a split.
+ */
+static bool index_program_sets(ifo_t* ifo)
+{
+    uint32_t program_count = 0;
+    unsigned int ps;
+    for (ps=0; ps<ifo->nr_of_psi; ps++) {
+        ifo->psis[ps].start_prog_num = MIN(program_count, UINT16_MAX) + 1;
+        program_count += ifo->psis[ps].nr_of_programs;
     }
-    fprintf(stdinfo, "video_format: %s", mode );
-    if (STREQ("Unknown", mode)) {
-        p_video_attr->aspect = -1; /* Don't adjust aspect later for unknown formats */
-        fprintf(stdinfo, ". (%d). Please report this number and actual compression format.\n", compression );
-    } else {
-        putc('\n', stdinfo);
+    /* Program numbers are 16 bit, so ignore sets beyond that */
+    ifo->nr_of_indexed_programs = MIN(program_count, UINT16_MAX);
+    ifo->program_psis = malloc(ifo->nr_of_indexed_programs + 1);
+    if (!ifo->program_psis) {
+        fprintf(stderr, "Error allocating space for the program set index\n");
+        return false;
+    }
+    uint32_t program = 0;
+    for (ps=0; ps<ifo->nr_of_psi; ps++) {
+        uint32_t end = MIN(program + ifo->psis[ps].nr_of_programs, ifo->nr_of_indexed_programs);
+        while (program < end) {
+            ifo->program_psis[program++] = ps + 1;
+        }
     }
-
     return true;
 }
 
-static bool parse_pgtm(pgtm_t pgtm, struct tm* tm)
+/* Decode the cells of a playlist. Return false if they're invalid. */
+static bool parse_ifo_playlist(const uint8_t* map, size_t map_size, size_t pgc_sa,
+                               const ifo_t* ifo, ifo_playlist_t* playlist)
 {
-    bool ret=false;
-
-    uint16_t year  = ((pgtm.pgtm[0]       ) <<8 | (pgtm.pgtm[1]     )) >> 2;
-    uint8_t  month =  (pgtm.pgtm[1] & 0x03) <<2 | (pgtm.pgtm[2] >> 6);
-    uint8_t  day   =  (pgtm.pgtm[2] & 0x3E) >>1;
-    uint8_t  hour  =  (pgtm.pgtm[2] & 0x01) <<4 | (pgtm.pgtm[3] >> 4);
-    uint8_t  min   =  (pgtm.pgtm[3] & 0x0F) <<2 | (pgtm.pgtm[4] >> 6);
-    uint8_t  sec   =  (pgtm.pgtm[4] & 0x3F);
-    if (year) {
-        tm->tm_year=year-1900;
-        tm->tm_mon=month-1;
-        tm->tm_mday=day;
-        tm->tm_hour=hour;
-        tm->tm_min=min;
-        tm->tm_sec=sec;
-        tm->tm_isdst=-1; /*Auto calc DST offset.*/
-
-        char date_str[32];
-        strftime(date_str,sizeof(date_str),"%F %T",tm); //locale = %x %X
-        fprintf(stdinfo, "date : %s\n",date_str);
-        ret=true;
-    } else {
-        fprintf(stdinfo, "date : not set\n");
+    const pgc_gi_t* pgc_gi = (const pgc_gi_t*) ifo_data(map, map_size, pgc_sa, sizeof(pgc_gi_t));
+    if (!pgc_gi || pgc_gi->nr_of_programs) {
+        return false;
     }
-    return ret;
+    uint16_t nr_of_cells = ntohs(pgc_gi->nr_of_cells);
+    const uint32_t* cell_sa = (const uint32_t*)
+        ifo_data(map, map_size, pgc_sa + sizeof(pgc_gi_t), nr_of_cells * sizeof(uint32_t));
+    playlist->cells = malloc(nr_of_cells * sizeof(ifo_cell_t) + 1);
+    if (!cell_sa || !playlist->cells) {
+        return false;
+    }
+    unsigned int c;
+    for (c=0; c<nr_of_cells; c++) {
+        const cell_t* cell = (const cell_t*)
+            ifo_data(map, map_size, pgc_sa + ntohl(cell_sa[c]), sizeof(cell_t));
+        if (!cell) {
+            return false;
+        }
+        if (cell->cell_type) {
+            continue; /* not movie */
+        }
+        uint16_t vob_id = ntohs(cell->vob_id);
+        if (vob_id == 0 || vob_id > ifo->nr_of_programs) {
+            return false;
+        }
+        const ifo_program_t* program = &ifo->programs[vob_id-1];
+        ifo_cell_t* ifo_cell = &playlist->cells[playlist->nr_of_cells];
+        ifo_cell->program = vob_id-1;
+        ifo_cell->start_ptm = ntohl(cell->start_ptm.ptm);
+        ifo_cell->end_ptm = ntohl(cell->end_ptm.ptm);
+        if (((ifo_cell->start_ptm - program->start_ptm) & 0xFFFFFFFF) >=
+            ((ifo_cell->end_ptm - program->start_ptm) & 0xFFFFFFFF)) {
+            return false;
+        }
+        playlist->nr_of_cells++;
+    }
+    return true;
 }
 
-#ifndef NDEBUG
-/* This is basically a simplification of find_program_text_info() */
-static void print_psi(psi_gi_t* psi_gi)
+/* Add an entry point to a program, keeping them sorted and unique.
+ * Return false if it's not within the program. */
+static bool add_entry_point(ifo_program_t* program, uint32_t ptm)
 {
-    putc('\n', stdinfo);
-    int ps;
-    uint16_t program_count = 0;
-    for (ps=0; ps<psi_gi->nr_of_psi; ps++) {
-        psi_t *psi = (psi_t*)(((char*)(psi_gi+1)) + (ps * sizeof(psi_t)));
-
-        uint16_t first_prog_num = ntohs(psi->first_prog_id); /* assuming this is first to play? */
-        uint16_t start_prog_num = program_count+1;
-        uint16_t num_progs_in_set = ntohs(psi->nr_of_programs);
-        program_count += num_progs_in_set;
-        fprintf(stdinfo, "Programs in Program set %d:", ps+1);
-        int program_id;
-        for (program_id = start_prog_num;
-             program_id < start_prog_num+num_progs_in_set;
-             program_id++) {
-            const char* fmt = (program_id==first_prog_num ? " (%d)" : " %d");
-            fprintf(stdinfo, fmt, program_id);
+    uint32_t time = ptm - program->start_ptm;
+    if (!time) {
+        return true; /* the start of the first chapter */
+    }
+    if (time >= (uint32_t)(program->end_ptm - program->start_ptm)) {
+        return false;
+    }
+    uint32_t* entry_points = realloc(program->entry_points,
+                                     (program->nr_of_entry_points + 1) * sizeof(uint32_t));
+    if (!entry_points) {
+        return false;
+    }
+    program->entry_points = entry_points;
+    unsigned int ep = program->nr_of_entry_points;
+    while (ep && (uint32_t)(entry_points[ep-1] - program->start_ptm) >= time) {
+        if (entry_points[ep-1] == ptm) {
+            return true; /* duplicate */
         }
-        putc('\n', stdinfo);
+        ep--;
     }
-    putc('\n', stdinfo);
+    memmove(&entry_points[ep+1], &entry_points[ep],
+            (program->nr_of_entry_points - ep) * sizeof(uint32_t));
+    entry_points[ep] = ptm;
+    program->nr_of_entry_points++;
+    return true;
 }
-#endif//NDEBUG
 
 /*
- * FIXME: This assumes the programs occur linearly within
- * the default program sets. This has been accurate for all
- * discs I've seen so far at least. Note I've noticed a
- * couple of "SONY_MOBILE" discs with no labels at all.
- */
-static psi_t* find_program_text_info(psi_gi_t* psi_gi, int program)
+The chapter marks of the programs are entry points in the cells of the
+original program chain, which follow the program set info. A table of
+the offsets of each cell (one per program usually) follows the program sets,
+and each cell lists its entry points after its times. An entry point can be
+followed by a text description, which we skip. As for the playlists,
+this layout is a guess, so if anything isn't as expected the chapters
+are ignored, leaving each program as a single chapter.
+*/
+static bool parse_ifo_entry_points(const uint8_t* map, size_t map_size, uint32_t def_psi_sa, ifo_t* ifo)
 {
-    int ps;
-    uint16_t program_count = 0;
-    for (ps=0; ps<psi_gi->nr_of_psi; ps++) {
-        psi_t *psi = (psi_t*)(((char*)(psi_gi+1)) + (ps * sizeof(psi_t)));
-        uint16_t start_prog_num;
-        /*
-        start_prog_num = ntohs(psi->first_prog_id);
-
-        We need to maintain program count as first_prog_id is often not stored,
-        as is the case for LG and "CIRRUS LOGIC" V1.1 discs for example (it's 0 or 0xFFFF).
-        Also I noticed a Sony disc that had programs sets with 2 programs in them, which
-        sometimes set the first_prog_id to the second program in the set.  Perhaps
-        this field identifies the prog to start playing, as the first program in those
-        sets was a single VOBU that was generated due to a split.
-        Perhaps I should name the programs label.ps_id(001) when > 1 ps. */
-        start_prog_num = program_count+1;
-        uint16_t num_progs_in_set = ntohs(psi->nr_of_programs);
-        /* TODO: Perhaps have an option to merge all programs
-           in a program set to a vob using this info. That would assume
-           though that the programs were adjacent. */
-        program_count += num_progs_in_set;
-        uint16_t end_prog_num = start_prog_num + num_progs_in_set - 1;
-        if ((program >= start_prog_num) && (program <= end_prog_num)) {
-            return psi;
-        }
-    }
-    return (psi_t*)NULL;
-}
-
-/*
- * This function controls the storage used by the actual
- * encoding conversion routines. Note a len must be passed
- * since the text fields are sometimes not NUL terminated.
- *
- * A string in the local encoding is returned which must be free()
- */
-static char* text_field_convert(const char* field, unsigned int len)
+    size_t offset = def_psi_sa + sizeof(psi_gi_t) + ifo->nr_of_psi * sizeof(psi_t);
+    const uint32_t* cell_sa = (const uint32_t*)
+        ifo_data(map, map_size, offset, ifo->nr_of_psi_programs * sizeof(uint32_t));
+    bool valid = cell_sa != NULL;
+    unsigned int c;
+    for (c=0; valid && c<ifo->nr_of_psi_programs; c++) {
+        offset = (size_t)def_psi_sa + ntohl(cell_sa[c]);
+        const cell_t* cell = (const cell_t*) ifo_data(map, map_size, offset, sizeof(cell_t));
+        if (!cell) {
+            valid = false;
+            break;
+        }
+        uint16_t vob_id = ntohs(cell->vob_id);
+        if (vob_id == 0 || vob_id > ifo->nr_of_programs) {
+            valid = false;
+            break;
+        }
+        ifo_program_t* program = &ifo->programs[vob_id-1];
+        offset += sizeof(cell_t);
+        unsigned int ep;
+        for (ep=0; ep<ntohs(cell->nr_of_entry_points); ep++) {
+            const entry_point_t* entry_point = (const entry_point_t*)
+                ifo_data(map, map_size, offset, sizeof(entry_point_t));
+            if (!entry_point || !add_entry_point(program, ntohl(entry_point->ptm.ptm))) {
+                valid = false;
+                break;
+            }
+            offset += sizeof(entry_point_t);
+            if ((entry_point->ep_type >> 6) == 1) {
+                offset += ENTRY_POINT_TEXT_LEN;
+            }
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "Warning: ignoring the chapters, as they're not as expected\n");
+        unsigned int program;
+        for (program=0; program<ifo->nr_of_programs; program++) {
+            free(ifo->programs[program].entry_points);
+            ifo->programs[program].entry_points = NULL;
+            ifo->programs[program].nr_of_entry_points = 0;
+        }
+    }
+    return true;
+}
+
+/*
+The user defined program sets (playlists) are lists of cells, each of which
+plays a time range of a program. This is how programs merged on the
+recorder are represented too, as the original programs are retained.
+The layout is a guess based on the DVD-Video PGC structures,
+so if any cell doesn't reference a valid program range, all playlists
+are ignored.
+*/
+static bool parse_ifo_playlists(const uint8_t* map, size_t map_size, uint32_t ud_pgcit_sa, ifo_t* ifo)
 {
-    unsigned int conv_max_len=len*MB_LEN_MAX+1/*NUL*/;
-    char* field_local=malloc(conv_max_len);
-    if (!field_local) {
-        fprintf(stderr, "Error allocating space for text conversion\n");
-        return NULL;
+    if (!ud_pgcit_sa) {
+        return true;
     }
-    if (*field) {
-        char field_copy[len+1]; /* Copy as may not be NUL terminated */
-        field_copy[len] = '\0';
-        (void) strncpy(field_copy, field, len);
-        size_t srclen = strlen(field_copy) + 1; /* convert NUL also */
-        if (!text_convert(field_copy, srclen, field_local, conv_max_len)) {
-            free(field_local);
-            field_local=NULL;
+    const ud_pgcit_t* ud_pgcit = (const ud_pgcit_t*) ifo_data(map, map_size, ud_pgcit_sa, sizeof(ud_pgcit_t));
+    if (!ud_pgcit || !ud_pgcit->nr_of_playlists) {
+        return true;
+    }
+    const uint32_t* pgc_sa = (const uint32_t*) ifo_data(map, map_size, ud_pgcit_sa + sizeof(ud_pgcit_t),
+                                                        ud_pgcit->nr_of_playlists * sizeof(uint32_t));
+    ifo->playlists = calloc(ud_pgcit->nr_of_playlists, sizeof(ifo_playlist_t));
+    if (!ifo->playlists) {
+        fprintf(stderr, "Error allocating space for playlists\n");
+        return false;
+    }
+    ifo->nr_of_playlists = ud_pgcit->nr_of_playlists;
+    unsigned int playlist;
+    for (playlist=0; pgc_sa && playlist<ifo->nr_of_playlists; playlist++) {
+        if (!parse_ifo_playlist(map, map_size, (size_t)ud_pgcit_sa + ntohl(pgc_sa[playlist]),
+                                ifo, &ifo->playlists[playlist])) {
+            break;
         }
-    } else {
-        *field_local='\0';
     }
+    if (!pgc_sa || playlist < ifo->nr_of_playlists) {
+        fprintf(stderr, "Warning: ignoring the playlists, as they're not as expected\n");
+        for (playlist=0; playlist<ifo->nr_of_playlists; playlist++) {
+            free(ifo->playlists[playlist].cells);
+        }
+        free(ifo->playlists);
+        ifo->playlists = NULL;
+        ifo->nr_of_playlists = 0;
+    }
+    return true;
+}
 
-    return field_local;
+/*
+Decode a VRO info table, appending its programs to those of the previous
+tables, so that they're numbered consecutively. Usually there's only one table,
+but HDD recorders and discs with multiple sessions can have more. These are
+taken to follow each other, with each starting after the last VVOB info of
+the previous table. The VOB formats are shared by all tables.
+Return the offset of the end of the table, or 0 if it's invalid.
+*/
+static size_t parse_ifo_pgi(const uint8_t* map, size_t map_size, uint32_t pgit_sa,
+                            size_t offset, unsigned int pgi, ifo_t* ifo)
+{
+    const pgi_gi_t* pgi_gi = (const pgi_gi_t*) ifo_data(map, map_size, offset, sizeof(pgi_gi_t));
+    if (!pgi_gi) {
+        return 0;
+    }
+    uint16_t nr_of_programs = ntohs(pgi_gi->nr_of_programs);
+    if (ifo->nr_of_programs + nr_of_programs > UINT16_MAX) {
+        return 0; /* program numbers are 16 bit */
+    }
+    offset += sizeof(pgi_gi_t);
+    typedef uint32_t vvobi_sa_t;
+    const vvobi_sa_t* vvobi_sa = (const vvobi_sa_t*)
+        ifo_data(map, map_size, offset, nr_of_programs * sizeof(vvobi_sa_t));
+    if (!vvobi_sa) {
+        return 0;
+    }
+    offset += nr_of_programs * sizeof(vvobi_sa_t);
+    ifo_program_t* programs = realloc(ifo->programs,
+                                      (ifo->nr_of_programs + nr_of_programs + 1) * sizeof(ifo_program_t));
+    if (!programs) {
+        fprintf(stderr, "Error allocating space for program info\n");
+        return 0;
+    }
+    ifo->programs = programs;
+    memset(&programs[ifo->nr_of_programs], 0, (nr_of_programs + 1) * sizeof(ifo_program_t));
+
+    size_t table_end = offset;
+    unsigned int program;
+    for (program=0; program<nr_of_programs; program++) {
+        ifo_program_t* info = &programs[ifo->nr_of_programs];
+        size_t info_end;
+        if (parse_ifo_program(map, map_size, pgit_sa, ntohl(vvobi_sa[program]),
+                              ifo->nr_of_vob_formats, info, &info_end)) {
+            table_end = MAX(table_end, info_end);
+        } else {
+            /* Leave the program empty, so other programs can still be extracted */
+            fprintf(stderr, "Warning: couldn't read the info for program %u\n",
+                    ifo->nr_of_programs+1);
+            free(info->vobus);
+            free(info->time_entries);
+            memset(info, 0, sizeof(*info));
+        }
+        info->pgi = pgi;
+        ifo->nr_of_programs++;
+    }
+    return table_end;
 }
 
-/* Filter redundant info */
-static bool disc_info_redundant(const char* info)
+/* Decode the entries of a group of stills. Return false if they're invalid. */
+static bool parse_ifo_still_group(const uint8_t* map, size_t map_size, size_t vogi_sa,
+                                  ifo_still_group_t* group)
 {
-    const char* info_exclude_list[] = {
-        "DVD VR",
-        "DVD-VR",
-        " ",
-        "" /* must be last */
-    };
-    const char** info_to_exclude = info_exclude_list;
-    while (**info_to_exclude) {
-        if (STREQ(info, *info_to_exclude)) {
-            return true;
+    const s_vogi_t* vogi = (const s_vogi_t*) ifo_data(map, map_size, vogi_sa, sizeof(s_vogi_t));
+    if (!vogi) {
+        return false;
+    }
+    uint16_t nr_of_stills = ntohs(vogi->nr_of_stills);
+    group->vob_offset = ntohl(vogi->vob_offset);
+    group->timestamp = vogi->timestamp;
+    group->stills = malloc(nr_of_stills * sizeof(ifo_still_t) + 1);
+    if (!group->stills) {
+        return false;
+    }
+    size_t offset = vogi_sa + sizeof(s_vogi_t);
+    for (group->nr_of_stills=0; group->nr_of_stills<nr_of_stills; group->nr_of_stills++) {
+        ifo_still_t* still = &group->stills[group->nr_of_stills];
+        const s_vob_ent_t* ent = (const s_vob_ent_t*) ifo_data(map, map_size, offset, sizeof(s_vob_ent_t));
+        if (!ent || !ent->video_sectors) {
+            return false;
+        }
+        offset += sizeof(s_vob_ent_t);
+        still->video_sectors = ntohs(ent->video_sectors);
+        still->audio_sectors = 0;
+        if ((ent->ent_type >> 6) == 1) {
+            const uint16_t* audio_sectors = (const uint16_t*)
+                ifo_data(map, map_size, offset, sizeof(uint16_t));
+            if (!audio_sectors) {
+                return false;
+            }
+            offset += sizeof(uint16_t);
+            still->audio_sectors = ntohs(*audio_sectors);
         }
-        info_to_exclude++;
     }
-    return false;
+    return true;
 }
 
-static void print_disc_info(rtav_vmgi_t* rtav_vmgi_ptr)
+/*
+The stills in VR_STILL.VRO are described by a table like the one for the
+programs in VR_MOVIE.VRO, with the VOB formats followed by groups of stills.
+Each group has the VRO offset of its first still, followed by the sizes of
+the video part, and of the optional audio part, of each still in turn.
+The layout is a guess based on that of the programs, so if it's not
+as expected the stills are ignored.
+*/
+static bool parse_ifo_stills(const uint8_t* map, size_t map_size, uint32_t s_avfit_sa, ifo_t* ifo)
 {
-    char* txt_local;
+    if (!s_avfit_sa) {
+        return true;
+    }
+    const s_avfiti_t* s_avfiti = (const s_avfiti_t*) ifo_data(map, map_size, s_avfit_sa, sizeof(s_avfiti_t));
+    if (!s_avfiti || !s_avfiti->nr_of_s_avfi) {
+        return true;
+    }
+    size_t offset = s_avfit_sa + sizeof(s_avfiti_t) + s_avfiti->nr_of_vob_formats * sizeof(s_vob_format_t);
+    const s_avfi_gi_t* s_avfi_gi = (const s_avfi_gi_t*) ifo_data(map, map_size, offset, sizeof(s_avfi_gi_t));
+    uint16_t nr_of_vogs = s_avfi_gi ? ntohs(s_avfi_gi->nr_of_vogs) : 0;
+    const uint32_t* vogi_sa = (const uint32_t*)
+        ifo_data(map, map_size, offset + sizeof(s_avfi_gi_t), nr_of_vogs * sizeof(uint32_t));
+    if (!nr_of_vogs) {
+        return true;
+    }
+    ifo->still_groups = calloc(nr_of_vogs, sizeof(ifo_still_group_t));
+    if (!ifo->still_groups) {
+        fprintf(stderr, "Error allocating space for stills\n");
+        return false;
+    }
+    ifo->nr_of_still_groups = nr_of_vogs;
+    unsigned int group;
+    for (group=0; vogi_sa && group<nr_of_vogs; group++) {
+        if (!parse_ifo_still_group(map, map_size, (size_t)s_avfit_sa + ntohl(vogi_sa[group]),
+                                   &ifo->still_groups[group])) {
+            break;
+        }
+    }
+    if (!vogi_sa || group < nr_of_vogs) {
+#ifndef NDEBUG
+        fprintf(stderr, "Warning: ignoring the stills, as they're not as expected\n");
+#endif//NDEBUG
+        for (group=0; group<nr_of_vogs; group++) {
+            free(ifo->still_groups[group].stills);
+        }
+        free(ifo->still_groups);
+        ifo->still_groups = NULL;
+        ifo->nr_of_still_groups = 0;
+    }
+    return true;
+}
 
-    txt_local = text_field_convert(rtav_vmgi_ptr->mat.disc_info2,
-                                   sizeof(rtav_vmgi_ptr->mat.disc_info2));
-    if (txt_local && *txt_local && !disc_info_redundant(txt_local)) {
-        fprintf(stdinfo, "info  : %s\n", txt_local);
+/* Decode the tables following the IFO header */
+static bool parse_ifo_tables(const uint8_t* map, size_t vmg_size, ifo_t* ifo)
+{
+    const rtav_vmgi_t* rtav_vmgi_ptr = (const rtav_vmgi_t*) map;
+    uint32_t pgit_sa = ntohl(rtav_vmgi_ptr->mat.pgit_sa);
+    uint32_t def_psi_sa = ntohl(rtav_vmgi_ptr->mat.def_psi_sa);
+    const pgiti_t* pgiti = (const pgiti_t*) ifo_data(map, vmg_size, pgit_sa, sizeof(pgiti_t));
+    const psi_gi_t* psi_gi = (const psi_gi_t*) ifo_data(map, vmg_size, def_psi_sa, sizeof(psi_gi_t));
+    if (!pgiti || !psi_gi) {
+        fprintf(stderr, "Error: IFO tables are beyond the end of the file\n");
+        return false;
+    }
+    ifo->pgit_ea = ntohl(pgiti->pgit_ea);
+    ifo->nr_of_pgi = pgiti->nr_of_pgi;
+    ifo->nr_of_vob_formats = pgiti->nr_of_vob_formats;
+    ifo->nr_of_psi = psi_gi->nr_of_psi;
+    ifo->nr_of_psi_programs = ntohs(psi_gi->nr_of_programs);
+
+    const psi_t* psi = (const psi_t*) ifo_data(map, vmg_size, def_psi_sa + sizeof(psi_gi_t),
+                                               ifo->nr_of_psi * sizeof(psi_t));
+    ifo->psis = malloc(ifo->nr_of_psi * sizeof(ifo_psi_t) + 1);
+    if (!psi || !ifo->psis) {
+        fprintf(stderr, "Error reading the program set info\n");
+        return false;
+    }
+    unsigned int ps;
+    for (ps=0; ps<ifo->nr_of_psi; ps++) {
+        memcpy(ifo->psis[ps].label, psi[ps].label, sizeof(ifo->psis[ps].label));
+        memcpy(ifo->psis[ps].title, psi[ps].title, sizeof(ifo->psis[ps].title));
+        ifo->psis[ps].nr_of_programs = ntohs(psi[ps].nr_of_programs);
+        ifo->psis[ps].first_prog_id = ntohs(psi[ps].first_prog_id);
+    }
+    if (!index_program_sets(ifo)) {
+        return false;
     }
-    free(txt_local);
 
-    if (strncmp(rtav_vmgi_ptr->mat.disc_info1,
-                rtav_vmgi_ptr->mat.disc_info2,
-                sizeof(rtav_vmgi_ptr->mat.disc_info1))) {
-        /* If there is a unique disc_info1 here, then there is
-         * no disc_info2 above on the discs I've seen so far */
-        txt_local = text_field_convert(rtav_vmgi_ptr->mat.disc_info1,
-                                    sizeof(rtav_vmgi_ptr->mat.disc_info1));
-        if (txt_local && *txt_local && !disc_info_redundant(txt_local)) {
-            fprintf(stdinfo, "info  : %s\n", txt_local);
+    if (ifo->nr_of_pgi == 0) {
+        return true; /* reported by the caller */
+    }
+
+    size_t offset = pgit_sa + sizeof(pgiti_t);
+    const vob_format_t* vob_format = (const vob_format_t*)
+        ifo_data(map, vmg_size, offset, ifo->nr_of_vob_formats * sizeof(vob_format_t));
+    ifo->vob_formats = malloc(ifo->nr_of_vob_formats * sizeof(ifo_vob_format_t) + 1);
+    if (!vob_format || !ifo->vob_formats) {
+        fprintf(stderr, "Error reading the VOB formats\n");
+        return false;
+    }
+    unsigned int vob_type;
+    for (vob_type=0; vob_type<ifo->nr_of_vob_formats; vob_type++) {
+        ifo_vob_format_t* format = &ifo->vob_formats[vob_type];
+        format->video_attr = ntohs(vob_format[vob_type].video_attr);
+        format->nr_of_audio_streams = vob_format[vob_type].nr_of_audio_streams;
+        format->audio_attr[0] = vob_format[vob_type].audio_attr0;
+        format->audio_attr[1] = vob_format[vob_type].audio_attr1;
+    }
+    offset += ifo->nr_of_vob_formats * sizeof(vob_format_t);
+
+    unsigned int pgi;
+    for (pgi=0; pgi<ifo->nr_of_pgi; pgi++) {
+        offset = parse_ifo_pgi(map, vmg_size, pgit_sa, offset, pgi, ifo);
+        if (!offset) {
+            if (!pgi) {
+                fprintf(stderr, "Error reading the program info\n");
+                return false;
+            }
+            fprintf(stderr, "Warning: couldn't read VRO info table %u\n", pgi+1);
+            ifo->nr_of_pgi = pgi;
+            break;
         }
-        free(txt_local);
     }
+    return parse_ifo_entry_points(map, vmg_size, def_psi_sa, ifo) &&
+           parse_ifo_playlists(map, vmg_size, ntohl(rtav_vmgi_ptr->mat.ud_pgcit_sa), ifo) &&
+           parse_ifo_stills(map, vmg_size, ntohl(rtav_vmgi_ptr->mat.s_avfit_sa), ifo);
 }
 
-static char* mb_clean_name(const char* src)
+/*********************************************************************************
+ * IFO cache
+ *********************************************************************************/
+
+/*
+Optionally cache the decoded IFO model in a directory (--cache), so that
+repeated runs over the same disc don't need to decode the IFO again.
+The cache file is named by a hash of the IFO data, so a changed IFO is
+never matched with a stale cache, and no other invalidation is needed.
+The file holds the ifo_t and each of its arrays in host order, with the
+sizes of the structures in the header, so that a cache written by a
+different build or platform is simply ignored and the IFO decoded instead.
+Note the text is cached as on the disc, as its conversion depends on the locale.
+As the cache directory may be shared, a loaded model is checked to have
+the array sizes and indices that decoding guarantees, and is otherwise
+ignored like any other mismatched cache.
+*/
+
+#define IFO_CACHE_MAGIC "DVDVRIFC"
+#define IFO_CACHE_VERSION 1
+
+typedef struct {
+    char     magic[8];
+    uint64_t hash;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t sizes[10];
+} ifo_cache_header_t;
+
+/* 64 bit FNV-1a */
+static uint64_t ifo_hash(const uint8_t* data, size_t len)
 {
-    size_t src_size = strlen (src) + 1;
-    wchar_t *str_wc = NULL;
-    size_t src_chars = mbstowcs (NULL, src, 0);
-    if (src_chars == (size_t) -1)
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    size_t i;
+    for (i=0; i<len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static void init_ifo_cache_header(ifo_cache_header_t* header, uint64_t hash)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, IFO_CACHE_MAGIC, sizeof(header->magic));
+    header->hash = hash;
+    header->version = IFO_CACHE_VERSION;
+    header->byte_order = 0x01020304;
+    header->sizes[0] = sizeof(ifo_t);
+    header->sizes[1] = sizeof(ifo_program_t);
+    header->sizes[2] = sizeof(ifo_vobu_t);
+    header->sizes[3] = sizeof(ifo_time_entry_t);
+    header->sizes[4] = sizeof(ifo_psi_t);
+    header->sizes[5] = sizeof(ifo_vob_format_t);
+    header->sizes[6] = sizeof(ifo_playlist_t);
+    header->sizes[7] = sizeof(ifo_cell_t);
+    header->sizes[8] = sizeof(ifo_still_group_t);
+    header->sizes[9] = sizeof(ifo_still_t);
+}
+
+static char* ifo_cache_name(const char* dir, uint64_t hash)
+{
+    size_t len = strlen(dir) + sizeof("/0123456789abcdef.ifo-cache");
+    char* name = malloc(len);
+    if (name) {
+        (void) snprintf(name, len, "%s/%016"PRIx64".ifo-cache", dir, hash);
+    }
+    return name;
+}
+
+/* Write a flag for whether the array is allocated, and then its data */
+static bool cache_write_array(FILE* cache, const void* data, size_t nmemb, size_t size)
+{
+    uint8_t present = data != NULL;
+    return fwrite(&present, 1, 1, cache) == 1 &&
+           (!present || !nmemb || fwrite(data, size, nmemb, cache) == nmemb);
+}
+
+/* Read an array written by cache_write_array(), clearing ok on error */
+static void* cache_read_array(FILE* cache, size_t nmemb, size_t size, bool* ok)
+{
+    uint8_t present;
+    if (!*ok || fread(&present, 1, 1, cache) != 1) {
+        *ok = false;
         return NULL;
-    src_chars += 1; /* make space for NUL */
-    str_wc = malloc (src_chars * sizeof (wchar_t));
-    if (str_wc == NULL)
+    }
+    if (!present) {
         return NULL;
-    if (mbstowcs (str_wc, src, src_chars) <= 0) {
-        free(str_wc);
+    }
+    void* data = malloc(nmemb * size + 1);
+    if (!data || (nmemb && fread(data, size, nmemb, cache) != nmemb)) {
+        free(data);
+        *ok = false;
         return NULL;
     }
-    str_wc[src_chars - 1] = L'\0';
+    return data;
+}
 
-    wchar_t* wc = str_wc;
-    while (*wc) {
-        size_t good = wcscspn(wc, L" /:?\\");
-        if (good)
-            wc+=good;
-        else
-            *wc++=L'-';
+/* Return whether a loaded model has the consistency that decoding the IFO ensures */
+static bool valid_ifo_model(const ifo_t* ifo)
+{
+    if ((ifo->nr_of_vob_formats && !ifo->vob_formats) || (ifo->nr_of_psi && !ifo->psis) ||
+        (ifo->nr_of_indexed_programs && !ifo->program_psis) ||
+        (ifo->nr_of_programs && !ifo->programs) || (ifo->nr_of_playlists && !ifo->playlists) ||
+        (ifo->nr_of_still_groups && !ifo->still_groups)) {
+        return false;
     }
 
-    char* newstr = malloc (src_size);
-    if (newstr == NULL) {
-        free(str_wc);
-        return NULL;
+    /* The program set index, as built by index_program_sets() */
+    uint32_t program_count = 0;
+    unsigned int i;
+    for (i=0; i<ifo->nr_of_psi; i++) {
+        if (ifo->psis[i].start_prog_num != MIN(program_count, UINT16_MAX) + 1) {
+            return false;
+        }
+        program_count += ifo->psis[i].nr_of_programs;
+    }
+    if (ifo->nr_of_indexed_programs != MIN(program_count, UINT16_MAX)) {
+        return false;
+    }
+    for (i=0; i<ifo->nr_of_indexed_programs; i++) {
+        if (ifo->program_psis[i] > ifo->nr_of_psi) {
+            return false;
+        }
     }
-    (void) wcstombs(newstr, str_wc, src_size);
-    free(str_wc);
 
-    return newstr;
+    for (i=0; i<ifo->nr_of_programs; i++) {
+        const ifo_program_t* program = &ifo->programs[i];
+        /* Programs that couldn't be decoded are left empty */
+        if (program->vob_format_id > ifo->nr_of_vob_formats ||
+            (!program->vob_format_id && program->nr_of_vobus) ||
+            program->pgi >= ifo->nr_of_pgi ||
+            (program->nr_of_vobus && !program->vobus) ||
+            (program->nr_of_entry_points && !program->entry_points)) {
+            return false;
+        }
+        unsigned int entry;
+        for (entry=0; program->time_entries && entry<program->nr_of_time_infos; entry++) {
+            if (program->time_entries[entry].vobu >= program->nr_of_vobus ||
+                (entry && program->time_entries[entry].vobu < program->time_entries[entry-1].vobu)) {
+                return false;
+            }
+        }
+        for (entry=1; entry<program->nr_of_entry_points; entry++) {
+            if ((uint32_t)(program->entry_points[entry] - program->start_ptm) <=
+                (uint32_t)(program->entry_points[entry-1] - program->start_ptm)) {
+                return false;
+            }
+        }
+    }
+
+    for (i=0; i<ifo->nr_of_playlists; i++) {
+        const ifo_playlist_t* playlist = &ifo->playlists[i];
+        if (playlist->nr_of_cells && !playlist->cells) {
+            return false;
+        }
+        unsigned int cell;
+        for (cell=0; cell<playlist->nr_of_cells; cell++) {
+            if (playlist->cells[cell].program >= ifo->nr_of_programs) {
+                return false;
+            }
+        }
+    }
+
+    for (i=0; i<ifo->nr_of_still_groups; i++) {
+        if (ifo->still_groups[i].nr_of_stills && !ifo->still_groups[i].stills) {
+            return false;
+        }
+    }
+    return true;
 }
 
-/* Must pass a string on the heap which may be modified inplace,
- * or may be reallocated. */
-static char* clean_name(char* src, bool mb_src)
+/* Load the cached model of the IFO with the given hash. Return false if unavailable. */
+static bool load_ifo_cache(const char* dir, uint64_t hash, ifo_t* ifo)
+{
+    char* name = ifo_cache_name(dir, hash);
+    FILE* cache = name ? fopen(name, "rb") : NULL;
+    free(name);
+    if (!cache) {
+        return false;
+    }
+    ifo_cache_header_t expected, header;
+    init_ifo_cache_header(&expected, hash);
+    bool ok = fread(&header, sizeof(header), 1, cache) == 1 &&
+              !memcmp(&header, &expected, sizeof(header)) &&
+              fread(ifo, sizeof(*ifo), 1, cache) == 1;
+    if (!ok) {
+        fclose(cache);
+        memset(ifo, 0, sizeof(*ifo));
+        return false;
+    }
+    /* The cached pointers are meaningless, so clear them before reading
+     * the arrays, so that free_ifo() is safe at any point */
+    ifo->vob_formats = NULL;
+    ifo->psis = NULL;
+    ifo->programs = NULL;
+    ifo->program_psis = NULL;
+    ifo->playlists = NULL;
+    ifo->still_groups = NULL;
+
+    ifo->vob_formats = cache_read_array(cache, ifo->nr_of_vob_formats, sizeof(ifo_vob_format_t), &ok);
+    ifo->psis = cache_read_array(cache, ifo->nr_of_psi, sizeof(ifo_psi_t), &ok);
+    ifo->program_psis = cache_read_array(cache, ifo->nr_of_indexed_programs, sizeof(uint8_t), &ok);
+    ifo->programs = cache_read_array(cache, ifo->nr_of_programs, sizeof(ifo_program_t), &ok);
+    unsigned int i;
+    for (i=0; ifo->programs && i<ifo->nr_of_programs; i++) {
+        ifo->programs[i].vobus = NULL;
+        ifo->programs[i].time_entries = NULL;
+        ifo->programs[i].entry_points = NULL;
+    }
+    for (i=0; ifo->programs && i<ifo->nr_of_programs; i++) {
+        ifo_program_t* program = &ifo->programs[i];
+        program->vobus = cache_read_array(cache, program->nr_of_vobus, sizeof(ifo_vobu_t), &ok);
+        program->time_entries = cache_read_array(cache, program->nr_of_time_infos,
+                                                 sizeof(ifo_time_entry_t), &ok);
+        program->entry_points = cache_read_array(cache, program->nr_of_entry_points,
+                                                 sizeof(uint32_t), &ok);
+    }
+    ifo->playlists = cache_read_array(cache, ifo->nr_of_playlists, sizeof(ifo_playlist_t), &ok);
+    for (i=0; ifo->playlists && i<ifo->nr_of_playlists; i++) {
+        ifo->playlists[i].cells = NULL;
+    }
+    for (i=0; ifo->playlists && i<ifo->nr_of_playlists; i++) {
+        ifo->playlists[i].cells = cache_read_array(cache, ifo->playlists[i].nr_of_cells,
+                                                   sizeof(ifo_cell_t), &ok);
+    }
+    ifo->still_groups = cache_read_array(cache, ifo->nr_of_still_groups, sizeof(ifo_still_group_t), &ok);
+    for (i=0; ifo->still_groups && i<ifo->nr_of_still_groups; i++) {
+        ifo->still_groups[i].stills = NULL;
+    }
+    for (i=0; ifo->still_groups && i<ifo->nr_of_still_groups; i++) {
+        ifo->still_groups[i].stills = cache_read_array(cache, ifo->still_groups[i].nr_of_stills,
+                                                       sizeof(ifo_still_t), &ok);
+    }
+    fclose(cache);
+    if (ok && !valid_ifo_model(ifo)) {
+        fprintf(stderr, "Warning: ignoring the inconsistent IFO cache\n");
+        ok = false;
+    }
+    if (!ok) {
+        free_ifo(ifo);
+        memset(ifo, 0, sizeof(*ifo));
+    }
+    return ok;
+}
+
+/* Save the model of the IFO with the given hash. Failure is only a warning. */
+static void save_ifo_cache(const char* dir, uint64_t hash, const ifo_t* ifo)
+{
+    char* name = ifo_cache_name(dir, hash);
+    if (!name) {
+        return;
+    }
+    /* Write to a temporary file, so concurrent runs never see a partial cache */
+    char tmp_name[strlen(name) + sizeof(".XXXXXX")];
+    (void) snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", name);
+    int fd = mkstemp(tmp_name);
+    if (fd != -1) {
+        mode_t mask = umask(0); /* mkstemp() uses 0600, but the cache can be shared */
+        umask(mask);
+        (void) fchmod(fd, 0666 & ~mask);
+    }
+    FILE* cache = fd != -1 ? fdopen(fd, "wb") : NULL;
+    if (!cache) {
+        fprintf(stderr, "Warning: couldn't write the IFO cache [%s] (%s)\n", tmp_name, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_name);
+        }
+        free(name);
+        return;
+    }
+    ifo_cache_header_t header;
+    init_ifo_cache_header(&header, hash);
+    bool ok = fwrite(&header, sizeof(header), 1, cache) == 1 &&
+              fwrite(ifo, sizeof(*ifo), 1, cache) == 1 &&
+              cache_write_array(cache, ifo->vob_formats, ifo->nr_of_vob_formats, sizeof(ifo_vob_format_t)) &&
+              cache_write_array(cache, ifo->psis, ifo->nr_of_psi, sizeof(ifo_psi_t)) &&
+              cache_write_array(cache, ifo->program_psis, ifo->nr_of_indexed_programs, sizeof(uint8_t)) &&
+              cache_write_array(cache, ifo->programs, ifo->nr_of_programs, sizeof(ifo_program_t));
+    unsigned int i;
+    for (i=0; ok && ifo->programs && i<ifo->nr_of_programs; i++) {
+        const ifo_program_t* program = &ifo->programs[i];
+        ok = cache_write_array(cache, program->vobus, program->nr_of_vobus, sizeof(ifo_vobu_t)) &&
+             cache_write_array(cache, program->time_entries, program->nr_of_time_infos,
+                               sizeof(ifo_time_entry_t)) &&
+             cache_write_array(cache, program->entry_points, program->nr_of_entry_points,
+                               sizeof(uint32_t));
+    }
+    ok = ok && cache_write_array(cache, ifo->playlists, ifo->nr_of_playlists, sizeof(ifo_playlist_t));
+    for (i=0; ok && ifo->playlists && i<ifo->nr_of_playlists; i++) {
+        ok = cache_write_array(cache, ifo->playlists[i].cells, ifo->playlists[i].nr_of_cells,
+                               sizeof(ifo_cell_t));
+    }
+    ok = ok && cache_write_array(cache, ifo->still_groups, ifo->nr_of_still_groups,
+                                 sizeof(ifo_still_group_t));
+    for (i=0; ok && ifo->still_groups && i<ifo->nr_of_still_groups; i++) {
+        ok = cache_write_array(cache, ifo->still_groups[i].stills, ifo->still_groups[i].nr_of_stills,
+                               sizeof(ifo_still_t));
+    }
+    if (fclose(cache) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp_name, name) == -1) {
+        fprintf(stderr, "Warning: couldn't write the IFO cache [%s] (%s)\n", name, strerror(errno));
+        unlink(tmp_name);
+    }
+    free(name);
+}
+
+/* Decode the IFO file, or load its model from any cache_dir.
+ * Return false on error, which has been reported. */
+static bool parse_ifo(const char* name, const char* cache_dir, ifo_t* ifo)
+{
+    memset(ifo, 0, sizeof(*ifo));
+
+    int fd=open(name,O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening [%s] (%s)\n", name, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error reading [%s] (%s)\n", name, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (st.st_size < (off_t)sizeof(rtav_vmgi_t)) {
+        fprintf(stderr, "invalid DVD-VR IFO size\n");
+        close(fd);
+        return false;
+    }
+
+    const rtav_vmgi_t* rtav_vmgi_ptr=mmap(0,sizeof(rtav_vmgi_t),PROT_READ,MAP_PRIVATE,fd,0);
+    if (rtav_vmgi_ptr == MAP_FAILED) {
+        fprintf(stderr, "Failed to MMAP ifo file (%s)\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    bool valid = !strncmp("DVD_RTR_VMG0",rtav_vmgi_ptr->mat.id,sizeof(rtav_vmgi_ptr->mat.id));
+    size_t vmg_size = (size_t)ntohl(rtav_vmgi_ptr->mat.vmg_ea) + 1;
+    if (munmap((void*)rtav_vmgi_ptr, sizeof(rtav_vmgi_t)) !=0) {
+        fprintf(stderr, "Failed to unmap ifo file (%s)\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (!valid) {
+        fprintf(stderr, "invalid DVD-VR IFO identifier\n");
+        close(fd);
+        return false;
+    }
+    /* Don't map past the end of the file, which would fault rather than fail */
+    if ((off_t)vmg_size > st.st_size) {
+        vmg_size = st.st_size;
+    }
+    if (vmg_size < sizeof(rtav_vmgi_t)) {
+        vmg_size = sizeof(rtav_vmgi_t);
+    }
+    const uint8_t* map=mmap(0,vmg_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to re MMAP ifo file (%s)\n", strerror(errno));
+        return false;
+    }
+    uint64_t hash = 0;
+    if (cache_dir) {
+        hash = ifo_hash(map, vmg_size);
+        if (load_ifo_cache(cache_dir, hash, ifo)) {
+#ifndef NDEBUG
+            fprintf(stderr, "Loaded the IFO model from the cache\n");
+#endif//NDEBUG
+            munmap((void*)map, vmg_size);
+            return true;
+        }
+    }
+    rtav_vmgi_ptr = (const rtav_vmgi_t*) map;
+    ifo->version = ntohs(rtav_vmgi_ptr->mat.version) & 0x00FF;
+    ifo->cprm_supported = rtav_vmgi_ptr->mat.cprm.supported;
+    ifo->txt_encoding = rtav_vmgi_ptr->mat.txt_encoding;
+    memcpy(ifo->disc_info1, rtav_vmgi_ptr->mat.disc_info1, sizeof(ifo->disc_info1));
+    memcpy(ifo->disc_info2, rtav_vmgi_ptr->mat.disc_info2, sizeof(ifo->disc_info2));
+
+    bool ret = parse_ifo_tables(map, vmg_size, ifo);
+    munmap((void*)map, vmg_size);
+    if (!ret) {
+        free_ifo(ifo);
+    } else if (cache_dir) {
+        save_ifo_cache(cache_dir, hash, ifo);
+    }
+    return ret;
+}
+
+static const char* parse_txt_encoding(uint8_t txt_encoding)
+{
+/* from the VideoTextDataUsage.pdf available at dvdforum.org we have:
+     01h : ISO 646
+     10h : JIS Roman[14]*and JIS Kanji1990[168]*
+     11h : ISO 8859-1
+     12h : JIS Roman[14]*and JIS Katakana[13]*including Shift JIS Kanji
+   Also Nero generates discs with 00h, so I'll assume this is ASCII.
+*/
+
+    const char* charset="Unknown";
+
+    switch (txt_encoding) {
+    case 0x00: charset="ASCII"; break;
+    case 0x01: charset="ISO646-JP"; break; /* ?? */
+    case 0x10: charset="JIS_C6220-1969-RO"; break; /* ?? */
+    case 0x11: charset="ISO_8859-1"; break;
+    case 0x12: charset="SHIFT_JIS"; break;
+    }
+
+    if (STREQ("Unknown", charset)) {
+        fprintf(stdinfo, "text encoding: %s", charset);
+        fprintf(stdinfo, ". (%02X). Please report this number and actual text encoding.\n", txt_encoding );
+        charset="ISO_8859-15"; /* Shouldn't give an error at least */
+    }
+
+    return charset;
+}
+
+
+static int get_audio_coding(audio_attr_t audio_attr)
+{
+    return (audio_attr.audio_attr[0] & 0xE0)>>5;
+}
+
+static int get_audio_channels(audio_attr_t audio_attr)
+{
+    int channels = (audio_attr.audio_attr[1] & 0x0F);
+    if (channels < 8) {
+        return channels+1;
+    } else if (channels == 9) {
+        return 2; /* mono */
+    }
+    return 0;
+}
+
+/* The first stream is reported as audio_..., and subsequent ones as audioN_... */
+static bool parse_audio_attr(audio_attr_t audio_attr0, int stream)
+{
+    int coding   = get_audio_coding(audio_attr0);
+    int channels = (audio_attr0.audio_attr[1] & 0x0F);
+    /* audio_attr0.audio_attr[2] = 7 for my camcorder. Is this 192Kbit? */
+    /* audio_attr0.audio_attr[2] = 9 for Masato Nunokawa's disc? */
+
+    char prefix[16] = "audio";
+    if (stream) {
+        (void) snprintf(prefix, sizeof(prefix), "audio%d", stream);
+    }
+    if (channels < 8) {
+        fprintf(stdinfo, "%s_channs: %d\n",prefix,channels+1);
+    } else if (channels == 9) {
+        /* According to Masato Nunokawa's disc */
+        fprintf(stdinfo, "%s_channs: 2 (mono)\n",prefix);
+    } else {
+        return false;
+    }
+
+    const char* coding_name="Unknown";
+    switch (coding) {
+    case AUDIO_AC3: coding_name="Dolby AC-3"; break;
+    case AUDIO_MPEG1: coding_name="MPEG-1"; break;
+    case AUDIO_MPEG2EXT: coding_name="MPEG-2ext"; break;
+    case AUDIO_LPCM: coding_name="Linear PCM"; break;
+    }
+    fprintf(stdinfo, "%s_coding: %s",prefix,coding_name);
+    if (STREQ("Unknown", coding_name)) {
+        fprintf(stdinfo, ". (%d). Please report this number and actual audio encoding.\n", coding );
+    } else {
+        putc('\n', stdinfo);
+    }
+
+    return true;
+}
+
+static bool parse_video_attr(uint16_t video_attr, p_video_attr_t* p_video_attr)
+{
+    int resolution  = (video_attr & 0x0038) >>  3;
+    int aspect      = (video_attr & 0x0C00) >> 10;
+    int tv_sys      = (video_attr & 0x3000) >> 12;
+    int compression = (video_attr & 0xC000) >> 14;
+
+    p_video_attr->aspect = p_video_attr->width = p_video_attr->height = -1;
+    p_video_attr->mpeg1 = (compression == 0);
+    p_video_attr->attr = video_attr;
+
+    int vert_resolution  = 0;
+    int horiz_resolution = 0;
+    const char* tv_system = "Unknown";
+    switch (tv_sys) {
+    case 0:
+        tv_system = "NTSC";
+        vert_resolution=480;
+        break;
+    case 1:
+        tv_system = "PAL";
+        vert_resolution=576;
+        break;
+    }
+    fprintf(stdinfo, "tv_system   : %s", tv_system);
+    if (STREQ("Unknown", tv_system)) {
+        fprintf(stdinfo, ". (%d). Please report this number and actual TV system.\n", tv_sys );
+    } else {
+        putc('\n', stdinfo);
+    }
+
+    switch (resolution) {
+    case 0: horiz_resolution=720; break;
+    case 1: horiz_resolution=704; break;
+    case 2: horiz_resolution=352; break;
+    case 3: horiz_resolution=352; vert_resolution/=2; break;
+    case 4: horiz_resolution=544; break; /* this is a google inspired guess. */
+    case 5: horiz_resolution=480; break; /* from Aaron Binns' disc */
+    }
+    if (horiz_resolution && vert_resolution) {
+        fprintf(stdinfo, "resolution  : %dx%d\n", horiz_resolution, vert_resolution);
+        p_video_attr->width = horiz_resolution;
+        p_video_attr->height = vert_resolution;
+    } else if (!horiz_resolution) {
+        fprintf(stdinfo, "resolution  : Unknown (%d). Please report this number and actual resolution.\n", resolution );
+    }
+
+    const char* aspect_ratio = "Unknown";
+    switch (aspect) {
+    case 0: aspect_ratio="4:3"; break;
+    case 1: aspect_ratio="16:9"; break;
+    }
+    fprintf(stdinfo, "aspect_ratio: %s", aspect_ratio );
+    if (STREQ("Unknown", aspect_ratio)) {
+        fprintf(stdinfo, ". (%d). Please report this number and actual aspect ratio.\n", aspect );
+    } else {
+        putc('\n', stdinfo);
+        p_video_attr->aspect = aspect + 2; /* DVD-Video aspect encoding */
+    }
+
+    const char* mode = "Unknown";
+    switch (compression) {
+    case 0: mode="MPEG1"; break;
+    case 1: mode="MPEG2"; break;
+    }
+    fprintf(stdinfo, "video_format: %s", mode );
+    if (STREQ("Unknown", mode)) {
+        p_video_attr->aspect = -1; /* Don't adjust aspect later for unknown formats */
+        fprintf(stdinfo, ". (%d). Please report this number and actual compression format.\n", compression );
+    } else {
+        putc('\n', stdinfo);
+    }
+
+    return true;
+}
+
+/* Decode a timestamp. Return false if it's not set. */
+static bool decode_pgtm(pgtm_t pgtm, struct tm* tm)
+{
+    uint16_t year  = ((pgtm.pgtm[0]       ) <<8 | (pgtm.pgtm[1]     )) >> 2;
+    uint8_t  month =  (pgtm.pgtm[1] & 0x03) <<2 | (pgtm.pgtm[2] >> 6);
+    uint8_t  day   =  (pgtm.pgtm[2] & 0x3E) >>1;
+    uint8_t  hour  =  (pgtm.pgtm[2] & 0x01) <<4 | (pgtm.pgtm[3] >> 4);
+    uint8_t  min   =  (pgtm.pgtm[3] & 0x0F) <<2 | (pgtm.pgtm[4] >> 6);
+    uint8_t  sec   =  (pgtm.pgtm[4] & 0x3F);
+    if (year) {
+        tm->tm_year=year-1900;
+        tm->tm_mon=month-1;
+        tm->tm_mday=day;
+        tm->tm_hour=hour;
+        tm->tm_min=min;
+        tm->tm_sec=sec;
+        tm->tm_isdst=-1; /*Auto calc DST offset.*/
+    }
+    return year;
+}
+
+static bool parse_pgtm(pgtm_t pgtm, struct tm* tm)
+{
+    bool ret=false;
+
+    if (decode_pgtm(pgtm, tm)) {
+        char date_str[32];
+        strftime(date_str,sizeof(date_str),"%F %T",tm); //locale = %x %X
+        fprintf(stdinfo, "date : %s\n",date_str);
+        ret=true;
+    } else {
+        fprintf(stdinfo, "date : not set\n");
+    }
+    return ret;
+}
+
+#ifndef NDEBUG
+static void print_psi(const ifo_t* ifo)
+{
+    putc('\n', stdinfo);
+    int ps;
+    for (ps=0; ps<ifo->nr_of_psi; ps++) {
+        const ifo_psi_t *psi = &ifo->psis[ps];
+
+        uint16_t first_prog_num = psi->first_prog_id; /* assuming this is first to play? */
+        uint16_t start_prog_num = psi->start_prog_num;
+        uint16_t num_progs_in_set = psi->nr_of_programs;
+        fprintf(stdinfo, "Programs in Program set %d:", ps+1);
+        int program_id;
+        for (program_id = start_prog_num;
+             program_id < start_prog_num+num_progs_in_set;
+             program_id++) {
+            const char* fmt = (program_id==first_prog_num ? " (%d)" : " %d");
+            fprintf(stdinfo, fmt, program_id);
+        }
+        putc('\n', stdinfo);
+    }
+    putc('\n', stdinfo);
+}
+#endif//NDEBUG
+
+/*
+ * FIXME: This assumes the programs occur linearly within
+ * the default program sets. This has been accurate for all
+ * discs I've seen so far at least. Note I've noticed a
+ * couple of "SONY_MOBILE" discs with no labels at all.
+ */
+static const ifo_psi_t* find_program_text_info(const ifo_t* ifo, int program)
+{
+    /* TODO: Perhaps have an option to merge all programs
+       in a program set to a vob using this info. That would assume
+       though that the programs were adjacent.
+       Perhaps I should name the programs label.ps_id(001) when > 1 ps. */
+    if (program < 1 || (uint32_t)program > ifo->nr_of_indexed_programs) {
+        return (const ifo_psi_t*)NULL;
+    }
+    uint8_t ps = ifo->program_psis[program-1];
+    return ps ? &ifo->psis[ps-1] : (const ifo_psi_t*)NULL;
+}
+
+/*
+ * This function controls the storage used by the actual
+ * encoding conversion routines. Note a len must be passed
+ * since the text fields are sometimes not NUL terminated.
+ *
+ * A string in to_charset is returned which must be free()
+ */
+static char* text_field_convert_to(const char* field, unsigned int len, const char* to_charset)
+{
+    unsigned int conv_max_len=len*MB_LEN_MAX+1/*NUL*/;
+    char* field_local=malloc(conv_max_len);
+    if (!field_local) {
+        fprintf(stderr, "Error allocating space for text conversion\n");
+        return NULL;
+    }
+    if (*field) {
+        char field_copy[len+1]; /* Copy as may not be NUL terminated */
+        field_copy[len] = '\0';
+        (void) strncpy(field_copy, field, len);
+        size_t srclen = strlen(field_copy) + 1; /* convert NUL also */
+        if (!text_convert(field_copy, srclen, field_local, conv_max_len, disc_charset, to_charset)) {
+            free(field_local);
+            field_local=NULL;
+        }
+    } else {
+        *field_local='\0';
+    }
+
+    return field_local;
+}
+
+/* As above, returning a string in the local encoding */
+static char* text_field_convert(const char* field, unsigned int len)
+{
+    return text_field_convert_to(field, len, sys_charset);
+}
+
+/* Filter redundant info */
+static bool disc_info_redundant(const char* info)
+{
+    const char* info_exclude_list[] = {
+        "DVD VR",
+        "DVD-VR",
+        " ",
+        "" /* must be last */
+    };
+    const char** info_to_exclude = info_exclude_list;
+    while (**info_to_exclude) {
+        if (STREQ(info, *info_to_exclude)) {
+            return true;
+        }
+        info_to_exclude++;
+    }
+    return false;
+}
+
+static void print_disc_info(const ifo_t* ifo)
+{
+    char* txt_local;
+
+    txt_local = text_field_convert(ifo->disc_info2, sizeof(ifo->disc_info2));
+    if (txt_local && *txt_local && !disc_info_redundant(txt_local)) {
+        fprintf(stdinfo, "info  : %s\n", txt_local);
+    }
+    free(txt_local);
+
+    if (strncmp(ifo->disc_info1, ifo->disc_info2, sizeof(ifo->disc_info1))) {
+        /* If there is a unique disc_info1 here, then there is
+         * no disc_info2 above on the discs I've seen so far */
+        txt_local = text_field_convert(ifo->disc_info1, sizeof(ifo->disc_info1));
+        if (txt_local && *txt_local && !disc_info_redundant(txt_local)) {
+            fprintf(stdinfo, "info  : %s\n", txt_local);
+        }
+        free(txt_local);
+    }
+}
+
+static char* mb_clean_name(const char* src)
+{
+    size_t src_size = strlen (src) + 1;
+    wchar_t *str_wc = NULL;
+    size_t src_chars = mbstowcs (NULL, src, 0);
+    if (src_chars == (size_t) -1)
+        return NULL;
+    src_chars += 1; /* make space for NUL */
+    str_wc = malloc (src_chars * sizeof (wchar_t));
+    if (str_wc == NULL)
+        return NULL;
+    if (mbstowcs (str_wc, src, src_chars) <= 0) {
+        free(str_wc);
+        return NULL;
+    }
+    str_wc[src_chars - 1] = L'\0';
+
+    wchar_t* wc = str_wc;
+    while (*wc) {
+        size_t good = wcscspn(wc, L" /:?\\");
+        if (good)
+            wc+=good;
+        else
+            *wc++=L'-';
+    }
+
+    char* newstr = malloc (src_size);
+    if (newstr == NULL) {
+        free(str_wc);
+        return NULL;
+    }
+    (void) wcstombs(newstr, str_wc, src_size);
+    free(str_wc);
+
+    return newstr;
+}
+
+/* Must pass a string on the heap which may be modified inplace,
+ * or may be reallocated. */
+static char* clean_name(char* src, bool mb_src)
+{
+    if (mb_src && (MB_CUR_MAX > 1)) {
+        char* cleaned = mb_clean_name(src);
+        free(src);
+        return cleaned;
+    }
+
+    char* c = src;
+    while (*c) {
+        size_t good = strcspn(c, " /:?\\");
+        if (good)
+            c+=good;
+        else
+            *c++='-';
+    }
+    return src;
+}
+
+static char* get_label_base(const ifo_psi_t* psi)
+{
+    char* title_local = text_field_convert(psi->title, sizeof(psi->title));
+    if (title_local && *title_local &&
+        strncmp(title_local, psi->label, sizeof(psi->label))) { /* if title != label */
+        title_local = clean_name(title_local, true);
+        if (!title_local) {
+          fprintf(stderr, "Error generating file name from title\n");
+          return NULL;
+        } else {
+          return title_local;
+        }
+    }
+    free(title_local);
+
+    const char* label=psi->label; /* ASCII */
+    if (*label && !STREQ(label, " ")) {
+        char* label_local = my_strndup(label, sizeof(psi->label));
+        label_local = clean_name(label_local, false);
+        return label_local;
+    }
+
+    return NULL;
+}
+
+static void print_label(const ifo_psi_t* psi)
+{
+    const char* label=psi->label; /* ASCII */
+
+    char* title_local = text_field_convert(psi->title, sizeof(psi->title));
+    if (title_local && *title_local &&
+        strncmp(title_local, label, sizeof(psi->label))) { /* if title != label */
+        fprintf(stdinfo, "title: %s\n", title_local);
+    }
+    free(title_local);
+
+    if (*label && !STREQ(label, " ")) {
+        fprintf(stdinfo, "label: %.*s\n", (int)sizeof(psi->label), label);
+    }
+}
+
+/*********************************************************************************
+ * MPEG2 processing routines
+ *********************************************************************************/
+
+/*
+This is to both apply the aspect ratio from the IFO to the sequence header (0xB3)
+and to reset the size of any sequence display extension packets (0xB5) to
+the size of the video, as processing of this is not handled well by players.
+
+For e.g., for 16:9 recordings my camcorder leaves the aspect in the sequence
+header at 4:3 but sets the pan scan width and height appropriately in the
+sequence display extension. ffmpeg for a short time used this to compute the
+aspect, but because many MPEG streams incorrectly set the pan scan widths and
+heights, it was changed back to ignoring these when determining the aspect ratio.
+See: http://svn.ffmpeg.org/ffmpeg?view=rev&revision=15183
+Specifically for widescreen PAL movies my DVD-VR camcorder set:
+  aspect = 2 (4:3)
+  width x height = 720 x 576
+  pan scan width x height = 540 x 576
+*/
+
+#define MPEG_HEADER_LEN 4
+#define SEQUENCE_ID 0xB3
+#define SEQUENCE_EXTENSION_ID 0xB5
+#define GOP_ID 0xB8
+#define PICTURE_ID 0x00
+#define VIDEO_STREAM_0 0xE0 /* I've only seen E0 on dvd-vr discs (E0-F possible) */
+#define SEQUENCE_LEN 4 /* length of data we need to parse from sequence packet */
+#define SEQUENCE_EXTENSION_LEN 5 /* length of data we need to parse from sequence extension packet */
+#define VIDEO_STREAM_LEN 3 /* length of data we need to parse from video stream packet */
+
+/* Return offset to header or -1 if not found */
+static int find_mpeg_header(const uint8_t* buf, const unsigned int bs, const uint8_t type)
+{
+    unsigned int offset=0;
+    uint32_t header = 0x00000100 + type;
+    NTOHL(header);
+    while (offset <= bs - sizeof (header)) {
+        if (*(uint32_t*)(buf+offset) == header)
+            return offset;
+        offset++;
+    }
+    return -1;
+}
+
+/*
+ * MPEG headers may be split across PES packets, and so across sectors.
+ * Therefore we parse the PES packets in each pack, and pass the video payload
+ * through a scanner that maintains its state between calls. The callback is
+ * passed each byte of the headers it's interested in, in place in the buffer,
+ * so that fields straddling sectors can be modified as they pass through.
+ */
+
+#define PACK_ID 0xBA
+#define SYSTEM_HEADER_ID 0xBB
+#define PRIVATE_STREAM_1 0xBD /* AC-3 etc. audio */
+#define PADDING_STREAM 0xBE
+#define PRIVATE_STREAM_2 0xBF /* RDI or NAV data */
+
+typedef void (*pes_func_t)(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                           unsigned int header_len, void* context);
+
+/* Return the length of the PES header including optional fields, or 0 if invalid */
+static unsigned int pes_header_len(const uint8_t* pes, const unsigned int pes_len)
+{
+    uint8_t stream_id = pes[3];
+    if (stream_id == PADDING_STREAM || stream_id == PRIVATE_STREAM_2) {
+        return MPEG_HEADER_LEN + 2;
+    }
+    if (pes_len < MPEG_HEADER_LEN + 5) {
+        return 0;
+    }
+    unsigned int len;
+    if ((pes[6] & 0xC0) == 0x80) { /* MPEG2 */
+        len = MPEG_HEADER_LEN + 5 + pes[8];
+    } else { /* MPEG1 */
+        len = MPEG_HEADER_LEN + 2;
+        while (len < pes_len && pes[len] == 0xFF) len++; /* stuffing */
+        if (len < pes_len && (pes[len] & 0xC0) == 0x40) len += 2; /* STD buffer */
+        if (len >= pes_len) return 0;
+        if ((pes[len] & 0xF0) == 0x20) len += 5;       /* PTS */
+        else if ((pes[len] & 0xF0) == 0x30) len += 10; /* PTS & DTS */
+        else len++;
+    }
+    return len <= pes_len ? len : 0;
+}
+
+static bool pes_scrambled(const uint8_t* pes)
+{
+    /* extension header is always available for 0xBD and 0xE? types */
+    return ((pes[6] & 0xC0) == 0x80) && (pes[6] & 0x30);
+}
+
+/* MPEG timestamps are 33 bit counts of a 90KHz clock */
+#define MPEG_TIME_MASK 0x1FFFFFFFFULL
+
+/* Get a PTS or DTS field */
+static uint64_t get_timestamp(const uint8_t* ts)
+{
+    return ((uint64_t)(ts[0] & 0x0E) << 29) | (ts[1] << 22) | ((ts[2] & 0xFE) << 14) |
+           (ts[3] << 7) | (ts[4] >> 1);
+}
+
+/* Set a PTS or DTS field, preserving the prefix bits */
+static void set_timestamp(uint8_t* ts, uint64_t time)
+{
+    ts[0] = (ts[0] & 0xF1) | ((time >> 29) & 0x0E);
+    ts[1] = time >> 22;
+    ts[2] = ((time >> 14) & 0xFE) | 0x01;
+    ts[3] = time >> 7;
+    ts[4] = ((time << 1) & 0xFE) | 0x01;
+}
+
+/* Get the SCR base from an MPEG2 pack header */
+static uint64_t get_scr(const uint8_t* pack)
+{
+    return ((uint64_t)(pack[4] & 0x38) << 27) | ((uint64_t)(pack[4] & 0x03) << 28) |
+           (pack[5] << 20) | ((pack[6] & 0xF8) << 12) | ((pack[6] & 0x03) << 13) |
+           (pack[7] << 5) | (pack[8] >> 3);
+}
+
+/* Set the SCR base in an MPEG2 pack header, preserving the extension */
+static void set_scr(uint8_t* pack, uint64_t scr)
+{
+    pack[4] = (pack[4] & 0xC4) | ((scr >> 27) & 0x38) | ((scr >> 28) & 0x03);
+    pack[5] = scr >> 20;
+    pack[6] = ((scr >> 12) & 0xF8) | 0x04 | ((scr >> 13) & 0x03);
+    pack[7] = scr >> 5;
+    pack[8] = ((scr << 3) & 0xF8) | (pack[8] & 0x07);
+}
+
+/* Return the PTS of the PES packet, or -1 if not present */
+static int64_t get_pes_pts(const uint8_t* pes, const unsigned int header_len)
+{
+    if ((pes[6] & 0xC0) != 0x80 || !(pes[7] & 0x80) || header_len < MPEG_HEADER_LEN + 10) {
+        return -1;
+    }
+    return get_timestamp(pes + MPEG_HEADER_LEN + 5);
+}
+
+/* Call pes_func for each PES packet in the pack */
+static void walk_pack(uint8_t* buf, const unsigned int bs, pes_func_t pes_func, void* context)
+{
+    if (bs < 14 || find_mpeg_header(buf, MPEG_HEADER_LEN, PACK_ID) != 0) {
+        return;
+    }
+    unsigned int offset;
+    if ((buf[4] & 0xC0) == 0x40) { /* MPEG2 */
+        offset = 14 + (buf[13] & 0x07);
+    } else {                       /* MPEG1 */
+        offset = 12;
+    }
+    while (offset + MPEG_HEADER_LEN + 2 <= bs) {
+        uint8_t* pes = buf + offset;
+        if (pes[0] || pes[1] || pes[2] != 0x01 || pes[3] < SYSTEM_HEADER_ID) {
+            break;
+        }
+        unsigned int pes_len = MPEG_HEADER_LEN + 2 + (pes[4] << 8 | pes[5]);
+        if (offset + pes_len > bs) {
+            break;
+        }
+        if (pes[3] != SYSTEM_HEADER_ID) {
+            unsigned int header_len = pes_header_len(pes, pes_len);
+            if (header_len) {
+                pes_func(pes[3], pes, pes_len, header_len, context);
+            }
+        }
+        offset += pes_len;
+    }
+}
+
+/* Called with pos==3 for the start code itself, returning whether the subsequent
+ * bytes of this header are wanted. Thereafter it's called for each subsequent byte,
+ * until it returns false or another start code is found. */
+typedef bool (*es_header_func_t)(uint8_t code, unsigned int pos, uint8_t* byte, void* context);
+
+typedef struct {
+    uint32_t     last;  /* last bytes seen, to find start codes split across buffers */
+    unsigned int pos;   /* offset within the current header */
+    int          code;  /* header being passed to the callback, or -1 */
+} es_scanner_t;
+
+static void init_es_scanner(es_scanner_t* scanner)
+{
+    scanner->last = 0xFFFFFFFF;
+    scanner->pos = 0;
+    scanner->code = -1;
+}
+
+static uint32_t shift_in(uint32_t last, const uint8_t* data, unsigned int start, unsigned int end)
+{
+    if (end - start > 3) {
+        start = end - 3;
+    }
+    while (start < end) {
+        last = (last << 8) | data[start++];
+    }
+    return last;
+}
+
+static void es_scan(es_scanner_t* scanner, uint8_t* data, const unsigned int len,
+                    es_header_func_t header_func, void* context)
+{
+    uint32_t last = scanner->last;
+    unsigned int i;
+    for (i=0; i<len; i++) {
+        bool start_code = (last & 0x00FFFFFF) == 0x000001;
+        if (!start_code && scanner->code < 0) {
+            /* skip quickly to the byte after the next 0x01 */
+            const uint8_t* one = memchr(data+i, 0x01, len-i);
+            unsigned int end = one ? (unsigned int)(one - data) + 1 : len;
+            last = shift_in(last, data, i, end);
+            i = end - 1;
+            continue;
+        }
+        uint8_t byte = data[i]; /* the callback may modify data[i] */
+        if (start_code) {
+            scanner->code = byte;
+            scanner->pos = 3;
+        } else {
+            scanner->pos++;
+        }
+        if (!header_func(scanner->code, scanner->pos, data+i, context)) {
+            scanner->code = -1;
+        }
+        last = (last << 8) | byte;
+    }
+    scanner->last = last;
+}
+
+typedef struct {
+    const uint8_t* buf;             /* current sector, for debugging */
+    es_scanner_t   scanner;
+    p_video_attr_t ifo_video_attr;
+    int            sector;
+    unsigned int   sde_skip;        /* optional colour description length */
+    uint8_t        display_size[4]; /* original sizes, for debugging */
+    bool           in_sequence;     /* passing sequence header and extensions */
+    bool           sequence_done;   /* finished a sequence header in this sector */
+    uint8_t        unused[6];
+} mpeg2_fix_t;
+static mpeg2_fix_t mpeg2_fix;
+
+/* reset cached values for each program */
+static void init_mpeg2_cache(void)
+{
+    init_es_scanner(&mpeg2_fix.scanner);
+    mpeg2_fix.in_sequence = false;
+}
+
+#ifndef NDEBUG
+static void print_sde_sizes(const char* what, const mpeg2_fix_t* fix, const uint8_t* byte,
+                            const uint8_t* display_size)
+{
+    uint16_t horiz_disp_size  = display_size[0] << 6;
+             horiz_disp_size += display_size[1] >> 2;
+    uint16_t vert_disp_size   = (display_size[1] & 0x01) << 13;
+             vert_disp_size  += display_size[2] << 5;
+             vert_disp_size  += display_size[3] >> 3;
+    fprintf(stdinfo, "%s SDE @ %d+%d (%d x %d)\n", what, fix->sector, (int)(byte - fix->buf),
+            horiz_disp_size, vert_disp_size);
+}
+#endif
+
+/* Set the aspect in sequence headers, and the sizes in sequence display extensions */
+static bool fix_mpeg2_header(uint8_t code, unsigned int pos, uint8_t* byte, void* context)
+{
+    mpeg2_fix_t* fix = context;
+
+    if (pos == MPEG_HEADER_LEN - 1) {
+        if (code == SEQUENCE_ID) {
+            fix->in_sequence = true;
+            return true;
+        } else if (!fix->in_sequence) {
+            return false;
+        } else if (code == SEQUENCE_EXTENSION_ID) {
+            return true;
+        } else if (code == GOP_ID || code == PICTURE_ID) { /* end of sequence extensions */
+            fix->in_sequence = false;
+            fix->sequence_done = true;
+        }
+        return false;
+    }
+
+    if (code == SEQUENCE_ID) {
+        if (pos < MPEG_HEADER_LEN + 3) {
+            return true;
+        }
+#ifndef NDEBUG
+        fprintf(stdinfo,"Found SH  @ %d+%d\n", fix->sector, (int)(byte - fix->buf) - (MPEG_HEADER_LEN + 3));
+#endif
+        *byte = (*byte & 0x0F) | ((uint8_t) fix->ifo_video_attr.aspect) << 4;
+        return false;
+    }
+
+    /* sequence extension */
+    if (pos == MPEG_HEADER_LEN) {
+        if ((*byte & 0xF0) != 0x20) {
+#ifndef NDEBUG
+            fprintf(stdinfo, "Found SE  @ %d+%d (type=%d)\n", fix->sector,
+                    (int)(byte - fix->buf) - MPEG_HEADER_LEN, (*byte & 0xF0) >> 4);
+#endif
+            return false;
+        }
+        if (fix->ifo_video_attr.width <= 0 || fix->ifo_video_attr.height <= 0) {
+            return false;
+        }
+        fix->sde_skip = (*byte & 0x01) ? 3 : 0;
+        return true;
+    }
+    if (pos < MPEG_HEADER_LEN + 1 + fix->sde_skip) {
+        return true;
+    }
+
+    uint16_t horiz_disp_size = fix->ifo_video_attr.width;
+    uint16_t vert_disp_size = fix->ifo_video_attr.height;
+    unsigned int index = pos - (MPEG_HEADER_LEN + 1 + fix->sde_skip);
+    fix->display_size[index] = *byte;
+    switch (index) {
+    case 0: *byte = horiz_disp_size >> 6; break;
+    case 1: *byte = ((horiz_disp_size << 2) & 0xFC) | 0x02 | ((vert_disp_size >> 13) & 0x01); break;
+    case 2: *byte = vert_disp_size >> 5; break;
+    case 3: *byte = vert_disp_size << 3; break;
+    }
+    if (index < 3) {
+        return true;
+    }
+#ifndef NDEBUG
+    const uint8_t new_display_size[4] = { horiz_disp_size >> 6,
+        ((horiz_disp_size << 2) & 0xFC) | 0x02 | ((vert_disp_size >> 13) & 0x01),
+        vert_disp_size >> 5, vert_disp_size << 3 };
+    const uint8_t* sde = byte - index - fix->sde_skip - (MPEG_HEADER_LEN + 1);
+    print_sde_sizes("Found", fix, sde, fix->display_size);
+    print_sde_sizes("New  ", fix, sde, new_display_size);
+#endif
+    return false;
+}
+
+static void fix_mpeg2_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                          unsigned int header_len, void* context)
+{
+    mpeg2_fix_t* fix = context;
+    if (stream_id != VIDEO_STREAM_0) {
+        return;
+    }
+    if (pes_scrambled(pes)) {
+        init_es_scanner(&fix->scanner); /* don't look for headers in encrypted data */
+        return;
+    }
+    es_scan(&fix->scanner, pes + header_len, pes_len - header_len, fix_mpeg2_header, fix);
+}
+
+static void check_mpeg_encryption(uint8_t* buf, const unsigned int bs, const unsigned int program)
+{
+    /* Note we'll warn below if we've not seen any video stream (E0 doesn't match).
+     * Note also I've only seen AC-3 audio on 0xBD and it has also been
+     * encrypted on discs I've seen.  */
+    if (ifo_program_attrs[program].scrambled != PARTIALLY_SCRAMBLED) {
+        int pes_offset = find_mpeg_header(buf, bs-VIDEO_STREAM_LEN, VIDEO_STREAM_0);
+        if (pes_offset >= 0) {
+            /* extension header is always available for 0xBD and 0xE? types */
+            uint8_t scramble_byte = *(buf + pes_offset + MPEG_HEADER_LEN + 2);
+            bool scrambled;
+            if ((scramble_byte & 0xC0) == 0x80) { /* MPEG2 */
+                scrambled = scramble_byte & 0x30;
+            } else {
+                scrambled = false; /* assuming MPEG1 doesn't support encryption */
+            }
+            if (ifo_program_attrs[program].scrambled != SCRAMBLED_UNSET &&
+                ifo_program_attrs[program].scrambled != scrambled) {
+                ifo_program_attrs[program].scrambled = PARTIALLY_SCRAMBLED;
+            } else {
+                ifo_program_attrs[program].scrambled = scrambled;
+            }
+        }
+    }
+}
+
+/* Return true if a sequence header and its extensions were completed in this sector */
+static bool fix_mpeg2_aspect(uint8_t* buf, const unsigned int bs, const unsigned int program)
+{
+    p_video_attr_t ifo_video_attr = ifo_video_attrs[ifo_program_attrs[program].video_attr];
+    if (ifo_video_attr.aspect < 2) {
+        mpeg2_fix.sector++;
+        return false;
+    }
+
+    mpeg2_fix.ifo_video_attr = ifo_video_attr;
+    mpeg2_fix.buf = buf;
+    mpeg2_fix.sequence_done = false;
+    walk_pack(buf, bs, fix_mpeg2_pes, &mpeg2_fix);
+
+    mpeg2_fix.sector++;
+    return mpeg2_fix.sequence_done;
+}
+
+/*
+Rebase the SCR in each pack header and the PTS and DTS in each PES header,
+so that each program starts at 0, and the timestamps are continuous across
+any data skipped within the program, or jumps within the stream.
+*/
+
+#define MAX_SCR_GAP 90000 /* consider jumps of more than 1s in the SCR discontinuous */
+
+typedef struct {
+    uint64_t origin;        /* input time mapped to 0 */
+    uint64_t last_scr;      /* last input SCR */
+    uint64_t last_gap;      /* last increase in the SCR between packs */
+    uint32_t start_ptm;     /* video start time from the IFO */
+    bool     enabled;
+    bool     started;
+    bool     discontinuity; /* data skipped since the last pack */
+    uint8_t  unused;
+} time_rebase_t;
+static time_rebase_t time_rebase;
+
+/* reset for each program */
+static void init_time_rebase(bool enabled, uint32_t start_ptm)
+{
+    time_rebase.enabled = enabled;
+    time_rebase.start_ptm = start_ptm;
+    time_rebase.started = false;
+    time_rebase.discontinuity = false;
+    time_rebase.last_gap = 0;
+}
+
+/* Note that data was skipped, so the next pack should continue from the last */
+static void mark_time_discontinuity(void)
+{
+    time_rebase.discontinuity = true;
+}
+
+static void rebase_pes_time(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                            unsigned int header_len, void* context)
+{
+    const time_rebase_t* rebase = context;
+    (void) stream_id; (void) pes_len;
+    if ((pes[6] & 0xC0) != 0x80) {
+        return; /* Padding, private stream 2 or MPEG1 */
+    }
+    uint8_t pts_dts_flags = pes[7] & 0xC0;
+    uint8_t* ts = pes + MPEG_HEADER_LEN + 5;
+    if ((pts_dts_flags & 0x80) && header_len >= MPEG_HEADER_LEN + 10) {
+        set_timestamp(ts, (get_timestamp(ts) - rebase->origin) & MPEG_TIME_MASK);
+    }
+    if (pts_dts_flags == 0xC0 && header_len >= MPEG_HEADER_LEN + 15) {
+        ts += 5;
+        set_timestamp(ts, (get_timestamp(ts) - rebase->origin) & MPEG_TIME_MASK);
+    }
+}
+
+static void rebase_mpeg2_time(uint8_t* buf, const unsigned int bs)
+{
+    if (!time_rebase.enabled) {
+        return;
+    }
+    if (bs < 14 || find_mpeg_header(buf, MPEG_HEADER_LEN, PACK_ID) != 0 ||
+        (buf[4] & 0xC0) != 0x40) {
+        return; /* only MPEG2 packs supported */
+    }
+
+    uint64_t scr = get_scr(buf);
+    if (!time_rebase.started) {
+        /* Start at the first SCR, but ensure the video start is not negative */
+        time_rebase.origin = scr;
+        if (((time_rebase.start_ptm - scr) & MPEG_TIME_MASK) > MPEG_TIME_MASK/2) {
+            time_rebase.origin = time_rebase.start_ptm;
+        }
+        time_rebase.started = true;
+    } else {
+        uint64_t gap = (scr - time_rebase.last_scr) & MPEG_TIME_MASK;
+        if (time_rebase.discontinuity || gap > MAX_SCR_GAP) {
+            /* continue on from the last pack output */
+            time_rebase.origin += gap - time_rebase.last_gap;
+            time_rebase.discontinuity = false;
+        } else {
+            time_rebase.last_gap = gap;
+        }
+    }
+    time_rebase.last_scr = scr;
+
+    set_scr(buf, (scr - time_rebase.origin) & MPEG_TIME_MASK);
+    walk_pack(buf, bs, rebase_pes_time, &time_rebase);
+}
+
+/*
+Convert the RDI pack at the start of each VOBU to a DVD-Video NAV pack
+(a PCI and DSI packet), so that players can seek and scan within the VOB.
+The VOBU search pointers in the DSI reference VOBUs up to 2 minutes
+either side, so the whole VOBU map for the program is parsed beforehand.
+Also see: http://forum.doom9.org/archive/index.php/t-102969.html
+Note code there makes incorrect assumptions about offsets I think.
+
+The IFO doesn't store the start time of each VOBU, but the bits above
+the size in each VOBU entry seem to be the duration of the VOBU in video fields,
+so these are used to apportion the program duration for the search pointers.
+VOBUs are assumed to be of equal duration if these are not present.
+The rest of the NAV pack is taken from the video of the VOBU itself,
+so each VOBU (at most 1023 sectors) is held in memory until it's complete.
+Its start and end times are those of the first and last pictures displayed,
+and the end sectors of its first 3 reference (I or P) pictures are noted
+for players to scan using only those. The IFO estimate is used for VOBUs
+whose video can't be parsed, as when encrypted or not read completely.
+*/
+
+#define NAV_PCI_LEN 0x3D4     /* PCI PES packet length */
+#define NAV_DSI_LEN 0x3FA     /* DSI PES packet length */
+#define NAV_PCI_OFFSET 0x2D   /* PCI data offset in the NAV pack */
+#define NAV_DSI_OFFSET 0x407  /* DSI data offset in the NAV pack */
+#define NAV_VOBU_SRI 0xEA     /* VOBU search info offset in the DSI */
+#define NAV_SRI_END 0x3FFFFFFF /* no VOBU in range */
+#define NAV_SRI_VIDEO 0x80000000 /* VOBU contains video */
+#define NAV_SRI_ENTRIES 19
+#define NAV_REFS 3            /* reference pictures whose end is noted in the DSI */
+#define SEQUENCE_END_ID 0xB7
+#define I_PICTURE 1
+#define P_PICTURE 2
+
+/* search distances in 0.5s, from the farthest forward */
+static const uint8_t nav_sri_times[NAV_SRI_ENTRIES] = {
+    240, 120, 60, 20, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1
+};
+
+static const uint8_t nav_system_header[] = {
+    0x00, 0x00, 0x01, SYSTEM_HEADER_ID, 0x00, 0x12, 0x80, 0xC4, 0xE1, 0x00, 0xE1, 0xFF,
+    0xB9, 0xE0, 0xE8, 0xB8, 0xC0, 0x20, 0xBD, 0xE0, 0x3A, 0xBF, 0xE0, 0x02
+};
+
+typedef struct {
+    uint32_t sector; /* relative to the start of the VOB */
+    uint32_t ptm;    /* start time */
+} nav_vobu_t;
+
+typedef struct {
+    nav_vobu_t*    vobus;          /* estimated, with an extra entry for the end of the VOB */
+    nav_vobu_t*    played;         /* as measured from the video, up to the current VOBU */
+    uint8_t*       buf;            /* sectors of the current VOBU */
+    size_t         buf_len;
+    size_t         buf_size;
+    const uint8_t* payload;        /* of the video PES packet being scanned */
+    int64_t        pes_pts;        /* of the video PES packet, until a picture uses it */
+    int64_t        gop_pts;        /* display time of the first picture in the GOP, or -1 */
+    int64_t        start_pts;      /* display time of the first picture in the VOBU, or -1 */
+    int64_t        end_pts;        /* end of the last picture displayed in the VOBU, or -1 */
+    es_scanner_t   scanner;
+    unsigned int   nr_of_vobus;
+    unsigned int   vobu;           /* current VOBU */
+    unsigned int   sector_in_vobu; /* sectors processed in the current VOBU */
+    unsigned int   video_sector;   /* last sector of the VOBU with video */
+    unsigned int   prev_video_sector;
+    unsigned int   ref_ea[NAV_REFS]; /* last sector of each reference picture */
+    unsigned int   nr_of_refs;
+    uint32_t       frame_ticks;
+    uint32_t       base_sector;    /* of the VOB within the title set VOBs */
+    uint16_t       vob_id;         /* of the VOB within the title set */
+    uint16_t       temporal_ref;   /* of the picture being scanned */
+    uint8_t        frame_rate;     /* BCD time flags */
+    bool           in_ref;         /* scanning a reference picture */
+    bool           scrambled;      /* video of the VOBU can't be parsed */
+    bool           enabled;
+} mpeg_nav_t;
+static mpeg_nav_t mpeg_nav;
+
+static void free_mpeg_nav(void)
+{
+    free(mpeg_nav.vobus);
+    free(mpeg_nav.played);
+    free(mpeg_nav.buf);
+    mpeg_nav.vobus = NULL;
+    mpeg_nav.played = NULL;
+    mpeg_nav.buf = NULL;
+    mpeg_nav.nr_of_vobus = 0;
+    mpeg_nav.enabled = false;
+}
+
+/* Build the VOBU table for a program.
+ * Return false on allocation failure. */
+static bool init_mpeg_nav(bool enabled, const ifo_vobu_t* vobu_info, unsigned int nr_of_vobus,
+                          uint32_t start_ptm, uint32_t end_ptm, const p_video_attr_t* video_attr)
+{
+    free_mpeg_nav();
+    mpeg_nav.enabled = enabled;
+    if (!enabled) {
+        return true;
+    }
+    uint16_t max_sectors = 0;
+    uint64_t total_fields = 0;
+    unsigned int vobu;
+    for (vobu=0; vobu<nr_of_vobus; vobu++) {
+        total_fields += vobu_info[vobu].fields;
+        max_sectors = MAX(max_sectors, vobu_info[vobu].sectors);
+    }
+    mpeg_nav.vobus = malloc((nr_of_vobus + 1) * sizeof(nav_vobu_t));
+    mpeg_nav.played = malloc((nr_of_vobus + 1) * sizeof(nav_vobu_t));
+    mpeg_nav.buf_size = (size_t)max_sectors * DVD_SECTOR_SIZE;
+    mpeg_nav.buf = malloc(MAX(mpeg_nav.buf_size, 1));
+    if (!mpeg_nav.vobus || !mpeg_nav.played || !mpeg_nav.buf) {
+        fprintf(stderr, "Error allocating space for NAV info\n");
+        return false;
+    }
+    mpeg_nav.buf_len = 0;
+    mpeg_nav.nr_of_vobus = nr_of_vobus;
+    mpeg_nav.vobu = 0;
+    mpeg_nav.sector_in_vobu = 0;
+    mpeg_nav.base_sector = 0;
+    mpeg_nav.vob_id = 1;
+    bool ntsc = video_attr->height == 480 || video_attr->height == 240;
+    mpeg_nav.frame_rate = ntsc ? 0xC0 : 0x40;
+    mpeg_nav.frame_ticks = ntsc ? 3003 : 3600;
+
+    uint64_t duration = (end_ptm - start_ptm) & 0xFFFFFFFF;
+    uint32_t sector = 0;
+    uint64_t fields = 0;
+    for (vobu=0; vobu<=nr_of_vobus; vobu++) {
+        mpeg_nav.vobus[vobu].sector = sector;
+        if (total_fields) {
+            mpeg_nav.vobus[vobu].ptm = start_ptm + duration * fields / total_fields;
+        } else {
+            mpeg_nav.vobus[vobu].ptm = start_ptm + duration * vobu / MAX(nr_of_vobus, 1);
+        }
+        if (vobu < nr_of_vobus) {
+            sector += vobu_info[vobu].sectors;
+            fields += vobu_info[vobu].fields;
+        }
+    }
+    memcpy(mpeg_nav.played, mpeg_nav.vobus, (nr_of_vobus + 1) * sizeof(nav_vobu_t));
+    return true;
+}
+
+/* Note where the VOB is within the title set, when it's not the only one */
+static void set_mpeg_nav_vob(uint32_t base_sector, uint16_t vob_id)
+{
+    mpeg_nav.base_sector = base_sector;
+    mpeg_nav.vob_id = vob_id;
+}
+
+/* Note the VOBU the following sectors belong to */
+static void set_mpeg_nav_vobu(unsigned int vobu)
+{
+    mpeg_nav.vobu = vobu;
+    mpeg_nav.sector_in_vobu = 0;
+    mpeg_nav.buf_len = 0;
+    mpeg_nav.video_sector = mpeg_nav.prev_video_sector = 0;
+    mpeg_nav.nr_of_refs = 0;
+    mpeg_nav.in_ref = false;
+    mpeg_nav.scrambled = false;
+    mpeg_nav.pes_pts = mpeg_nav.gop_pts = -1;
+    mpeg_nav.start_pts = mpeg_nav.end_pts = -1;
+    init_es_scanner(&mpeg_nav.scanner);
+}
+
+static void put_be32(uint8_t* buf, uint32_t value)
+{
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+/* Map an IFO time to that in the output stream */
+static uint32_t nav_ptm(uint32_t ptm)
+{
+    if (time_rebase.enabled) {
+        return (ptm - time_rebase.origin) & MPEG_TIME_MASK;
+    }
+    return ptm;
+}
+
+/* Set a BCD hh:mm:ss:ff time */
+static void put_bcd_time(uint8_t* buf, uint32_t time, uint8_t frame_rate)
+{
+    unsigned int fps = frame_rate == 0xC0 ? 30 : 25;
+    unsigned int frames = (time % 90000) * fps / 90000;
+    time /= 90000;
+    unsigned int values[4] = { time / 3600, (time / 60) % 60, time % 60, frames };
+    int i;
+    for (i=0; i<4; i++) {
+        buf[i] = ((values[i] / 10) % 10) << 4 | (values[i] % 10);
+    }
+    buf[3] |= frame_rate;
+}
+
+/* Return the index of the VOBU of a table playing at the specified time */
+static unsigned int find_nav_vobu(const nav_vobu_t* vobus, unsigned int nr_of_vobus, uint32_t ptm)
+{
+    unsigned int low = 0, high = nr_of_vobus;
+    while (high - low > 1) {
+        unsigned int mid = (low + high) / 2;
+        if ((int32_t)(ptm - vobus[mid].ptm) >= 0) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Return the index of the VOBU of the program playing at the specified time */
+static unsigned int nav_find_vobu(uint32_t ptm)
+{
+    return find_nav_vobu(mpeg_nav.vobus, mpeg_nav.nr_of_vobus, ptm);
+}
+
+/* Return a VOBU search pointer from the current VOBU to the specified one */
+static uint32_t nav_sri(unsigned int vobu)
+{
+    if (vobu >= mpeg_nav.nr_of_vobus) {
+        return NAV_SRI_END;
+    }
+    const nav_vobu_t* current = &mpeg_nav.vobus[mpeg_nav.vobu];
+    uint32_t offset;
+    if (vobu >= mpeg_nav.vobu) {
+        offset = mpeg_nav.vobus[vobu].sector - current->sector;
+    } else {
+        offset = current->sector - mpeg_nav.vobus[vobu].sector;
+    }
+    return NAV_SRI_VIDEO | offset;
+}
+
+/* Note where each reference picture ends, and the display times of the pictures */
+static bool nav_header(uint8_t code, unsigned int pos, uint8_t* byte, void* context)
+{
+    mpeg_nav_t* nav = context;
+    if (pos == MPEG_HEADER_LEN - 1) {
+        if (code != PICTURE_ID && code != GOP_ID && code != SEQUENCE_ID && code != SEQUENCE_END_ID) {
+            return false; /* within the current picture */
+        }
+        if (nav->in_ref) { /* the picture ends before this start code */
+            bool in_sector = byte - nav->payload > MPEG_HEADER_LEN - 1;
+            nav->ref_ea[nav->nr_of_refs++] = in_sector ? nav->sector_in_vobu : nav->prev_video_sector;
+            nav->in_ref = false;
+        }
+        if (code == GOP_ID) {
+            nav->gop_pts = -1;
+        }
+        return code == PICTURE_ID;
+    }
+    if (pos == MPEG_HEADER_LEN) { /* the temporal reference is the first 10 bits */
+        nav->temporal_ref = *byte << 2;
+        return true;
+    }
+    nav->temporal_ref |= *byte >> 6;
+    uint8_t picture_type = (*byte >> 3) & 0x07;
+    nav->in_ref = (picture_type == I_PICTURE || picture_type == P_PICTURE) &&
+                  nav->nr_of_refs < NAV_REFS;
+    if (nav->pes_pts >= 0) {
+        nav->gop_pts = (nav->pes_pts - nav->temporal_ref * nav->frame_ticks) & MPEG_TIME_MASK;
+        nav->pes_pts = -1;
+        if (nav->start_pts < 0 ||
+            ((nav->gop_pts - nav->start_pts) & MPEG_TIME_MASK) > MPEG_TIME_MASK/2) {
+            nav->start_pts = nav->gop_pts;
+        }
+    }
+    if (nav->gop_pts >= 0) {
+        int64_t end = (nav->gop_pts + (nav->temporal_ref + 1) * nav->frame_ticks) & MPEG_TIME_MASK;
+        if (nav->end_pts < 0 || ((end - nav->end_pts) & MPEG_TIME_MASK) < MPEG_TIME_MASK/2) {
+            nav->end_pts = end;
+        }
+    }
+    return false;
+}
+
+static void nav_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                    unsigned int header_len, void* context)
+{
+    mpeg_nav_t* nav = context;
+    if (stream_id != VIDEO_STREAM_0) {
+        return;
+    }
+    if (nav->video_sector != nav->sector_in_vobu) {
+        nav->prev_video_sector = nav->video_sector;
+        nav->video_sector = nav->sector_in_vobu;
+    }
+    if (pes_scrambled(pes)) {
+        init_es_scanner(&nav->scanner);
+        nav->scrambled = true;
+        return;
+    }
+    int64_t pts = get_pes_pts(pes, header_len);
+    if (pts >= 0) {
+        nav->pes_pts = pts;
+    }
+    nav->payload = pes + header_len;
+    es_scan(&nav->scanner, pes + header_len, pes_len - header_len, nav_header, nav);
+}
+
+static void add_mpeg_nav(uint8_t* buf, const unsigned int bs)
+{
+    if (!mpeg_nav.enabled || mpeg_nav.vobu >= mpeg_nav.nr_of_vobus) {
+        return;
+    }
+    walk_pack(buf, bs, nav_pes, &mpeg_nav);
+    mpeg_nav.sector_in_vobu++;
+}
+
+/* An output_func_t to hold the sectors of the VOBU until its NAV pack is complete */
+static int buffer_mpeg_nav(int fd, const uint8_t* buf, unsigned int len)
+{
+    (void) fd;
+    if (mpeg_nav.buf_len + len > mpeg_nav.buf_size) {
+        errno = EFBIG;
+        return -1;
+    }
+    memcpy(mpeg_nav.buf + mpeg_nav.buf_len, buf, len);
+    mpeg_nav.buf_len += len;
+    return 0;
+}
+
+/* Replace the RDI pack at the start of the VOBU with a NAV pack */
+static void put_nav_pack(uint8_t* buf, uint32_t s_ptm, uint32_t e_ptm, uint32_t eltm)
+{
+    const nav_vobu_t* vobu = &mpeg_nav.vobus[mpeg_nav.vobu];
+    const nav_vobu_t* next = vobu + 1;
+    const nav_vobu_t* first = &mpeg_nav.vobus[0];
+    uint32_t last_sector = next->sector - vobu->sector - 1;
+
+    buf[13] = 0xF8; /* no pack stuffing */
+    memset(buf + 14, 0, DVD_SECTOR_SIZE - 14);
+    memcpy(buf + 14, nav_system_header, sizeof(nav_system_header));
+
+    uint8_t* pci = buf + NAV_PCI_OFFSET - 7;
+    pci[2] = 0x01; pci[3] = PRIVATE_STREAM_2;
+    pci[4] = NAV_PCI_LEN >> 8; pci[5] = NAV_PCI_LEN & 0xFF;
+    pci[6] = 0x00; /* PCI substream */
+    pci += 7;
+    put_be32(pci + 0x00, mpeg_nav.base_sector + vobu->sector); /* nv_pck_lbn */
+    put_be32(pci + 0x0C, s_ptm);                  /* vobu_s_ptm */
+    put_be32(pci + 0x10, e_ptm);                  /* vobu_e_ptm */
+    put_bcd_time(pci + 0x18, eltm, mpeg_nav.frame_rate); /* e_eltm */
+
+    uint8_t* dsi = buf + NAV_DSI_OFFSET - 7;
+    dsi[2] = 0x01; dsi[3] = PRIVATE_STREAM_2;
+    dsi[4] = NAV_DSI_LEN >> 8; dsi[5] = NAV_DSI_LEN & 0xFF;
+    dsi[6] = 0x01; /* DSI substream */
+    dsi += 7;
+    put_be32(dsi + 0x00, get_scr(buf));           /* nv_pck_scr */
+    put_be32(dsi + 0x04, mpeg_nav.base_sector + vobu->sector); /* nv_pck_lbn */
+    put_be32(dsi + 0x08, last_sector);            /* vobu_ea */
+    int i;
+    for (i=0; i<NAV_REFS; i++) {                  /* vobu_1stref_ea ... 3rdref_ea */
+        /* repeat the last if there are fewer reference pictures */
+        unsigned int ref = MIN((unsigned int)i, mpeg_nav.nr_of_refs - 1);
+        put_be32(dsi + 0x0C + i*4, mpeg_nav.nr_of_refs ? mpeg_nav.ref_ea[ref] : 0);
+    }
+    dsi[0x18] = mpeg_nav.vob_id >> 8;             /* vobu_vob_idn */
+    dsi[0x19] = mpeg_nav.vob_id & 0xFF;
+    dsi[0x1B] = 1;                                /* vobu_c_idn */
+    put_bcd_time(dsi + 0x1C, eltm, mpeg_nav.frame_rate); /* c_eltm */
+
+    uint8_t* sri = dsi + NAV_VOBU_SRI;
+    put_be32(sri, nav_sri(mpeg_nav.vobu + 1));    /* next_video */
+    for (i=0; i<NAV_SRI_ENTRIES; i++) {
+        uint32_t distance = nav_sri_times[i] * 45000;
+        uint32_t fwd = NAV_SRI_END, bwd = NAV_SRI_END;
+        if ((int32_t)(vobu->ptm + distance - mpeg_nav.vobus[mpeg_nav.nr_of_vobus].ptm) < 0) {
+            unsigned int target = nav_find_vobu(vobu->ptm + distance);
+            if (target > mpeg_nav.vobu) {
+                fwd = nav_sri(target);
+            }
+        }
+        if ((int32_t)(vobu->ptm - distance - first->ptm) >= 0) {
+            unsigned int target = nav_find_vobu(vobu->ptm - distance);
+            if (target < mpeg_nav.vobu) {
+                bwd = nav_sri(target);
+            }
+        }
+        put_be32(sri + 4 + i*4, fwd);                        /* fwda */
+        put_be32(sri + 4 + 19*4 + 8 + (18-i)*4, bwd);        /* bwda, nearest first */
+    }
+    put_be32(sri + 4 + 19*4, nav_sri(mpeg_nav.vobu + 1));    /* next_vobu */
+    put_be32(sri + 4 + 19*4 + 4, mpeg_nav.vobu ? nav_sri(mpeg_nav.vobu - 1) : NAV_SRI_END); /* prev_vobu */
+    put_be32(sri + 4 + 19*4 + 8 + 19*4,                      /* prev_video */
+             mpeg_nav.vobu ? nav_sri(mpeg_nav.vobu - 1) : NAV_SRI_END);
+}
+
+/*
+ * Complete the NAV pack of the buffered VOBU and write the VOBU.
+ * The VOBU is measured if it was all read, and its video could be parsed.
+ * Return false on write error.
+ */
+static bool write_mpeg_nav_vobu(int fd, bool complete)
+{
+    if (!mpeg_nav.enabled || mpeg_nav.vobu >= mpeg_nav.nr_of_vobus) {
+        return true;
+    }
+    unsigned int vobu = mpeg_nav.vobu;
+    if (mpeg_nav.in_ref) { /* the picture continues to the end of the VOBU */
+        mpeg_nav.ref_ea[mpeg_nav.nr_of_refs++] = mpeg_nav.video_sector;
+        mpeg_nav.in_ref = false;
+    }
+    bool measured = complete && !mpeg_nav.scrambled && mpeg_nav.start_pts >= 0 &&
+                    mpeg_nav.end_pts >= 0;
+    uint32_t duration = mpeg_nav.vobus[vobu+1].ptm - mpeg_nav.vobus[vobu].ptm;
+    uint32_t s_ptm = nav_ptm(mpeg_nav.played[vobu].ptm);
+    if (measured) {
+        duration = (mpeg_nav.end_pts - mpeg_nav.start_pts) & MPEG_TIME_MASK;
+        s_ptm = mpeg_nav.start_pts;
+    }
+    mpeg_nav.played[vobu+1].ptm = mpeg_nav.played[vobu].ptm + duration;
+
+    uint8_t* buf = mpeg_nav.buf;
+    if (mpeg_nav.buf_len >= DVD_SECTOR_SIZE &&
+        find_mpeg_header(buf, MPEG_HEADER_LEN, PACK_ID) == 0 && (buf[4] & 0xC0) == 0x40 &&
+        find_mpeg_header(buf + 14 + (buf[13] & 0x07), MPEG_HEADER_LEN, PRIVATE_STREAM_2) == 0) {
+        put_nav_pack(buf, s_ptm, s_ptm + duration,
+                     mpeg_nav.played[vobu].ptm - mpeg_nav.played[0].ptm);
+    }
+
+    size_t written = 0;
+    while (written < mpeg_nav.buf_len) {
+        ssize_t len = write(fd, buf + written, mpeg_nav.buf_len - written);
+        if (len <= 0) {
+            fprintf(stderr, "Error writing to DST [%s]\n", strerror(errno));
+            return false;
+        }
+        written += len;
+    }
+    mpeg_nav.buf_len = 0;
+    return true;
+}
+
+/*
+Extract line 21 (EIA-608) closed captions from the MPEG2 user data,
+as the sectors are processed. Both the ATSC (GA94) and DVD (CC) user data
+formats are supported. All field 1 caption data is written to an SCC file,
+and the first caption channel (CC1) is decoded to an SRT file.
+The SRT decoding is simplified, treating roll-up and paint-on captions
+as a line at a time, and ignoring positioning and style.
+The files are removed if no captions are found.
+The ATSC caption data is attached to each picture in coded order, so it's
+held until the end of the GOP and then processed in display order,
+as given by the temporal reference of each picture. The time of each
+picture is found from the GOP position of a picture with a PTS,
+or continues from the previous GOP. The DVD caption data is for the whole GOP
+in display order, a pair of fields per frame.
+*/
+
+#define USER_DATA_ID 0xB2
+#define CAPTION_USER_DATA_MAX 512
+#define CAPTION_TEXT_MAX 256
+#define CAPTION_PICTURES_MAX 64  /* per GOP */
+#define CAPTION_TRIPLES_MAX 63   /* the most DVD user data can hold */
+
+typedef struct {
+    int64_t  pts;                /* of the picture, or -1 */
+    uint16_t temporal_ref;       /* display order in the GOP */
+    uint8_t  count;              /* triples of caption data */
+    bool     atsc;
+    uint8_t  data[CAPTION_TRIPLES_MAX * 3];
+    uint8_t  unused[7];
+} caption_picture_t;
+
+typedef enum {
+    CAPTION_POP_ON,
+    CAPTION_ROLL_UP,
+    CAPTION_PAINT_ON
+} caption_mode_t;
+
+typedef struct {
+    FILE*          scc;
+    FILE*          srt;
+    char*          scc_name;
+    char*          srt_name;
+    int64_t        origin;          /* display time of the first picture, or -1 */
+    int64_t        pes_pts;         /* of the current video PES, until used */
+    int64_t        next_pts;        /* display time after the pictures processed, or -1 */
+    int64_t        displayed_pts;   /* when the displayed caption was shown */
+    es_scanner_t   scanner;
+    unsigned int   user_data_len;
+    unsigned int   srt_count;
+    unsigned int   scc_lines;
+    unsigned int   nr_of_pictures;  /* in the current GOP */
+    uint32_t       frame_ticks;     /* 90KHz units per frame */
+    caption_mode_t mode;
+    uint16_t       last_control;    /* control codes are sent twice */
+    uint8_t        fps;
+    bool           enabled;
+    bool           collecting;      /* in user data */
+    bool           in_picture;      /* user data is for the last picture */
+    bool           channel2;        /* data following is for CC2 */
+    uint8_t        unused[5];
+    caption_picture_t pictures[CAPTION_PICTURES_MAX];
+    uint8_t        user_data[CAPTION_USER_DATA_MAX];
+    char           loading[CAPTION_TEXT_MAX];   /* pop-on caption not yet shown */
+    char           displayed[CAPTION_TEXT_MAX];
+} captions_t;
+static captions_t captions;
+
+/* The EIA-608 characters that differ from ASCII */
+static const char* caption_char(uint8_t c)
+{
+    static char ascii[2];
+    switch (c) {
+    case 0x2A: return "á";
+    case 0x5C: return "é";
+    case 0x5E: return "í";
+    case 0x5F: return "ó";
+    case 0x60: return "ú";
+    case 0x7B: return "ç";
+    case 0x7C: return "÷";
+    case 0x7D: return "Ñ";
+    case 0x7E: return "ñ";
+    case 0x7F: return "■";
+    }
+    ascii[0] = c;
+    return ascii;
+}
+
+static const char* const caption_special_chars[16] = {
+    "®", "°", "½", "¿", "™", "¢", "£", "♪", "à", " ", "è", "â", "ê", "î", "ô", "û"
+};
+
+static void caption_append(char* text, const char* chars)
+{
+    size_t len = strlen(text);
+    if (len + strlen(chars) < CAPTION_TEXT_MAX) {
+        strcpy(text + len, chars);
+    }
+}
+
+static void format_srt_time(char* buf, size_t size, int64_t pts)
+{
+    uint64_t time = (pts - captions.origin) & MPEG_TIME_MASK;
+    uint64_t ms = time / 90;
+    (void) snprintf(buf, size, "%02"PRIu64":%02"PRIu64":%02"PRIu64",%03"PRIu64,
+                    ms / 3600000, (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000);
+}
+
+/* Write any displayed caption to the SRT file, as shown until pts */
+static void caption_clear(int64_t pts)
+{
+    if (captions.displayed[0] && captions.displayed_pts >= 0) {
+        char start[16], end[16];
+        format_srt_time(start, sizeof(start), captions.displayed_pts);
+        format_srt_time(end, sizeof(end), pts);
+        size_t len = strlen(captions.displayed);
+        while (len && captions.displayed[len-1] == '\n') {
+            captions.displayed[--len] = '\0';
+        }
+        fprintf(captions.srt, "%u\n%s --> %s\n%s\n\n", ++captions.srt_count, start, end,
+                captions.displayed);
+    }
+    captions.displayed[0] = '\0';
+    captions.displayed_pts = pts;
+}
+
+/* Decode a pair of CC1 bytes */
+static void decode_caption_pair(uint8_t b1, uint8_t b2, int64_t pts)
+{
+    b1 &= 0x7F; b2 &= 0x7F; /* parity */
+    if (!b1 && !b2) {
+        return;
+    }
+    char* text = captions.mode == CAPTION_POP_ON ? captions.loading : captions.displayed;
+
+    if (b1 >= 0x10 && b1 <= 0x1F) {
+        uint16_t control = b1 << 8 | b2;
+        if (control == captions.last_control) {
+            captions.last_control = 0; /* ignore the repeat */
+            return;
+        }
+        captions.last_control = control;
+        captions.channel2 = b1 & 0x08;
+        if (captions.channel2) {
+            return;
+        }
+        b1 &= 0xF7;
+        if (b1 == 0x14 && b2 >= 0x20 && b2 <= 0x2F) {
+            switch (b2) {
+            case 0x20: captions.mode = CAPTION_POP_ON; break;
+            case 0x25: case 0x26: case 0x27:
+                captions.mode = CAPTION_ROLL_UP; break;
+            case 0x29: captions.mode = CAPTION_PAINT_ON; break;
+            case 0x21: /* backspace */
+                if (*text) {
+                    text[strlen(text)-1] = '\0';
+                }
+                break;
+            case 0x2C: /* erase displayed memory */
+                caption_clear(pts);
+                break;
+            case 0x2D: /* carriage return */
+                if (captions.mode == CAPTION_ROLL_UP) {
+                    caption_clear(pts);
+                } else {
+                    caption_append(text, "\n");
+                }
+                break;
+            case 0x2E: /* erase non-displayed memory */
+                captions.loading[0] = '\0';
+                break;
+            case 0x2F: /* end of caption, so show the loaded caption */
+                caption_clear(pts);
+                strcpy(captions.displayed, captions.loading);
+                captions.loading[0] = '\0';
+                break;
+            }
+        } else if (b1 == 0x11 && b2 >= 0x30 && b2 <= 0x3F) {
+            caption_append(text, caption_special_chars[b2 - 0x30]);
+        } else if (b1 == 0x11 && b2 >= 0x20 && b2 <= 0x2F) {
+            caption_append(text, " "); /* mid row style change */
+        } else if (b2 >= 0x40 && b2 <= 0x7F) {
+            /* preamble address code, so start a new row */
+            if (*text && text[strlen(text)-1] != '\n') {
+                caption_append(text, "\n");
+            }
+        }
+        return;
+    }
+
+    captions.last_control = 0;
+    if (captions.channel2) {
+        return;
+    }
+    if (captions.mode != CAPTION_POP_ON && !captions.displayed[0]) {
+        captions.displayed_pts = pts;
+    }
+    if (b1 >= 0x20) {
+        caption_append(text, caption_char(b1));
+    }
+    if (b2 >= 0x20) {
+        caption_append(text, caption_char(b2));
+    }
+}
+
+/* Process the caption data for a frame, as (field, byte1, byte2) triples */
+static void process_caption_data(const uint8_t* data, unsigned int count, bool atsc, int64_t pts)
+{
+    bool line_started = false;
+    unsigned int i;
+    for (i=0; i<count; i++, data+=3) {
+        bool field1;
+        if (atsc) {
+            bool valid = data[0] & 0x04;
+            field1 = valid && (data[0] & 0x03) == 0;
+        } else {
+            field1 = data[0] & 0x01;
+        }
+        if (!field1 || ((data[1] & 0x7F) == 0 && (data[2] & 0x7F) == 0)) {
+            continue;
+        }
+        int64_t pair_pts = pts;
+        if (!atsc) { /* a pair of fields for each frame */
+            pair_pts = (pts + (i/2) * captions.frame_ticks) & MPEG_TIME_MASK;
+        }
+        if (!line_started) {
+            unsigned int fps = captions.fps;
+            uint64_t time = (pts - captions.origin) & MPEG_TIME_MASK;
+            uint64_t frames = fps == 30 ? time * 30000 / 1001 / 90000 : time * fps / 90000;
+            fprintf(captions.scc, "\n\n%02"PRIu64":%02"PRIu64":%02"PRIu64":%02"PRIu64"\t",
+                    frames / (fps * 3600), (frames / (fps * 60)) % 60, (frames / fps) % 60, frames % fps);
+            line_started = true;
+            captions.scc_lines++;
+        } else {
+            putc(' ', captions.scc);
+        }
+        fprintf(captions.scc, "%02x%02x", data[1], data[2]);
+        decode_caption_pair(data[1], data[2], pair_pts);
+    }
+}
+
+/* Process the caption data of the pictures of a GOP in display order */
+static void flush_caption_pictures(void)
+{
+    unsigned int nr_of_pictures = captions.nr_of_pictures;
+    captions.nr_of_pictures = 0;
+    captions.in_picture = false;
+
+    int64_t gop_pts = -1; /* display time of temporal reference 0 */
+    unsigned int frames = 0, i;
+    for (i=0; i<nr_of_pictures; i++) {
+        const caption_picture_t* picture = &captions.pictures[i];
+        if (gop_pts < 0 && picture->pts >= 0) {
+            gop_pts = (picture->pts - picture->temporal_ref * captions.frame_ticks) & MPEG_TIME_MASK;
+        }
+        frames = MAX(frames, picture->temporal_ref + 1U);
+    }
+    if (gop_pts < 0) {
+        gop_pts = captions.next_pts;
+    }
+    if (gop_pts < 0) {
+        return; /* no time yet */
+    }
+    if (captions.origin < 0) {
+        captions.origin = gop_pts;
+    }
+
+    /* A stable sort, so GOP user data stays before the pictures */
+    uint8_t order[CAPTION_PICTURES_MAX];
+    for (i=0; i<nr_of_pictures; i++) {
+        unsigned int j = i;
+        while (j && captions.pictures[order[j-1]].temporal_ref > captions.pictures[i].temporal_ref) {
+            order[j] = order[j-1];
+            j--;
+        }
+        order[j] = i;
+    }
+    for (i=0; i<nr_of_pictures; i++) {
+        const caption_picture_t* picture = &captions.pictures[order[i]];
+        if (picture->count) {
+            process_caption_data(picture->data, picture->count, picture->atsc,
+                                 (gop_pts + picture->temporal_ref * captions.frame_ticks) & MPEG_TIME_MASK);
+        }
+    }
+    captions.next_pts = (gop_pts + frames * captions.frame_ticks) & MPEG_TIME_MASK;
+}
+
+/* Start a picture, to which the following user data is attached */
+static void start_caption_picture(void)
+{
+    if (captions.nr_of_pictures == CAPTION_PICTURES_MAX) {
+        flush_caption_pictures();
+    }
+    caption_picture_t* picture = &captions.pictures[captions.nr_of_pictures++];
+    picture->pts = captions.pes_pts; /* applies to the first picture in the PES */
+    captions.pes_pts = -1;
+    picture->temporal_ref = 0;
+    picture->count = 0;
+    captions.in_picture = true;
+}
+
+/* Parse a user data block for caption data, and note it for the picture,
+ * or for the GOP if it precedes the pictures */
+static void process_caption_user_data(const uint8_t* data, unsigned int len)
+{
+    const uint8_t* triples = NULL;
+    unsigned int count = 0;
+    bool atsc = false;
+    if (len >= 7 && !memcmp(data, "GA94\x03", 5) && (data[5] & 0x40)) {
+        count = data[5] & 0x1F;
+        triples = data + 7;
+        atsc = true;
+    } else if (len >= 5 && !memcmp(data, "CC\x01\xF8", 4)) {
+        count = ((data[4] & 0x3E) >> 1) * 2 + (data[4] & 0x01);
+        triples = data + 5;
+    }
+    if (!triples || (unsigned int)(triples - data) + count*3 > len) {
+        return;
+    }
+    if (!captions.in_picture) {
+        start_caption_picture();
+        captions.in_picture = false;
+    }
+    caption_picture_t* picture = &captions.pictures[captions.nr_of_pictures-1];
+    count = MIN(count, CAPTION_TRIPLES_MAX - (unsigned int)picture->count);
+    memcpy(picture->data + picture->count*3, triples, count*3);
+    picture->count += count;
+    picture->atsc = atsc;
+}
+
+static bool caption_header(uint8_t code, unsigned int pos, uint8_t* byte, void* context)
+{
+    captions_t* cc = context;
+    if (pos == MPEG_HEADER_LEN - 1) {
+        if (cc->collecting) {
+            /* the user data has ended, including the next start code prefix */
+            process_caption_user_data(cc->user_data, cc->user_data_len);
+            cc->collecting = false;
+        }
+        if (code == GOP_ID) {
+            flush_caption_pictures();
+        } else if (code == PICTURE_ID) {
+            start_caption_picture();
+            return true;
+        } else if (code == USER_DATA_ID) {
+            cc->collecting = true;
+            cc->user_data_len = 0;
+            return true;
+        }
+        return false;
+    }
+    if (code == PICTURE_ID) { /* the temporal reference is the first 10 bits */
+        caption_picture_t* picture = &cc->pictures[cc->nr_of_pictures-1];
+        if (pos == MPEG_HEADER_LEN) {
+            picture->temporal_ref = *byte << 2;
+            return true;
+        }
+        picture->temporal_ref |= *byte >> 6;
+        return false;
+    }
+    if (cc->user_data_len < sizeof(cc->user_data)) {
+        cc->user_data[cc->user_data_len++] = *byte;
+        return true;
+    }
+    process_caption_user_data(cc->user_data, cc->user_data_len);
+    cc->collecting = false;
+    return false;
+}
+
+static void caption_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                        unsigned int header_len, void* context)
+{
+    captions_t* cc = context;
+    if (stream_id != VIDEO_STREAM_0) {
+        return;
+    }
+    if (pes_scrambled(pes)) {
+        init_es_scanner(&cc->scanner);
+        cc->collecting = false;
+        return;
+    }
+    int64_t pts = get_pes_pts(pes, header_len);
+    if (pts >= 0) {
+        cc->pes_pts = pts;
+    }
+    es_scan(&cc->scanner, pes + header_len, pes_len - header_len, caption_header, cc);
+}
+
+static void extract_captions(uint8_t* buf, const unsigned int bs)
+{
+    if (captions.enabled) {
+        walk_pack(buf, bs, caption_pes, &captions);
+    }
+}
+
+static FILE* open_caption_file(const char* base, const char* ext, char** name)
+{
+    *name = malloc(strlen(base) + strlen(ext) + 1);
+    if (!*name) {
+        fprintf(stderr, "Error allocating space for caption file name\n");
+        return NULL;
+    }
+    sprintf(*name, "%s%s", base, ext);
+    FILE* fp = fopen(*name, "w");
+    if (!fp) {
+        fprintf(stderr, "Error opening [%s] (%s)\n", *name, strerror(errno));
+    }
+    return fp;
+}
+
+/* Open the caption files for a program */
+static bool captions_start(bool enabled, const char* base, const p_video_attr_t* video_attr)
+{
+    captions.enabled = enabled;
+    if (!enabled) {
+        return true;
+    }
+    init_es_scanner(&captions.scanner);
+    captions.origin = captions.pes_pts = captions.next_pts = captions.displayed_pts = -1;
+    captions.collecting = captions.in_picture = captions.channel2 = false;
+    captions.nr_of_pictures = 0;
+    captions.mode = CAPTION_POP_ON;
+    captions.last_control = 0;
+    captions.srt_count = captions.scc_lines = 0;
+    captions.loading[0] = captions.displayed[0] = '\0';
+    captions.fps = (video_attr->height == 480 || video_attr->height == 240) ? 30 : 25;
+    captions.frame_ticks = captions.fps == 30 ? 3003 : 3600;
+
+    captions.scc = open_caption_file(base, ".scc", &captions.scc_name);
+    captions.srt = open_caption_file(base, ".srt", &captions.srt_name);
+    if (!captions.scc || !captions.srt) {
+        return false;
+    }
+    fprintf(captions.scc, "Scenarist_SCC V1.0");
+    return true;
+}
+
+/* Close the caption files, removing them if no captions were found */
+static bool captions_end(struct tm* tm)
+{
+    if (!captions.enabled) {
+        return true;
+    }
+    bool ret = true;
+    flush_caption_pictures();
+    caption_clear(captions.next_pts);
+    if (captions.scc_lines) {
+        putc('\n', captions.scc);
+    }
+    if (fclose(captions.scc) == EOF || fclose(captions.srt) == EOF) {
+        fprintf(stderr, "Error writing caption files [%s]\n", strerror(errno));
+        ret = false;
+    }
+    if (!captions.scc_lines) {
+        unlink(captions.scc_name);
+        unlink(captions.srt_name);
+    } else {
+        touch(captions.scc_name, tm);
+        touch(captions.srt_name, tm);
+        fprintf(stdinfo, "captions: %u\n", captions.srt_count);
+    }
+    free(captions.scc_name);
+    free(captions.srt_name);
+    captions.enabled = false;
+    return ret;
+}
+
+void process_mpeg2(uint8_t* buf, const unsigned int bs, void* program)
+{
+    (void) fix_mpeg2_aspect(buf, bs, *(const unsigned int*)program);
+    rebase_mpeg2_time(buf, bs);
+    extract_captions(buf, bs);
+    add_mpeg_nav(buf, bs);
+    check_mpeg_encryption(buf, bs, *(const unsigned int*)program);
+}
+
+/*********************************************************************************
+ * MPEG2 fixup planning
+ *********************************************************************************/
+
+/*
+The only modifications fix_mpeg2_aspect() makes are to a few bytes in the
+sectors containing a sequence header, which are generally the first video
+sectors in each VOBU. So rather than pushing every byte of a program through
+process_mpeg2(), we can do a quick pre-pass reading only the start of each VOBU,
+up to the end of its first sequence header and extensions,
+and record the modified bytes as a sparse list of (sector, offset, bytes) patches.
+This list can then be applied by any copying method, or written to a
+sidecar file for use by external tools.
+*/
+
+#define FIXUP_MAX_LEN 9         /* longest run of modified bytes in a single patch */
+#define FIXUP_SCAN_SECTORS 16   /* sectors read at a time from the start of each VOBU */
+
+typedef struct {
+    uint32_t sector;            /* relative to the start of the program */
+    uint16_t offset;            /* within the sector */
+    uint8_t  len;
+    uint8_t  bytes[FIXUP_MAX_LEN];
+} fixup_t;
+STATIC_ASSERT(sizeof(fixup_t) == 16,"");
+
+typedef struct {
+    fixup_t*     fixups;
+    unsigned int nr_of_fixups;
+    unsigned int allocated;
+} fixup_list_t;
+
+static void init_fixup_list(fixup_list_t* list)
+{
+    list->fixups = NULL;
+    list->nr_of_fixups = list->allocated = 0;
+}
+
+static void free_fixup_list(fixup_list_t* list)
+{
+    free(list->fixups);
+    init_fixup_list(list);
+}
+
+static bool add_fixup(fixup_list_t* list, uint32_t sector, uint16_t offset,
+                      const uint8_t* bytes, uint8_t len)
+{
+    if (list->nr_of_fixups == list->allocated) {
+        unsigned int allocated = list->allocated ? list->allocated * 2 : 64;
+        fixup_t* fixups = realloc(list->fixups, allocated * sizeof(fixup_t));
+        if (!fixups) {
+            return false;
+        }
+        list->fixups = fixups;
+        list->allocated = allocated;
+    }
+    fixup_t* fixup = &list->fixups[list->nr_of_fixups++];
+    fixup->sector = sector;
+    fixup->offset = offset;
+    fixup->len = len;
+    memcpy(fixup->bytes, bytes, len);
+    return true;
+}
+
+/* Record the differences between the original and modified sector */
+static bool diff_sector(fixup_list_t* list, uint32_t sector,
+                        const uint8_t* orig, const uint8_t* buf, unsigned int bs)
+{
+    unsigned int offset=0;
+    while (offset < bs) {
+        if (orig[offset] == buf[offset]) {
+            offset++;
+            continue;
+        }
+        unsigned int len=1;
+        while (offset+len < bs && len < FIXUP_MAX_LEN && orig[offset+len] != buf[offset+len]) {
+            len++;
+        }
+        if (!add_fixup(list, sector, offset, buf+offset, len)) {
+            return false;
+        }
+        offset += len;
+    }
+    return true;
+}
+
+/*
+ * Scan the start of each VOBU of a program, up to the end of its first
+ * sequence header and extensions, and record the fixups that
+ * process_mpeg2() would have applied. Returns false on error.
+ */
+static bool plan_mpeg2_fixups(int vro_fd, off_t vob_offset, const ifo_vobu_t* vobu_info,
+                              unsigned int nr_of_vobus, unsigned int program, fixup_list_t* list)
+{
+    if (ifo_video_attrs[ifo_program_attrs[program].video_attr].aspect < 2) {
+        return true; /* fix_mpeg2_aspect() doesn't modify anything */
+    }
+    uint8_t orig[FIXUP_SCAN_SECTORS*DVD_SECTOR_SIZE];
+    uint8_t buf[DVD_SECTOR_SIZE];
+    uint32_t vobu_sector = 0;
+    unsigned int vobu;
+
+    for (vobu=0; vobu<nr_of_vobus; vobu++, vobu_info++) {
+        uint16_t vobu_size = vobu_info->sectors;
+        uint32_t sector = 0;
+        bool found_sequence_header = false;
+        /* Only the start of each VOBU is scanned, so don't carry
+         * any partial header on from the previous VOBU */
+        init_mpeg2_cache();
+        while (!found_sequence_header && sector < vobu_size) {
+            uint32_t sectors = MIN(vobu_size - sector, FIXUP_SCAN_SECTORS);
+            off_t offset = vob_offset + (off_t)(vobu_sector+sector)*DVD_SECTOR_SIZE;
+            ssize_t len = pread(vro_fd, orig, (size_t)sectors*DVD_SECTOR_SIZE, offset);
+            uint32_t sectors_read = len > 0 ? (uint32_t)len / DVD_SECTOR_SIZE : 0;
+            uint32_t s;
+            for (s=0; s<sectors_read && !found_sequence_header; s++) {
+                const uint8_t* sector_orig = orig + (size_t)s*DVD_SECTOR_SIZE;
+                memcpy(buf, sector_orig, sizeof(buf));
+                found_sequence_header = fix_mpeg2_aspect(buf, sizeof(buf), program);
+                if (!diff_sector(list, vobu_sector+sector+s, sector_orig, buf, sizeof(buf))) {
+                    fprintf(stderr, "Error allocating space for MPEG fixups\n");
+                    return false;
+                }
+            }
+            if (sectors_read < sectors) {
+                break; /* read errors are reported when copying */
+            }
+            sector += sectors;
+        }
+        vobu_sector += vobu_size;
+    }
+
+    return true;
+}
+
+/* Apply the fixups for this sector, returning the index of the next fixup */
+static size_t apply_fixups(uint8_t* buf, const unsigned int bs, uint32_t sector,
+                           const fixup_list_t* list, size_t next)
+{
+    while (next < list->nr_of_fixups && list->fixups[next].sector < sector) {
+        next++; /* skip any fixups for unreadable sectors */
+    }
+    while (next < list->nr_of_fixups && list->fixups[next].sector == sector) {
+        const fixup_t* fixup = &list->fixups[next++];
+        if (fixup->offset + fixup->len <= bs) {
+            memcpy(buf + fixup->offset, fixup->bytes, fixup->len);
+        }
+    }
+    return next;
+}
+
+typedef struct {
+    const fixup_list_t* fixups;
+    unsigned int        program;
+    uint32_t            sector;
+    size_t              next;
+} planned_context_t;
+
+/* Like process_mpeg2() but apply the planned fixups rather than searching for them */
+void process_mpeg2_planned(uint8_t* buf, const unsigned int bs, void* context)
+{
+    planned_context_t* planned = context;
+    planned->next = apply_fixups(buf, bs, planned->sector++, planned->fixups, planned->next);
+    rebase_mpeg2_time(buf, bs);
+    extract_captions(buf, bs);
+    add_mpeg_nav(buf, bs);
+    check_mpeg_encryption(buf, bs, planned->program);
+}
+
+/* Write the fixups in a simple text format: sector offset hexbytes */
+static bool write_fixups(const char* name, const fixup_list_t* list)
+{
+    FILE* fp = fopen(name, "w");
+    if (!fp) {
+        fprintf(stderr, "Error opening [%s] (%s)\n", name, strerror(errno));
+        return false;
+    }
+    fprintf(fp, "# dvd-vr fixups: sector offset bytes (sector size %d)\n", DVD_SECTOR_SIZE);
+    unsigned int i;
+    for (i=0; i<list->nr_of_fixups; i++) {
+        const fixup_t* fixup = &list->fixups[i];
+        fprintf(fp, "%"PRIu32" %"PRIu16" ", fixup->sector, fixup->offset);
+        int b;
+        for (b=0; b<fixup->len; b++) {
+            fprintf(fp, "%02X", fixup->bytes[b]);
+        }
+        putc('\n', fp);
+    }
+    if (fclose(fp) == EOF) {
+        fprintf(stderr, "Error writing [%s] (%s)\n", name, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*********************************************************************************
+ * Time ranges
+ *********************************************************************************/
+
+/*
+Find the VOBUs covering a time range of a program, using only the IFO,
+so that just those VOBUs need to be read from the VRO.
+The time map gives the VOBU playing every TIME_MAP_UNIT seconds, from which
+we step through the (at most TIME_MAP_UNIT seconds of) VOBU durations to
+the VOBU containing the time. If the VOBU durations aren't recorded, then
+the VOBUs are assumed to be of equal duration, as for the NAV packs.
+*/
+
+#define TIME_MAP_UNIT 10 /* seconds between time map entries */
+
+typedef struct {
+    uint16_t first_vobu;
+    uint16_t nr_of_vobus;
+    uint32_t sector;     /* of the first VOBU within the VOB */
+    uint32_t start_ptm;  /* video start and end time of the range */
+    uint32_t end_ptm;
+} vobu_range_t;
+
+/* Parse [[HH:]MM:]SS[.frac] to 90KHz units. Return false if invalid. */
+static bool parse_time(const char* time, uint64_t* ptm)
+{
+    uint64_t seconds = 0;
+    int fields = 0;
+    const char* p = time;
+    for (;;) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        char* end;
+        unsigned long value = strtoul(p, &end, 10);
+        if (value > UINT32_MAX || (fields && value >= 60)) {
+            return false;
+        }
+        seconds = seconds * 60 + value;
+        p = end;
+        if (*p != ':' || ++fields > 2) {
+            break;
+        }
+        p++;
+    }
+    *ptm = seconds * 90000;
+    if (*p == '.') {
+        uint64_t scale = 9000;
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            *ptm += (*p - '0') * scale;
+            scale /= 10;
+        }
+    }
+    return *p == '\0';
+}
+
+/* Return whether the video of a program is NTSC,
+ * assuming not if it has no valid VOB format */
+static bool program_ntsc(const ifo_t* ifo, const ifo_program_t* info)
+{
+    if (!info->vob_format_id || info->vob_format_id > ifo->nr_of_vob_formats) {
+        return false;
+    }
+    const p_video_attr_t* video_attr = &ifo_video_attrs[info->vob_format_id-1];
+    return video_attr->height == 480 || video_attr->height == 240;
+}
+
+/* Convert video fields to 90KHz units */
+static uint64_t fields_to_ptm(uint64_t fields, bool ntsc)
+{
+    return ntsc ? fields * 3003 / 2 : fields * 1800;
+}
+
+/* Return the VOBU of the program playing at time, and its start time */
+static unsigned int find_vobu(const ifo_program_t* info, bool ntsc, uint64_t time, uint64_t* vobu_time)
+{
+    uint64_t duration = (info->end_ptm - info->start_ptm) & 0xFFFFFFFF;
+    unsigned int vobu = 0;
+    if (!info->total_fields) {
+        vobu = time * info->nr_of_vobus / duration;
+        *vobu_time = duration * vobu / info->nr_of_vobus;
+        return vobu;
+    }
+
+    uint64_t start = 0;
+    uint64_t unit = ntsc ? TIME_MAP_UNIT * 60 : TIME_MAP_UNIT * 50; /* fields */
+    uint64_t entry = (time / fields_to_ptm(unit, ntsc));
+    if (info->time_entries && entry) {
+        entry = MIN(entry, info->nr_of_time_infos);
+        const ifo_time_entry_t* time_entry = &info->time_entries[entry-1];
+        uint64_t entry_fields = entry * unit;
+        if (time_entry->time_diff <= entry_fields) {
+            vobu = time_entry->vobu;
+            start = fields_to_ptm(entry_fields - time_entry->time_diff, ntsc);
+        }
+    }
+    while (vobu+1 < info->nr_of_vobus) {
+        uint64_t end = start + fields_to_ptm(info->vobus[vobu].fields, ntsc);
+        if (end > time) {
+            break;
+        }
+        start = end;
+        vobu++;
+    }
+    *vobu_time = start;
+    return vobu;
+}
+
+/* Return the start time of a VOBU, in 90KHz units from the start of the program */
+static uint64_t vobu_time(const ifo_program_t* info, bool ntsc, unsigned int vobu)
+{
+    uint64_t duration = (info->end_ptm - info->start_ptm) & 0xFFFFFFFF;
+    if (!info->total_fields) {
+        return info->nr_of_vobus ? duration * vobu / info->nr_of_vobus : 0;
+    }
+    uint64_t time = 0;
+    unsigned int i;
+    for (i=0; i<vobu && i<info->nr_of_vobus; i++) {
+        time += fields_to_ptm(info->vobus[i].fields, ntsc);
+    }
+    return MIN(time, duration);
+}
+
+/*
+ * Find the VOBUs covering start to end (90KHz units from the start of the program).
+ * Return false if the range is beyond the end of the program.
+ */
+static bool find_vobu_range(const ifo_program_t* info, bool ntsc, uint64_t start, uint64_t end,
+                            vobu_range_t* range)
+{
+    uint64_t duration = (info->end_ptm - info->start_ptm) & 0xFFFFFFFF;
+    end = MIN(end, duration);
+    if (!info->nr_of_vobus || start >= end) {
+        return false;
+    }
+    uint64_t start_time, end_time;
+    unsigned int first = find_vobu(info, ntsc, start, &start_time);
+    unsigned int last = find_vobu(info, ntsc, end - 1, &end_time);
+    if (info->total_fields) {
+        end_time += fields_to_ptm(info->vobus[last].fields, ntsc);
+    } else {
+        end_time = duration * (last + 1) / info->nr_of_vobus;
+    }
+
+    range->first_vobu = first;
+    range->nr_of_vobus = last - first + 1;
+    range->sector = 0;
+    unsigned int vobu;
+    for (vobu=0; vobu<first; vobu++) {
+        range->sector += info->vobus[vobu].sectors;
+    }
+    range->start_ptm = info->start_ptm + start_time;
+    range->end_ptm = info->start_ptm + MIN(end_time, duration);
+    return true;
+}
+
+/*********************************************************************************
+ * Output splitting
+ *********************************************************************************/
+
+/*
+Split the output into files no larger than a given size, for FAT32 etc.
+Files are only split on VOBU boundaries, so that each part starts with
+an RDI pack and a sequence header and can be played independently.
+Since the VOBU sizes are all in the IFO, the parts are planned before
+any data is read, and each file is preallocated to its final size
+when the output is a straight copy of the VRO data.
+*/
+
+typedef struct {
+    unsigned int first_vobu;
+    uint32_t     sectors;
+} split_part_t;
+
+/* Parse a size like 4294967295, 1G or 650M. Return 0 if invalid. */
+static uint64_t parse_size(const char* size)
+{
+    char* trailing;
+    errno = 0;
+    uint64_t bytes = strtoull(size, &trailing, 10);
+    if (trailing == size || errno || *size == '-') {
+        return 0;
+    }
+    int shift = 0;
+    switch (*trailing) {
+    case 'G': shift += 10; /* fall through */
+    case 'M': shift += 10; /* fall through */
+    case 'K': shift += 10; trailing++; break;
+    }
+    if (*trailing || bytes > (UINT64_MAX >> shift)) {
+        return 0;
+    }
+    return bytes << shift;
+}
+
+/*
+ * Return the parts for the VOBUs of a program, where each part is at most
+ * max_sectors unless it's a single larger VOBU. The returned array must be free()d.
+ */
+static split_part_t* plan_splits(const ifo_vobu_t* vobu_info, unsigned int nr_of_vobus,
+                                 uint32_t max_sectors, unsigned int* nr_of_parts)
+{
+    split_part_t* parts = malloc((nr_of_vobus + 1) * sizeof(split_part_t));
+    if (!parts) {
+        fprintf(stderr, "Error allocating space for output parts\n");
+        return NULL;
+    }
+    unsigned int part = 0;
+    parts[0].first_vobu = 0;
+    parts[0].sectors = 0;
+    unsigned int vobu;
+    for (vobu=0; vobu<nr_of_vobus; vobu++) {
+        uint16_t vobu_size = vobu_info[vobu].sectors;
+        if (parts[part].sectors && parts[part].sectors + vobu_size > max_sectors) {
+            part++;
+            parts[part].first_vobu = vobu;
+            parts[part].sectors = 0;
+        }
+        parts[part].sectors += vobu_size;
+    }
+    *nr_of_parts = part + 1;
+    return parts;
+}
+
+/* Allocate the space for an output part up front, to avoid fragmentation
+ * and to fail early if there isn't enough space. */
+static bool preallocate_part(int fd, const char* name, uint32_t sectors)
+{
+#ifdef _POSIX_ADVISORY_INFO
+    int err = posix_fallocate(fd, 0, (off_t)sectors * DVD_SECTOR_SIZE);
+    if (err == ENOSPC || err == EFBIG) {
+        fprintf(stderr, "Error allocating space for [%s] (%s)\n", name, strerror(err));
+        return false;
+    }
+    /* Otherwise preallocation is not supported, so just write normally */
+#else
+    (void) fd; (void) name; (void) sectors;
+#endif //_POSIX_ADVISORY_INFO
+    return true;
+}
+
+/* Write zeros in place of sectors that couldn't be read, so that the following
+ * VOBUs are at the offsets given in the NAV packs and IFO tables.
+ * Return false on write error. */
+static bool zero_fill_part(int fd, uint32_t sectors)
+{
+    static const uint8_t zeros[DVD_SECTOR_SIZE];
+    while (sectors--) {
+        if (write(fd, zeros, sizeof(zeros)) != sizeof(zeros)) {
+            fprintf(stderr, "Error writing to DST [%s]\n", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Finish writing a part, discarding any preallocated space not written,
+ * which can happen on read errors. */
+static void close_part(int fd, const char* name, bool preallocated, struct tm* tm)
+{
+    if (preallocated) {
+        off_t written = lseek(fd, 0, SEEK_CUR);
+        if (written == (off_t)-1 || ftruncate(fd, written) == -1) {
+            fprintf(stderr, "Error truncating [%s] (%s)\n", name, strerror(errno));
+        }
+    }
+    close(fd);
+    touch(name, tm);
+}
+
+/*********************************************************************************
+ * Encryption probing
+ *********************************************************************************/
+
+/*
+Rather than determining the encryption status while copying whole programs,
+we can quickly sample the first few video packs in each VOBU, giving
+a per VOBU map of the scrambled state and time of each VOBU.
+Note Panasonic recorders were seen to leave the first 15s unscrambled.
+*/
+
+#define PROBE_SECTORS 8      /* max sectors to read at the start of each VOBU */
+#define PROBE_VIDEO_PACKS 2  /* number of video packs to sample in each VOBU */
+
+typedef struct {
+    int64_t     pts;         /* of first video pack sampled, or -1 if none had a PTS */
+    scrambled_t scrambled;   /* SCRAMBLED_UNSET if no video was sampled */
+    int         video_packs; /* number sampled */
+} vobu_probe_t;
+
+static void probe_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                      unsigned int header_len, void* context)
+{
+    vobu_probe_t* probe = context;
+    (void) pes_len;
+    if (stream_id != VIDEO_STREAM_0) {
+        return;
+    }
+    scrambled_t scrambled = pes_scrambled(pes) ? SCRAMBLED : UNSCRAMBLED;
+    if (probe->scrambled != SCRAMBLED_UNSET && probe->scrambled != scrambled) {
+        probe->scrambled = PARTIALLY_SCRAMBLED;
+    } else {
+        probe->scrambled = scrambled;
+    }
+    int64_t pts = get_pes_pts(pes, header_len);
+    if (pts >= 0 && probe->pts < 0) {
+        probe->pts = pts;
+    }
+    probe->video_packs++;
+}
+
+/*
+ * Sample the video at the start of each VOBU of a program.
+ * The returned array must be free()d.
+ */
+static vobu_probe_t* probe_vobus(int vro_fd, off_t vob_offset, const ifo_vobu_t* vobu_info,
+                                 unsigned int nr_of_vobus)
+{
+    vobu_probe_t* probes = malloc(nr_of_vobus * sizeof(vobu_probe_t));
+    if (!probes) {
+        fprintf(stderr, "Error allocating space for VOBU probes\n");
+        return NULL;
+    }
+
+    uint8_t buf[DVD_SECTOR_SIZE];
+    uint32_t vobu_sector = 0;
+    unsigned int vobu;
+    for (vobu=0; vobu<nr_of_vobus; vobu++, vobu_info++) {
+        vobu_probe_t* probe = &probes[vobu];
+        probe->pts = -1;
+        probe->scrambled = SCRAMBLED_UNSET;
+        probe->video_packs = 0;
+
+        uint16_t vobu_size = vobu_info->sectors;
+        uint32_t sector;
+        for (sector=0; sector<MIN(vobu_size, PROBE_SECTORS); sector++) {
+            off_t offset = vob_offset + (off_t)(vobu_sector+sector)*DVD_SECTOR_SIZE;
+            if (pread(vro_fd, buf, sizeof(buf), offset) != sizeof(buf)) {
+                break;
+            }
+            walk_pack(buf, sizeof(buf), probe_pes, probe);
+            if (probe->video_packs >= PROBE_VIDEO_PACKS) {
+                break;
+            }
+        }
+        vobu_sector += vobu_size;
+    }
+
+    return probes;
+}
+
+static void format_pts(char* buf, size_t size, uint64_t pts)
+{
+    unsigned int cs = (pts % 90000) / 900;
+    uint64_t secs = pts / 90000;
+    (void) snprintf(buf, size, "%02u:%02u:%02u.%02u", (unsigned int)(secs/3600),
+                    (unsigned int)(secs/60%60), (unsigned int)(secs%60), cs);
+}
+
+/*
+ * Return the start time of a VOBU of a range, relative to the start of the range.
+ * This is from the sampled PTS, or from the IFO if no PTS was sampled.
+ */
+static uint64_t probed_vobu_time(const vobu_probe_t* probes, const ifo_program_t* info, bool ntsc,
+                                 const vobu_range_t* range, unsigned int vobu)
+{
+    if (probes[vobu].pts >= 0) {
+        return (probes[vobu].pts - range->start_ptm) & MPEG_TIME_MASK;
+    }
+    uint64_t range_start = (range->start_ptm - info->start_ptm) & 0xFFFFFFFF;
+    uint64_t time = vobu_time(info, ntsc, range->first_vobu + vobu);
+    return time > range_start ? time - range_start : 0;
+}
+
+/* Print the time range of VOBUs [first, end), relative to the start of the range */
+static void print_scrambled_range(const vobu_probe_t* probes, const ifo_program_t* info, bool ntsc,
+                                  const vobu_range_t* range, unsigned int first, unsigned int end,
+                                  scrambled_t scrambled)
+{
+    uint64_t start_pts = first ? probed_vobu_time(probes, info, ntsc, range, first) : 0;
+    uint64_t end_pts = end < range->nr_of_vobus ? probed_vobu_time(probes, info, ntsc, range, end)
+                                                : (uint32_t)(range->end_ptm - range->start_ptm);
+    char start_str[32], end_str[32];
+    format_pts(start_str, sizeof(start_str), start_pts);
+    format_pts(end_str, sizeof(end_str), end_pts);
+
+    const char* state = "scrambled";
+    if (scrambled == UNSCRAMBLED) {
+        state = "clear";
+    } else if (scrambled == PARTIALLY_SCRAMBLED) {
+        state = "partially scrambled";
+    }
+    fprintf(stdinfo, "crypt: %s-%s %s (VOBUs %u-%u)\n",
+            start_str, end_str, state, first+1, end);
+}
+
+/* Print the time ranges of each scrambled state,
+ * returning the scrambled state of the whole program. */
+static scrambled_t print_scrambled_ranges(const vobu_probe_t* probes, const ifo_program_t* info,
+                                          bool ntsc, const vobu_range_t* range)
+{
+    unsigned int nr_of_vobus = range->nr_of_vobus;
+    scrambled_t program_scrambled = SCRAMBLED_UNSET;
+    scrambled_t run_scrambled = SCRAMBLED_UNSET;
+    unsigned int vobu, run_start = 0;
+
+    for (vobu=0; vobu<nr_of_vobus; vobu++) {
+        scrambled_t scrambled = probes[vobu].scrambled;
+        if (scrambled == SCRAMBLED_UNSET || scrambled == run_scrambled) {
+            continue; /* VOBUs without video sampled are assumed same as previous */
+        }
+        if (run_scrambled != SCRAMBLED_UNSET) {
+            print_scrambled_range(probes, info, ntsc, range, run_start, vobu, run_scrambled);
+        }
+        if (program_scrambled != SCRAMBLED_UNSET || scrambled == PARTIALLY_SCRAMBLED) {
+            program_scrambled = PARTIALLY_SCRAMBLED;
+        } else {
+            program_scrambled = scrambled;
+        }
+        run_scrambled = scrambled;
+        run_start = vobu;
+    }
+    if (run_scrambled != SCRAMBLED_UNSET) {
+        print_scrambled_range(probes, info, ntsc, range, run_start, nr_of_vobus, run_scrambled);
+    }
+
+    return program_scrambled;
+}
+
+/*********************************************************************************
+ * Chapters
+ *********************************************************************************/
+
+/*
+The chapters of a program start at its entry points from the IFO,
+so they're found without scanning the video. As the output can only
+be split on VOBU boundaries, each chapter file starts at the VOBU
+containing its entry point. Chapter markers in the output (Matroska)
+are at the exact times of the entry points.
+*/
+
+typedef enum {
+    CHAPTERS_NONE,
+    CHAPTERS_SPLIT, /* write each chapter to a separate file */
+    CHAPTERS_MARKS  /* mark the chapters in the output */
+} chapter_mode_t;
+
+/*
+ * Return the start times of the chapters within a range of a program,
+ * the first being the start of the range. The returned array must be free()d.
+ */
+static uint32_t* range_chapters(const ifo_program_t* info, const vobu_range_t* range,
+                                unsigned int* nr_of_chapters)
+{
+    uint32_t* chapters = malloc((info->nr_of_entry_points + 1) * sizeof(uint32_t));
+    if (!chapters) {
+        fprintf(stderr, "Error allocating space for chapters\n");
+        return NULL;
+    }
+    uint32_t range_start = range->start_ptm - info->start_ptm;
+    uint32_t range_end = range->end_ptm - info->start_ptm;
+    chapters[0] = range->start_ptm;
+    *nr_of_chapters = 1;
+    unsigned int ep;
+    for (ep=0; ep<info->nr_of_entry_points; ep++) {
+        uint32_t time = info->entry_points[ep] - info->start_ptm;
+        if (time > range_start && time < range_end) {
+            chapters[(*nr_of_chapters)++] = info->entry_points[ep];
+        }
+    }
+    return chapters;
+}
+
+/* Print the chapter start times relative to the start of the program */
+static void print_chapters(const ifo_program_t* info, const uint32_t* chapters,
+                           unsigned int nr_of_chapters)
+{
+    unsigned int chapter;
+    for (chapter=0; chapter<nr_of_chapters; chapter++) {
+        char start[16];
+        format_pts(start, sizeof(start), (chapters[chapter] - info->start_ptm) & 0xFFFFFFFF);
+        fprintf(stdinfo, "chapter: %u %s\n", chapter+1, start);
+    }
+}
+
+/*
+ * Return the output parts for the chapters of a range of a program,
+ * starting each part at the VOBU containing the chapter start.
+ * The returned array must be free()d.
+ */
+static split_part_t* plan_chapter_splits(const ifo_program_t* info, bool ntsc,
+                                         const vobu_range_t* range, const uint32_t* chapters,
+                                         unsigned int nr_of_chapters, unsigned int* nr_of_parts)
+{
+    split_part_t* parts = malloc(nr_of_chapters * sizeof(split_part_t));
+    if (!parts) {
+        fprintf(stderr, "Error allocating space for output parts\n");
+        return NULL;
+    }
+    parts[0].first_vobu = 0;
+    unsigned int part = 0, chapter;
+    for (chapter=1; chapter<nr_of_chapters; chapter++) {
+        uint64_t vobu_time;
+        unsigned int vobu = find_vobu(info, ntsc, (chapters[chapter] - info->start_ptm) & 0xFFFFFFFF,
+                                      &vobu_time);
+        if (vobu > range->first_vobu + parts[part].first_vobu) {
+            parts[++part].first_vobu = vobu - range->first_vobu;
+        }
+    }
+    *nr_of_parts = part + 1;
+    for (part=0; part<*nr_of_parts; part++) {
+        unsigned int end = part+1 < *nr_of_parts ? parts[part+1].first_vobu : range->nr_of_vobus;
+        parts[part].sectors = 0;
+        unsigned int vobu;
+        for (vobu=parts[part].first_vobu; vobu<end; vobu++) {
+            parts[part].sectors += info->vobus[range->first_vobu + vobu].sectors;
+        }
+    }
+    return parts;
+}
+
+/*********************************************************************************
+ * Playlists
+ *********************************************************************************/
+
+/*
+Extract a user defined program set (playlist) to a single output,
+with its cells in playback order. The VOBUs covering each cell are found
+from the IFO as for --start and --end, giving a piece of the VRO for each cell,
+at a known offset in the output. The pieces are then sorted by their position
+in the VRO, and adjacent or overlapping pieces of the same program are
+coalesced to extents, so that the VRO is read in a single forward pass,
+and any data shared between cells is only read once.
+Each pack read is written to the output position of every piece containing it.
+*/
+
+#define PLAYLIST_READ_SECTORS 256 /* per read of an extent, for progress and errors */
+
+typedef struct {
+    uint32_t sector;     /* in the VRO */
+    uint32_t sectors;
+    uint64_t out_sector; /* in the output */
+    unsigned int program;
+    uint8_t  unused[4];
+} playlist_piece_t;
+
+typedef struct {
+    const playlist_piece_t* pieces; /* of the extent being read, sorted by sector */
+    unsigned int nr_of_pieces;
+    uint32_t     sector;            /* in the VRO of the next data output */
+} scatter_t;
+static scatter_t scatter;
+
+/* Print the cells of each playlist, with times relative to their program */
+static void print_playlists(const ifo_t* ifo)
+{
+    fprintf(stdinfo, "\nNumber of playlists: %d\n", ifo->nr_of_playlists);
+    unsigned int playlist;
+    for (playlist=0; playlist<ifo->nr_of_playlists; playlist++) {
+        const ifo_playlist_t* pl = &ifo->playlists[playlist];
+        fprintf(stdinfo, "\nplaylist: %u\n", playlist+1);
+        unsigned int cell;
+        for (cell=0; cell<pl->nr_of_cells; cell++) {
+            const ifo_cell_t* c = &pl->cells[cell];
+            const ifo_program_t* info = &ifo->programs[c->program];
+            char start[16], end[16];
+            format_pts(start, sizeof(start), (c->start_ptm - info->start_ptm) & 0xFFFFFFFF);
+            format_pts(end, sizeof(end), (c->end_ptm - info->start_ptm) & 0xFFFFFFFF);
+            fprintf(stdinfo, "cell : %u program %u %s - %s\n", cell+1, c->program+1, start, end);
+        }
+    }
+}
+
+static int compare_pieces(const void* p1, const void* p2)
+{
+    const playlist_piece_t* piece1 = p1;
+    const playlist_piece_t* piece2 = p2;
+    if (piece1->sector != piece2->sector) {
+        return piece1->sector < piece2->sector ? -1 : 1;
+    }
+    return piece1->out_sector < piece2->out_sector ? -1 : piece1->out_sector > piece2->out_sector;
+}
+
+/*
+ * Return the pieces of the VRO for the cells of a playlist, sorted by sector,
+ * and the total output size. The returned array must be free()d.
+ */
+static playlist_piece_t* plan_playlist(const ifo_t* ifo, const ifo_playlist_t* playlist,
+                                       unsigned int* nr_of_pieces, uint64_t* out_sectors)
+{
+    playlist_piece_t* pieces = malloc(playlist->nr_of_cells * sizeof(playlist_piece_t) + 1);
+    if (!pieces) {
+        fprintf(stderr, "Error allocating space for playlist\n");
+        return NULL;
+    }
+    *nr_of_pieces = 0;
+    *out_sectors = 0;
+    unsigned int cell;
+    for (cell=0; cell<playlist->nr_of_cells; cell++) {
+        const ifo_cell_t* c = &playlist->cells[cell];
+        const ifo_program_t* info = &ifo->programs[c->program];
+        if (!info->nr_of_vobus) {
+            fprintf(stderr, "Warning: cell %u is in program %u, which has no VOBUs\n",
+                    cell+1, c->program+1);
+            continue;
+        }
+        bool ntsc = program_ntsc(ifo, info);
+        vobu_range_t range;
+        if (!find_vobu_range(info, ntsc, (c->start_ptm - info->start_ptm) & 0xFFFFFFFF,
+                             (c->end_ptm - info->start_ptm) & 0xFFFFFFFF, &range)) {
+            fprintf(stderr, "Warning: cell %u is beyond the end of program %u\n",
+                    cell+1, c->program+1);
+            continue;
+        }
+        playlist_piece_t* piece = &pieces[*nr_of_pieces];
+        piece->sector = info->vob_offset + range.sector;
+        piece->sectors = 0;
+        unsigned int vobu;
+        for (vobu=range.first_vobu; vobu<range.first_vobu+range.nr_of_vobus; vobu++) {
+            piece->sectors += info->vobus[vobu].sectors;
+        }
+        piece->out_sector = *out_sectors;
+        piece->program = c->program;
+        *out_sectors += piece->sectors;
+        (*nr_of_pieces)++;
+    }
+    qsort(pieces, *nr_of_pieces, sizeof(playlist_piece_t), compare_pieces);
+    return pieces;
+}
+
+/* An output_func_t to write the packs read from the current extent
+ * to the output position of each piece that contains them. */
+static int scatter_packs(int fd, const uint8_t* buf, unsigned int len)
+{
+    uint32_t sectors = len / DVD_SECTOR_SIZE;
+    unsigned int p;
+    for (p=0; p<scatter.nr_of_pieces; p++) {
+        const playlist_piece_t* piece = &scatter.pieces[p];
+        if (piece->sector >= scatter.sector + sectors) {
+            break; /* sorted */
+        }
+        uint32_t start = MAX(piece->sector, scatter.sector);
+        uint32_t end = MIN(piece->sector + piece->sectors, scatter.sector + sectors);
+        if (start >= end) {
+            continue;
+        }
+        size_t bytes = (size_t)(end - start) * DVD_SECTOR_SIZE;
+        off_t offset = (off_t)(piece->out_sector + (start - piece->sector)) * DVD_SECTOR_SIZE;
+        if (pwrite(fd, buf + (size_t)(start - scatter.sector) * DVD_SECTOR_SIZE, bytes, offset)
+            != (ssize_t)bytes) {
+            return -1;
+        }
+    }
+    scatter.sector += sectors;
+    return 0;
+}
+
+/*
+ * Coalesce the pieces following the first that start within its extent,
+ * returning the index after the last and setting the extent end sector.
+ */
+static unsigned int coalesce_pieces(const playlist_piece_t* pieces, unsigned int nr_of_pieces,
+                                    unsigned int first, uint32_t* end)
+{
+    unsigned int program = pieces[first].program;
+    *end = pieces[first].sector + pieces[first].sectors;
+    unsigned int last = first + 1;
+    while (last < nr_of_pieces && pieces[last].program == program &&
+           pieces[last].sector <= *end) {
+        *end = MAX(*end, pieces[last].sector + pieces[last].sectors);
+        last++;
+    }
+    return last;
+}
+
+/*
+ * Read the extents covering the pieces, writing them to the output fd.
+ * Return false on write error. Read errors are left as zeros in the output.
+ */
+static bool extract_playlist(int vro_fd, int fd, const playlist_piece_t* pieces,
+                             unsigned int nr_of_pieces, bool* read_error)
+{
+    uint64_t total = 0, done = 0;
+    uint32_t end;
+    unsigned int first = 0;
+    while (first < nr_of_pieces) { /* the sectors actually read */
+        unsigned int last = coalesce_pieces(pieces, nr_of_pieces, first, &end);
+        total += end - pieces[first].sector;
+        first = last;
+    }
+    *read_error = false;
+    percent_display(PERCENT_START, 0, 0);
+    first = 0;
+    while (first < nr_of_pieces) {
+        unsigned int program = pieces[first].program;
+        uint32_t start = pieces[first].sector;
+        unsigned int last = coalesce_pieces(pieces, nr_of_pieces, first, &end);
+        scatter.pieces = &pieces[first];
+        scatter.nr_of_pieces = last - first;
+        init_mpeg2_cache();
+
+        uint32_t sector;
+        for (sector=start; sector<end; sector+=PLAYLIST_READ_SECTORS) {
+            uint32_t sectors = MIN(end - sector, PLAYLIST_READ_SECTORS);
+            if (lseek(vro_fd, (off_t)sector * DVD_SECTOR_SIZE, SEEK_SET) == (off_t)-1) {
+                fprintf(stderr, "Error seeking within VRO [%s]\n", strerror(errno));
+                return false;
+            }
+            scatter.sector = sector;
+            int display_char = 0;
+            int ret = stream_data(vro_fd, fd, sectors, DVD_SECTOR_SIZE, process_mpeg2, &program,
+                                  scatter_packs);
+            if (ret == -2) {
+                return false;
+            } else if (ret == -1) {
+                display_char = 'X';
+                *read_error = true;
+                init_mpeg2_cache();
+            } else if (ifo_program_attrs[program].scrambled == SCRAMBLED ||
+                       ifo_program_attrs[program].scrambled == PARTIALLY_SCRAMBLED) {
+                display_char = 'E';
+            }
+            done += sectors;
+            percent_display(PERCENT_UPDATE, done * 100 / total, display_char);
+        }
+        first = last;
+    }
+    if (!*read_error) {
+        percent_display(PERCENT_END, 0, 0);
+    } else {
+        putc('\n', stderr); /* Leave the percent display showing read errors */
+    }
+    return true;
+}
+
+/*********************************************************************************
+ * Still images
+ *********************************************************************************/
+
+/*
+Extract the stills from VR_STILL.VRO, each to its own vob file.
+A still is an MPEG-2 program stream with a single I frame, optionally
+followed by packs of audio recorded with it, so the video and audio parts
+are copied together and the file can be played or converted as is.
+The stills of a group are stored consecutively, so each group is
+read in a single forward pass, streaming the data as for the programs.
+*/
+
+/* Print the groups of stills, returning the total number of stills */
+static unsigned int print_stills(const ifo_t* ifo)
+{
+    unsigned int nr_of_stills = 0;
+    fprintf(stdinfo, "\nNumber of still groups: %d\n", ifo->nr_of_still_groups);
+    unsigned int group;
+    for (group=0; group<ifo->nr_of_still_groups; group++) {
+        const ifo_still_group_t* g = &ifo->still_groups[group];
+        fprintf(stdinfo, "\nstill group: %u\n", group+1);
+        struct tm tm;
+        (void) parse_pgtm(g->timestamp, &tm);
+        uint64_t sectors = 0;
+        unsigned int still, with_audio = 0;
+        for (still=0; still<g->nr_of_stills; still++) {
+            sectors += g->stills[still].video_sectors + g->stills[still].audio_sectors;
+            with_audio += g->stills[still].audio_sectors != 0;
+        }
+        fprintf(stdinfo, "stills: %u (%u with audio)\n", g->nr_of_stills, with_audio);
+        fprintf(stdinfo, "size : %'"PRIu64"\n", sectors*DVD_SECTOR_SIZE);
+        nr_of_stills += g->nr_of_stills;
+    }
+    return nr_of_stills;
+}
+
+/*
+ * Extract the stills to BASE_stillNNN.vob, where BASE is name_base,
+ * or the timestamp of the still's group if that's NULL.
+ * Return false on error, which has been reported. After a read error,
+ * the remaining stills are still extracted before returning false.
+ */
+static bool extract_stills(int still_fd, const ifo_t* ifo, const char* name_base,
+                           const struct tm* now_tm, unsigned int nr_of_stills)
+{
+    unsigned int still_num = 0;
+    bool ok = true;
+    percent_display(PERCENT_START, 0, 0);
+    unsigned int group;
+    for (group=0; group<ifo->nr_of_still_groups; group++) {
+        const ifo_still_group_t* g = &ifo->still_groups[group];
+        struct tm tm;
+        if (!decode_pgtm(g->timestamp, &tm)) {
+            tm = *now_tm;
+        }
+        const char* prefix = name_base;
+        char stamp[64];
+        if (!prefix) {
+            strftime(stamp, sizeof(stamp), TIMESTAMP_FMT, &tm);
+            prefix = stamp;
+        }
+        uint32_t sector = g->vob_offset;
+        unsigned int still;
+        for (still=0; still<g->nr_of_stills; still++) {
+            uint32_t sectors = g->stills[still].video_sectors + g->stills[still].audio_sectors;
+            still_num++;
+            char name[strlen(prefix) + sizeof("_still12345.vob")];
+            (void) snprintf(name, sizeof(name), "%s_still%03u.vob", prefix, still_num);
+            int fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0666);
+            if (fd == -1) {
+                fprintf(stderr, "Error opening [%s] (%s)\n", name, strerror(errno));
+                return false;
+            }
+            int display_char = 0;
+            if (lseek(still_fd, (off_t)sector * DVD_SECTOR_SIZE, SEEK_SET) == (off_t)-1) {
+                fprintf(stderr, "Error seeking within still VRO [%s]\n", strerror(errno));
+                close(fd);
+                return false;
+            }
+            int ret = stream_data(still_fd, fd, sectors, DVD_SECTOR_SIZE, NULL, NULL, NULL);
+            if (ret == -2) { /* write error */
+                close(fd);
+                return false;
+            } else if (ret == -1) { /* read error */
+                display_char = 'X';
+                ok = false;
+            }
+            close(fd);
+            touch(name, &tm);
+            sector += sectors;
+            percent_display(PERCENT_UPDATE, still_num * 100 / nr_of_stills, display_char);
+        }
+    }
+    if (ok) {
+        percent_display(PERCENT_END, 0, 0);
+    } else {
+        putc('\n', stderr); /* Leave the percent display showing read errors */
+        fprintf(stderr, "Error reading some stills\n");
+    }
+    return ok;
+}
+
+/*********************************************************************************
+ * Seek index
+ *********************************************************************************/
+
+/*
+Record the output offset and PTS of the start of each VOBU,
+and of each I frame, as the VOB is written. These are written to
+a sidecar file at the end of the program, so that the VOB can be seeked
+without a scan. The file has an 8 byte magic of "DVDVRIDX",
+a 4 byte version and 4 byte entry count, then for each entry an 8 byte
+output byte offset and an 8 byte PTS, with the INDEX_ flags in the top bits.
+All fields are big endian. VOBU entries are for the first pack output
+in the VOBU, and I frame entries for the pack containing the picture header.
+*/
+
+#define INDEX_MAGIC "DVDVRIDX"
+#define INDEX_VERSION 1
+#define INDEX_VOBU   (1ULL << 63)
+#define INDEX_IFRAME (1ULL << 62)
+#define INDEX_NO_PTS (1ULL << 61) /* e.g. scrambled */
+#define I_FRAME 1                 /* picture_coding_type */
+
+typedef struct {
+    uint64_t offset;
+    uint64_t pts;    /* with INDEX_ flags */
+} index_entry_t;
+
+typedef struct {
+    index_entry_t* entries;
+    size_t         nr_of_entries;
+    size_t         allocated;
+    uint64_t       offset;         /* output bytes */
+    uint64_t       pack_offset;    /* of the pack being scanned */
+    uint64_t       picture_offset; /* of the picture header being scanned */
+    int64_t        pes_pts;        /* of the current video PES, until used */
+    int64_t        picture_pts;    /* of the picture header being scanned */
+    ssize_t        vobu_entry;     /* VOBU entry awaiting a PTS, or -1 */
+    es_scanner_t   scanner;
+    bool           enabled;
+    bool           vobu_start;     /* next pack output starts a VOBU */
+    uint8_t        unused[2];
+} seek_index_t;
+static seek_index_t seek_index;
+
+/* reset for each output file */
+static void index_start(void)
+{
+    seek_index.nr_of_entries = 0;
+    seek_index.offset = 0;
+    seek_index.pes_pts = -1;
+    seek_index.vobu_entry = -1;
+    seek_index.vobu_start = false;
+    init_es_scanner(&seek_index.scanner);
+}
+
+/* Note the next pack output starts a VOBU */
+static void index_vobu(void)
+{
+    seek_index.vobu_start = true;
+}
+
+static void add_index_entry(uint64_t offset, uint64_t pts)
+{
+    if (seek_index.nr_of_entries == seek_index.allocated) {
+        size_t allocated = seek_index.allocated ? seek_index.allocated * 2 : 1024;
+        index_entry_t* entries = realloc(seek_index.entries, allocated * sizeof(index_entry_t));
+        if (!entries) {
+            fprintf(stderr, "Error allocating space for seek index\n");
+            exit(EXIT_FAILURE);
+        }
+        seek_index.entries = entries;
+        seek_index.allocated = allocated;
+    }
+    seek_index.entries[seek_index.nr_of_entries].offset = offset;
+    seek_index.entries[seek_index.nr_of_entries].pts = pts;
+    seek_index.nr_of_entries++;
+}
+
+static bool index_picture_header(uint8_t code, unsigned int pos, uint8_t* byte, void* context)
+{
+    seek_index_t* index = context;
+    if (code != PICTURE_ID) {
+        return false;
+    }
+    if (pos == MPEG_HEADER_LEN - 1) {
+        index->picture_offset = index->pack_offset;
+        index->picture_pts = index->pes_pts; /* applies to the first picture in the PES */
+        index->pes_pts = -1;
+        return true;
+    }
+    if (pos < MPEG_HEADER_LEN + 1) {
+        return true;
+    }
+    if (((*byte >> 3) & 0x07) == I_FRAME) {
+        add_index_entry(index->picture_offset,
+                        index->picture_pts >= 0 ? (uint64_t)index->picture_pts | INDEX_IFRAME
+                                                : INDEX_IFRAME | INDEX_NO_PTS);
+    }
+    return false;
+}
+
+static void index_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                      unsigned int header_len, void* context)
+{
+    seek_index_t* index = context;
+    if (stream_id != VIDEO_STREAM_0) {
+        return;
+    }
+    if (pes_scrambled(pes)) {
+        init_es_scanner(&index->scanner);
+        return;
+    }
+    int64_t pts = get_pes_pts(pes, header_len);
+    if (pts >= 0) {
+        index->pes_pts = pts;
+        if (index->vobu_entry >= 0) {
+            index->entries[index->vobu_entry].pts = pts | INDEX_VOBU;
+            index->vobu_entry = -1;
+        }
+    }
+    es_scan(&index->scanner, pes + header_len, pes_len - header_len, index_picture_header, index);
+}
+
+/* Index a pack as it's output */
+static void index_pack(const uint8_t* pack)
+{
+    seek_index.pack_offset = seek_index.offset;
+    if (seek_index.vobu_start) {
+        seek_index.vobu_entry = seek_index.nr_of_entries;
+        add_index_entry(seek_index.offset, INDEX_VOBU | INDEX_NO_PTS); /* PTS set later */
+        seek_index.vobu_start = false;
+    }
+    /* walk_pack() doesn't modify the data, and nor do our callbacks */
+    walk_pack((uint8_t*) pack, DVD_SECTOR_SIZE, index_pes, &seek_index);
+    seek_index.offset += DVD_SECTOR_SIZE;
+}
+
+static void put_be64(uint8_t* buf, uint64_t value)
+{
+    put_be32(buf, value >> 32);
+    put_be32(buf + 4, value);
+}
+
+/* Write the index for the output file */
+static bool index_end(const char* base, struct tm* tm)
+{
+    char name[strlen(base) + sizeof(".idx")];
+    (void) snprintf(name, sizeof(name), "%s.idx", base);
+    size_t len = 16 + seek_index.nr_of_entries * 16;
+    uint8_t* buf = malloc(len);
+    if (!buf) {
+        fprintf(stderr, "Error allocating space for seek index\n");
+        return false;
+    }
+    memcpy(buf, INDEX_MAGIC, 8);
+    put_be32(buf + 8, INDEX_VERSION);
+    put_be32(buf + 12, seek_index.nr_of_entries);
+    size_t entry;
+    for (entry=0; entry<seek_index.nr_of_entries; entry++) {
+        put_be64(buf + 16 + entry*16, seek_index.entries[entry].offset);
+        put_be64(buf + 16 + entry*16 + 8, seek_index.entries[entry].pts);
+    }
+
+    bool ret = false;
+    int fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening [%s] (%s)\n", name, strerror(errno));
+    } else if (write(fd, buf, len) != (ssize_t)len) {
+        fprintf(stderr, "Error writing [%s] (%s)\n", name, strerror(errno));
+        close(fd);
+    } else {
+        close(fd);
+        touch(name, tm);
+        ret = true;
+    }
+    free(buf);
+    return ret;
+}
+
+static void free_index(void)
+{
+    free(seek_index.entries);
+    seek_index.entries = NULL;
+    seek_index.nr_of_entries = seek_index.allocated = 0;
+}
+
+/*********************************************************************************
+ * Pack filtering
+ *********************************************************************************/
+
+/*
+Drop packs from the program stream as it's written.
+Padding packs and the RDI packs at the start of each VOBU
+are not needed to play the extracted VOBs.
+Audio streams not selected are also dropped.
+Runs of packs that are kept are written together.
+*/
+
+typedef struct {
+    uint64_t dropped;    /* bytes not written for the current program */
+    bool     strip;      /* drop padding and RDI packs */
+    uint8_t  audio_mask; /* audio streams to keep */
+    uint8_t  unused[6];
+} pack_filter_t;
+static pack_filter_t pack_filter = { .audio_mask = 0xFF };
+
+static bool audio_selected(int audio)
+{
+    return pack_filter.audio_mask & (1 << audio);
+}
+
+/* Return the audio stream number of the PES packet, or -1 if not audio */
+static int pes_audio_stream(const uint8_t* pes, unsigned int pes_len)
+{
+    if ((pes[3] & 0xF8) == 0xC0) {
+        return pes[3] & 0x07;
+    } else if (pes[3] == PRIVATE_STREAM_1) {
+        unsigned int header_len = pes_header_len(pes, pes_len);
+        if (header_len && header_len < pes_len) {
+            uint8_t sub_stream_id = pes[header_len];
+            if ((sub_stream_id & 0xF8) == 0x80 || (sub_stream_id & 0xF8) == 0xA0) {
+                return sub_stream_id & 0x07; /* AC-3 or LPCM */
+            }
+        }
+    }
+    return -1;
+}
+
+static bool drop_pack(const uint8_t* pack)
+{
+    if (find_mpeg_header(pack, MPEG_HEADER_LEN, PACK_ID) != 0 || (pack[4] & 0xC0) != 0x40) {
+        return false;
+    }
+    const uint8_t* pes = pack + 14 + (pack[13] & 0x07);
+    if (find_mpeg_header(pes, MPEG_HEADER_LEN, SYSTEM_HEADER_ID) == 0) {
+        pes += MPEG_HEADER_LEN + 2 + (pes[4] << 8 | pes[5]);
+        if (pes + MPEG_HEADER_LEN > pack + DVD_SECTOR_SIZE) {
+            return false;
+        }
+    }
+    if (pes[0] || pes[1] || pes[2] != 0x01) {
+        return false;
+    }
+    if (pack_filter.strip && (pes[3] == PADDING_STREAM || pes[3] == PRIVATE_STREAM_2)) {
+        return true;
+    }
+    unsigned int pes_len = MPEG_HEADER_LEN + 2 + (pes[4] << 8 | pes[5]);
+    if (pes + pes_len > pack + DVD_SECTOR_SIZE) {
+        return false;
+    }
+    int audio = pes_audio_stream(pes, pes_len);
+    return audio >= 0 && !audio_selected(audio);
+}
+
+/* An output_func_t to write only the packs not dropped,
+ * and index those that are. */
+static int filter_packs(int fd, const uint8_t* buf, unsigned int len)
+{
+    unsigned int start = 0, offset;
+    for (offset=0; offset+DVD_SECTOR_SIZE<=len; offset+=DVD_SECTOR_SIZE) {
+        if (!drop_pack(buf + offset)) {
+            if (seek_index.enabled) {
+                index_pack(buf + offset);
+            }
+        } else {
+            if (offset > start &&
+                write(fd, buf + start, offset - start) != (ssize_t)(offset - start)) {
+                return -1;
+            }
+            pack_filter.dropped += DVD_SECTOR_SIZE;
+            start = offset + DVD_SECTOR_SIZE;
+        }
+    }
+    if (len > start && write(fd, buf + start, len - start) != (ssize_t)(len - start)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*********************************************************************************
+ * Elementary stream output
+ *********************************************************************************/
+
+/*
+Rather than writing the program stream, split it into its elementary streams
+as it's read from the VRO. The first video stream is written to the main
+output file, while the other streams are written to files alongside,
+which are named according to the type of the stream.
+*/
+
+#define MAX_ES_OUTPUTS 16
+
+typedef struct {
+    char*    name;
+    int      fd;
+    uint16_t stream;  /* stream id, or 0x100 + sub stream id for private stream 1 */
+    uint16_t skip;    /* private header length to skip in each PES payload */
+} es_output_t;
+
+typedef struct {
+    char*        base;     /* name without extension */
+    struct tm*   tm;       /* timestamp to apply to the files */
+    int          video_fd; /* main output */
+    unsigned int nr_of_outputs;
+    es_output_t  outputs[MAX_ES_OUTPUTS];
+} demux_t;
+static demux_t demux;
+
+/* Start demuxing to files named from base */
+static bool demux_start(const char* base, struct tm* tm)
+{
+    demux.base = my_strndup(base, strlen(base));
+    if (!demux.base) {
+        fprintf(stderr, "Error allocating space for demux file names\n");
+        return false;
+    }
+    demux.tm = tm;
+    demux.nr_of_outputs = 0;
+    return true;
+}
+
+/* Close all but the main output */
+static void demux_end(void)
+{
+    unsigned int i;
+    for (i=0; i<demux.nr_of_outputs; i++) {
+        close(demux.outputs[i].fd);
+        touch(demux.outputs[i].name, demux.tm);
+        free(demux.outputs[i].name);
+    }
+    demux.nr_of_outputs = 0;
+    free(demux.base);
+    demux.base = NULL;
+}
+
+/* Return the output for the stream, opening it if required.
+ * NULL is returned for streams we don't output. */
+static es_output_t* demux_output(uint8_t stream_id, const uint8_t* payload, unsigned int payload_len)
+{
+    uint16_t stream = stream_id;
+    const char* ext = NULL;
+    uint16_t skip = 0;
+    if (stream_id == PRIVATE_STREAM_1) {
+        if (!payload_len) {
+            return NULL;
+        }
+        uint8_t sub_stream_id = payload[0];
+        stream = 0x100 + sub_stream_id;
+        if (sub_stream_id >= 0x80 && sub_stream_id <= 0x87) {
+            ext = "ac3"; skip = 4;
+        } else if (sub_stream_id >= 0x88 && sub_stream_id <= 0x8F) {
+            ext = "dts"; skip = 4;
+        } else if (sub_stream_id >= 0xA0 && sub_stream_id <= 0xA7) {
+            ext = "lpcm"; skip = 7;
+        }
+    } else if ((stream_id & 0xE0) == 0xC0) {
+        ext = "mpa";
+    } else if ((stream_id & 0xF0) == 0xE0) {
+        ext = "m2v";
+    }
+    if (!ext) {
+        return NULL; /* sub pictures etc. */
+    }
+
+    unsigned int i;
+    for (i=0; i<demux.nr_of_outputs; i++) {
+        if (demux.outputs[i].stream == stream) {
+            return &demux.outputs[i];
+        }
+    }
+    if (demux.nr_of_outputs == MAX_ES_OUTPUTS) {
+        return NULL;
+    }
+
+    /* The first stream of each type is named base.ext, and others base.ID.ext */
+    bool first_of_type = true;
+    for (i=0; i<demux.nr_of_outputs; i++) {
+        const char* other_ext = strrchr(demux.outputs[i].name, '.');
+        if (STREQ(other_ext+1, ext)) {
+            first_of_type = false;
+        }
+    }
+    size_t name_len = strlen(demux.base) + 16;
+    char* name = malloc(name_len);
+    if (!name) {
+        fprintf(stderr, "Error allocating space for demux file names\n");
+        exit(EXIT_FAILURE);
+    }
+    if (first_of_type) {
+        (void) snprintf(name, name_len, "%s.%s", demux.base, ext);
+    } else {
+        (void) snprintf(name, name_len, "%s.%02X.%s", demux.base, stream & 0xFF, ext);
+    }
+    int fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0666);
+    if (fd == -1) {
+        fprintf(stderr, "Error opening [%s] (%s)\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    es_output_t* output = &demux.outputs[demux.nr_of_outputs++];
+    output->name = name;
+    output->fd = fd;
+    output->stream = stream;
+    output->skip = skip;
+    return output;
+}
+
+static void demux_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                      unsigned int header_len, void* context)
+{
+    int* ret = context;
+    uint8_t* payload = pes + header_len;
+    unsigned int payload_len = pes_len - header_len;
+    int fd;
+    if (stream_id == VIDEO_STREAM_0) {
+        fd = demux.video_fd;
+    } else {
+        es_output_t* output = demux_output(stream_id, payload, payload_len);
+        if (!output || output->skip > payload_len) {
+            return;
+        }
+        fd = output->fd;
+        payload += output->skip;
+        payload_len -= output->skip;
+    }
+    if (write(fd, payload, payload_len) != (ssize_t)payload_len) {
+        *ret = -1;
+    }
+}
+
+/* An output_func_t to write the elementary streams in the packs */
+static int demux_packs(int fd, const uint8_t* buf, unsigned int len)
+{
+    int ret = 0;
+    demux.video_fd = fd;
+    unsigned int offset;
+    for (offset=0; offset+DVD_SECTOR_SIZE<=len; offset+=DVD_SECTOR_SIZE) {
+        if (drop_pack(buf + offset)) {
+            continue;
+        }
+        /* walk_pack() doesn't modify the data, but its callbacks may */
+        walk_pack((uint8_t*)buf + offset, DVD_SECTOR_SIZE, demux_pes, &ret);
+    }
+    return ret;
+}
+
+/*********************************************************************************
+ * MPEG transport stream output
+ *********************************************************************************/
+
+/*
+Repackage the PES packets from each pack into 188 byte transport stream
+packets, as they're read from the VRO. The PAT and PMT are written at the
+start of each VOBU (indicated by the RDI pack), with the streams listed
+in the PMT taken from the IFO. The PCR is taken from the SCR of each pack,
+and carried on the video PID.
+*/
+
+#define TS_PACKET_SIZE 188
+#define TS_PAT_PID 0x0000
+#define TS_PMT_PID 0x0100
+#define TS_VIDEO_PID 0x0101
+#define TS_AUDIO_PID 0x0102 /* + audio stream number */
+#define TS_PIDS 4           /* PAT, PMT, video, audio... */
+#define TS_MAX_PIDS (TS_PIDS + MAX_AUDIO_STREAMS - 1)
+
+typedef struct {
+    uint8_t*     buf;            /* output for the current call */
+    unsigned int len;
+    unsigned int allocated;
+    int          audio_coding[MAX_AUDIO_STREAMS];
+    int          nr_of_audio_streams;
+    bool         mpeg1;
+    bool         psi_written;    /* PAT and PMT written for this program */
+    uint8_t      cc[TS_MAX_PIDS]; /* continuity counters */
+    uint8_t      unused[5];
+} ts_mux_t;
+static ts_mux_t ts_mux;
+
+static uint32_t mpeg_crc32(const uint8_t* data, unsigned int len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    while (len--) {
+        crc ^= (uint32_t)*data++ << 24;
+        int bit;
+        for (bit=0; bit<8; bit++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/* Setup the streams to be listed in the PMT for a program */
+static void ts_start(const p_video_attr_t* video_attr, const p_audio_attr_t* audio_attr)
+{
+    ts_mux.mpeg1 = video_attr->mpeg1;
+    ts_mux.nr_of_audio_streams = MIN(audio_attr->nr_of_streams, MAX_AUDIO_STREAMS);
+    memcpy(ts_mux.audio_coding, audio_attr->coding, sizeof(ts_mux.audio_coding));
+    ts_mux.psi_written = false;
+    memset(ts_mux.cc, 0, sizeof(ts_mux.cc));
+}
+
+static uint8_t* ts_new_packet(void)
+{
+    if (ts_mux.len + TS_PACKET_SIZE > ts_mux.allocated) {
+        unsigned int allocated = ts_mux.allocated ? ts_mux.allocated * 2 : 64 * TS_PACKET_SIZE;
+        uint8_t* buf = realloc(ts_mux.buf, allocated);
+        if (!buf) {
+            fprintf(stderr, "Error allocating space for transport stream\n");
+            exit(EXIT_FAILURE);
+        }
+        ts_mux.buf = buf;
+        ts_mux.allocated = allocated;
+    }
+    uint8_t* packet = ts_mux.buf + ts_mux.len;
+    ts_mux.len += TS_PACKET_SIZE;
+    return packet;
+}
+
+/* Write the data to TS packets on the PID, with an optional PCR in the first */
+static void ts_write(unsigned int pid_index, uint16_t pid, const uint8_t* data, unsigned int len,
+                     bool unit_start, int64_t pcr)
+{
+    while (len || unit_start) {
+        uint8_t* packet = ts_new_packet();
+        unsigned int header_len = 4;
+        unsigned int adaptation_len = 0;
+        if (pcr >= 0) {
+            adaptation_len = 8;
+        }
+        if (header_len + adaptation_len + len < TS_PACKET_SIZE) {
+            /* stuff the last packet */
+            adaptation_len = TS_PACKET_SIZE - header_len - len;
+        }
+        packet[0] = 0x47;
+        packet[1] = (unit_start ? 0x40 : 0x00) | (pid >> 8);
+        packet[2] = pid & 0xFF;
+        packet[3] = (adaptation_len ? 0x30 : 0x10) | (ts_mux.cc[pid_index]++ & 0x0F);
+        if (adaptation_len) {
+            uint8_t* af = packet + header_len;
+            af[0] = adaptation_len - 1;
+            if (adaptation_len > 1) {
+                af[1] = 0x00;
+                unsigned int af_used = 2;
+                if (pcr >= 0) {
+                    uint64_t base = pcr / 300;
+                    unsigned int ext = pcr % 300;
+                    af[1] |= 0x10;
+                    af[2] = base >> 25;
+                    af[3] = base >> 17;
+                    af[4] = base >> 9;
+                    af[5] = base >> 1;
+                    af[6] = ((base & 0x01) << 7) | 0x7E | (ext >> 8);
+                    af[7] = ext & 0xFF;
+                    af_used = 8;
+                }
+                memset(af + af_used, 0xFF, adaptation_len - af_used);
+            }
+        }
+        unsigned int payload_len = TS_PACKET_SIZE - header_len - adaptation_len;
+        memcpy(packet + header_len + adaptation_len, data, payload_len);
+        data += payload_len;
+        len -= payload_len;
+        unit_start = false;
+        pcr = -1;
+    }
+}
+
+static void ts_write_section(unsigned int pid_index, uint16_t pid, uint8_t* section, unsigned int len)
+{
+    uint32_t crc = mpeg_crc32(section, len);
+    section[len++] = crc >> 24;
+    section[len++] = crc >> 16;
+    section[len++] = crc >> 8;
+    section[len++] = crc;
+    uint8_t data[TS_PACKET_SIZE];
+    data[0] = 0; /* pointer field */
+    memcpy(data+1, section, len);
+    ts_write(pid_index, pid, data, len+1, true, -1);
+}
+
+static void ts_write_psi(void)
+{
+    uint8_t section[TS_PACKET_SIZE];
+
+    /* PAT with a single program */
+    const uint8_t pat[] = { 0x00, 0xB0, 13, 0x00, 0x01, 0xC1, 0x00, 0x00,
+                            0x00, 0x01, 0xE0 | (TS_PMT_PID >> 8), TS_PMT_PID & 0xFF };
+    memcpy(section, pat, sizeof(pat));
+    ts_write_section(0, TS_PAT_PID, section, sizeof(pat));
+
+    /* PMT */
+    unsigned int len = 12;
+    section[0] = 0x02;
+    section[3] = 0x00; section[4] = 0x01; /* program number */
+    section[5] = 0xC1;
+    section[6] = section[7] = 0x00;
+    section[8] = 0xE0 | (TS_VIDEO_PID >> 8); section[9] = TS_VIDEO_PID & 0xFF; /* PCR PID */
+    section[10] = 0xF0; section[11] = 0x00;
+    section[len++] = ts_mux.mpeg1 ? 0x01 : 0x02;
+    section[len++] = 0xE0 | (TS_VIDEO_PID >> 8);
+    section[len++] = TS_VIDEO_PID & 0xFF;
+    section[len++] = 0xF0; section[len++] = 0x00;
+    int audio;
+    for (audio=0; audio<ts_mux.nr_of_audio_streams; audio++) {
+        uint8_t stream_type;
+        switch (ts_mux.audio_coding[audio]) {
+        case AUDIO_AC3:      stream_type = 0x81; break; /* as used by ATSC */
+        case AUDIO_MPEG1:    stream_type = 0x03; break;
+        case AUDIO_MPEG2EXT: stream_type = 0x04; break;
+        default:             continue; /* LPCM has no standard TS mapping */
+        }
+        if (!audio_selected(audio)) {
+            continue;
+        }
+        uint16_t pid = TS_AUDIO_PID + audio;
+        section[len++] = stream_type;
+        section[len++] = 0xE0 | (pid >> 8);
+        section[len++] = pid & 0xFF;
+        if (stream_type == 0x81) {
+            const uint8_t registration[] = { 0xF0, 0x06, 0x05, 0x04, 'A', 'C', '-', '3' };
+            memcpy(section+len, registration, sizeof(registration));
+            len += sizeof(registration);
+        } else {
+            section[len++] = 0xF0; section[len++] = 0x00;
+        }
+    }
+    section[1] = 0xB0 | ((len + 4 - 3) >> 8);
+    section[2] = (len + 4 - 3) & 0xFF;
+    ts_write_section(1, TS_PMT_PID, section, len);
+
+    ts_mux.psi_written = true;
+}
+
+typedef struct {
+    int64_t pcr; /* for the next video PES, or -1 */
+} ts_pack_t;
+
+static void ts_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                   unsigned int header_len, void* context)
+{
+    ts_pack_t* pack = context;
+    int audio = -1;
+    bool ac3 = false;
+    unsigned int skip = 0;
+
+    if (stream_id == VIDEO_STREAM_0) {
+        ts_write(2, TS_VIDEO_PID, pes, pes_len, true, pack->pcr);
+        pack->pcr = -1;
+        return;
+    } else if (stream_id == PRIVATE_STREAM_1 && pes_len > header_len) {
+        uint8_t sub_stream_id = pes[header_len];
+        if (sub_stream_id >= 0x80 && sub_stream_id <= 0x87) {
+            audio = sub_stream_id - 0x80;
+            ac3 = true;
+            skip = 4; /* TS carries AC-3 without the DVD sub stream header */
+        }
+    } else if ((stream_id & 0xE0) == 0xC0) {
+        audio = stream_id - 0xC0;
+    }
+    if (audio < 0 || audio >= ts_mux.nr_of_audio_streams || skip > pes_len - header_len) {
+        return;
+    }
+    if (ac3 != (ts_mux.audio_coding[audio] == AUDIO_AC3)) {
+        return; /* not as described in the PMT */
+    }
+
+    uint8_t ts_pes[DVD_SECTOR_SIZE];
+    memcpy(ts_pes, pes, header_len);
+    memcpy(ts_pes + header_len, pes + header_len + skip, pes_len - header_len - skip);
+    unsigned int ts_pes_len = pes_len - skip;
+    ts_pes[4] = (ts_pes_len - (MPEG_HEADER_LEN + 2)) >> 8;
+    ts_pes[5] = (ts_pes_len - (MPEG_HEADER_LEN + 2)) & 0xFF;
+    ts_write(3 + audio, TS_AUDIO_PID + audio, ts_pes, ts_pes_len, true, -1);
+}
+
+/* An output_func_t to write the packs as a transport stream */
+static int ts_packs(int fd, const uint8_t* buf, unsigned int len)
+{
+    ts_mux.len = 0;
+    unsigned int offset;
+    for (offset=0; offset+DVD_SECTOR_SIZE<=len; offset+=DVD_SECTOR_SIZE) {
+        uint8_t* pack = (uint8_t*) buf + offset;
+        if (find_mpeg_header(pack, MPEG_HEADER_LEN, PACK_ID) != 0 || drop_pack(pack)) {
+            continue;
+        }
+        ts_pack_t ts_pack = { .pcr = -1 };
+        if ((pack[4] & 0xC0) == 0x40) { /* MPEG2 */
+            unsigned int scr_ext = ((pack[8] & 0x03) << 7) | (pack[9] >> 1);
+            ts_pack.pcr = get_scr(pack) * 300 + scr_ext;
+        }
+        unsigned int first_pes = 14 + (pack[13] & 0x07);
+        if (!ts_mux.psi_written ||
+            find_mpeg_header(pack + first_pes, MPEG_HEADER_LEN, PRIVATE_STREAM_2) == 0) {
+            ts_write_psi(); /* at the start of each VOBU */
+        }
+        walk_pack(pack, DVD_SECTOR_SIZE, ts_pes, &ts_pack);
+    }
+    if (write(fd, ts_mux.buf, ts_mux.len) != (ssize_t)ts_mux.len) {
+        return -1;
+    }
+    return 0;
+}
+
+/*********************************************************************************
+ * Matroska output
+ *********************************************************************************/
+
+/*
+Write the video and audio frames from each pack to a Matroska file as they're
+read from the VRO. Each VOBU starts with an I frame, so a cluster is started
+at each VOBU (indicated by the RDI pack) and its position recorded in the Cues,
+which give players a seek index without needing to scan the file.
+Video is split into a block per picture at the picture start codes, as not
+every picture has a PTS. The missing times are found from the temporal
+reference (display order within the GOP) of the picture, relative to a
+picture in the GOP that did have a PTS.
+Clusters are buffered in memory so their sizes are known when written.
+If the output is seekable, the Segment size and the SeekHead entry for the
+Cues are updated at the end.
+*/
+
+#define MKV_EBML_ID 0x1A45DFA3
+#define MKV_SEGMENT_ID 0x18538067
+#define MKV_SEEKHEAD_ID 0x114D9B74
+#define MKV_SEEK_ID 0x4DBB
+#define MKV_SEEKID_ID 0x53AB
+#define MKV_SEEKPOSITION_ID 0x53AC
+#define MKV_INFO_ID 0x1549A966
+#define MKV_TRACKS_ID 0x1654AE6B
+#define MKV_CLUSTER_ID 0x1F43B675
+#define MKV_CUES_ID 0x1C53BB6B
+#define MKV_CHAPTERS_ID 0x1043A770
+#define MKV_VOID_ID 0xEC
+#define MKV_SEEK_ENTRY_LEN 21 /* a Seek with an 8 byte SeekPosition */
+#define MKV_VIDEO_TRACK 1
+#define MKV_AUDIO_TRACK 2     /* + audio stream number */
+
+typedef struct {
+    uint8_t* data;
+    size_t   len;
+    size_t   allocated;
+} ebml_buf_t;
+
+static void ebml_append(ebml_buf_t* buf, const void* data, size_t len)
+{
+    if (buf->len + len > buf->allocated) {
+        size_t allocated = buf->allocated ? buf->allocated : 4096;
+        while (buf->len + len > allocated) {
+            allocated *= 2;
+        }
+        uint8_t* new_data = realloc(buf->data, allocated);
+        if (!new_data) {
+            fprintf(stderr, "Error allocating space for matroska output\n");
+            exit(EXIT_FAILURE);
+        }
+        buf->data = new_data;
+        buf->allocated = allocated;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void ebml_put_id(ebml_buf_t* buf, uint32_t id)
+{
+    uint8_t bytes[4];
+    int len = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+    int i;
+    for (i=0; i<len; i++) {
+        bytes[i] = id >> (8 * (len-1-i));
+    }
+    ebml_append(buf, bytes, len);
+}
+
+/* Write a variable length size, using len bytes or the minimum if 0 */
+static void ebml_put_size(ebml_buf_t* buf, uint64_t size, int len)
+{
+    uint8_t bytes[8];
+    if (!len) {
+        len = 1;
+        while (len < 8 && size >= (1ULL << (7*len)) - 1) {
+            len++;
+        }
+    }
+    int i;
+    for (i=0; i<len; i++) {
+        bytes[i] = size >> (8 * (len-1-i));
+    }
+    bytes[0] |= 0x80 >> (len-1);
+    ebml_append(buf, bytes, len);
+}
+
+static void ebml_put_uint(ebml_buf_t* buf, uint32_t id, uint64_t value, int len)
+{
+    uint8_t bytes[8];
+    if (!len) {
+        len = 1;
+        while (len < 8 && (value >> (8*len))) {
+            len++;
+        }
+    }
+    int i;
+    for (i=0; i<len; i++) {
+        bytes[i] = value >> (8 * (len-1-i));
+    }
+    ebml_put_id(buf, id);
+    ebml_put_size(buf, len, 0);
+    ebml_append(buf, bytes, len);
+}
+
+static void ebml_put_float(ebml_buf_t* buf, uint32_t id, double value)
+{
+    uint64_t bits;
+    STATIC_ASSERT(sizeof(bits) == sizeof(value),"");
+    memcpy(&bits, &value, sizeof(bits));
+    ebml_put_uint(buf, id, bits, 8);
+}
+
+static void ebml_put_string(ebml_buf_t* buf, uint32_t id, const char* value)
+{
+    ebml_put_id(buf, id);
+    ebml_put_size(buf, strlen(value), 0);
+    ebml_append(buf, value, strlen(value));
+}
+
+/* Write a master element containing the child elements, and empty the children */
+static void ebml_put_master(ebml_buf_t* buf, uint32_t id, ebml_buf_t* children)
+{
+    ebml_put_id(buf, id);
+    ebml_put_size(buf, children->len, 0);
+    ebml_append(buf, children->data, children->len);
+    children->len = 0;
+}
+
+static void ebml_free(ebml_buf_t* buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->allocated = 0;
+}
+
+typedef struct {
+    ebml_buf_t data;
+    int64_t    pts;      /* -1 if no frame pending */
+    bool       keyframe;
+    uint8_t    unused[7];
+} mkv_frame_t;
+
+typedef struct {
+    ebml_buf_t   out;          /* output for the current call */
+    ebml_buf_t   cluster;      /* blocks in the current cluster */
+    ebml_buf_t   cues;         /* CuePoints */
+    mkv_frame_t  frames[1 + MAX_AUDIO_STREAMS];
+    off_t        pos;          /* bytes written to the file */
+    off_t        segment_start;
+    off_t        seek_void;    /* Void reserved for the Cues Seek */
+    int64_t      cluster_time; /* ms, or -1 if the cluster is empty */
+    int64_t      cue_time;     /* ms of the keyframe in the cluster, or -1 */
+    int64_t      video_pts;    /* PTS of the next picture starting from video_pes, or -1 */
+    int64_t      gop_pts;      /* PTS of temporal reference 0 in the GOP, or -1 */
+    size_t       video_pes;    /* offset in the video frame of the PES with video_pts */
+    size_t       video_scanned; /* bytes of the video frame searched for start codes */
+    size_t       next_unit;    /* offset of any header after the picture, or 0 */
+    int          audio_coding[MAX_AUDIO_STREAMS];
+    int          nr_of_audio_streams;
+    int          temporal_ref; /* of the picture in the video frame, or -1 */
+    uint32_t     origin;       /* video start time from the IFO */
+    uint32_t     frame_ticks;  /* 90KHz units per video frame */
+    bool         origin_mapped; /* origin is in the output time base */
+    uint8_t      unused[7];
+} mkv_mux_t;
+static mkv_mux_t mkv_mux;
+
+static int mkv_write(int fd, ebml_buf_t* buf)
+{
+    if (write(fd, buf->data, buf->len) != (ssize_t)buf->len) {
+        return -1;
+    }
+    mkv_mux.pos += buf->len;
+    buf->len = 0;
+    return 0;
+}
+
+static bool mkv_audio_supported(int coding)
+{
+    return coding == AUDIO_AC3 || coding == AUDIO_MPEG1 || coding == AUDIO_MPEG2EXT;
+}
+
+/* Write the headers for a program, with any chapters given (start times from the IFO) */
+static int mkv_start(int fd, const p_video_attr_t* video_attr, const p_audio_attr_t* audio_attr,
+                     uint32_t start_ptm, uint32_t end_ptm,
+                     const uint32_t* chapters, unsigned int nr_of_chapters)
+{
+    ebml_buf_t* out = &mkv_mux.out;
+    ebml_buf_t children = { NULL, 0, 0 };
+    ebml_buf_t grandchildren = { NULL, 0, 0 };
+
+    mkv_mux.pos = 0;
+    mkv_mux.cluster_time = mkv_mux.cue_time = -1;
+    mkv_mux.origin = start_ptm;
+    mkv_mux.origin_mapped = false;
+    mkv_mux.video_pts = mkv_mux.gop_pts = -1;
+    mkv_mux.video_scanned = mkv_mux.next_unit = 0;
+    mkv_mux.temporal_ref = -1;
+    mkv_mux.frame_ticks = (video_attr->height == 480 || video_attr->height == 240) ? 3003 : 3600;
+    mkv_mux.nr_of_audio_streams = MIN(audio_attr->nr_of_streams, MAX_AUDIO_STREAMS);
+    memcpy(mkv_mux.audio_coding, audio_attr->coding, sizeof(mkv_mux.audio_coding));
+    unsigned int i;
+    for (i=0; i<sizeof(mkv_mux.frames)/sizeof(mkv_mux.frames[0]); i++) {
+        mkv_mux.frames[i].pts = -1;
+    }
+
+    ebml_put_uint(&children, 0x4286, 1, 0);          /* EBMLVersion */
+    ebml_put_uint(&children, 0x42F7, 1, 0);          /* EBMLReadVersion */
+    ebml_put_uint(&children, 0x42F2, 4, 0);          /* EBMLMaxIDLength */
+    ebml_put_uint(&children, 0x42F3, 8, 0);          /* EBMLMaxSizeLength */
+    ebml_put_string(&children, 0x4282, "matroska");  /* DocType */
+    ebml_put_uint(&children, 0x4287, 2, 0);          /* DocTypeVersion */
+    ebml_put_uint(&children, 0x4285, 2, 0);          /* DocTypeReadVersion */
+    ebml_put_master(out, MKV_EBML_ID, &children);
+
+    ebml_put_id(out, MKV_SEGMENT_ID);
+    ebml_put_size(out, 0x00FFFFFFFFFFFFFFULL, 8);    /* unknown size, updated at end */
+    mkv_mux.segment_start = out->len;
+
+    /* Build Info and Tracks first, so their positions are known for the SeekHead */
+    ebml_buf_t info = { NULL, 0, 0 };
+    ebml_put_uint(&children, 0x2AD7B1, 1000000, 0);  /* TimecodeScale (1ms) */
+    ebml_put_string(&children, 0x4D80, "dvd-vr");    /* MuxingApp */
+    ebml_put_string(&children, 0x5741, "dvd-vr "VERSION); /* WritingApp */
+    ebml_put_float(&children, 0x4489, (double)(uint32_t)(end_ptm - start_ptm) / 90); /* Duration */
+    ebml_put_master(&info, MKV_INFO_ID, &children);
+
+    ebml_buf_t tracks = { NULL, 0, 0 };
+    ebml_buf_t track = { NULL, 0, 0 };
+    ebml_put_uint(&track, 0xD7, MKV_VIDEO_TRACK, 0); /* TrackNumber */
+    ebml_put_uint(&track, 0x73C5, MKV_VIDEO_TRACK, 0); /* TrackUID */
+    ebml_put_uint(&track, 0x83, 1, 0);               /* TrackType: video */
+    ebml_put_string(&track, 0x86, video_attr->mpeg1 ? "V_MPEG1" : "V_MPEG2");
+    if (video_attr->width > 0 && video_attr->height > 0) {
+        ebml_put_uint(&grandchildren, 0xB0, video_attr->width, 0);  /* PixelWidth */
+        ebml_put_uint(&grandchildren, 0xBA, video_attr->height, 0); /* PixelHeight */
+        if (video_attr->aspect == 2 || video_attr->aspect == 3) {
+            ebml_put_uint(&grandchildren, 0x54B0, video_attr->aspect == 3 ? 16 : 4, 0);
+            ebml_put_uint(&grandchildren, 0x54BA, video_attr->aspect == 3 ? 9 : 3, 0);
+            ebml_put_uint(&grandchildren, 0x54B2, 3, 0); /* DisplayUnit: aspect ratio */
+        }
+        ebml_put_master(&track, 0xE0, &grandchildren);
+    }
+    ebml_put_master(&children, 0xAE, &track);        /* TrackEntry */
+    int audio;
+    for (audio=0; audio<mkv_mux.nr_of_audio_streams; audio++) {
+        int coding = mkv_mux.audio_coding[audio];
+        if (!mkv_audio_supported(coding) || !audio_selected(audio)) {
+            continue; /* LPCM would need the sample format which we don't know */
+        }
+        ebml_put_uint(&track, 0xD7, MKV_AUDIO_TRACK + audio, 0);
+        ebml_put_uint(&track, 0x73C5, MKV_AUDIO_TRACK + audio, 0);
+        ebml_put_uint(&track, 0x83, 2, 0);           /* TrackType: audio */
+        ebml_put_string(&track, 0x86, coding == AUDIO_AC3 ? "A_AC3" : "A_MPEG/L2");
+        ebml_put_float(&grandchildren, 0xB5, 48000); /* SamplingFrequency */
+        if (audio_attr->channels[audio] > 0) {
+            ebml_put_uint(&grandchildren, 0x9F, audio_attr->channels[audio], 0);
+        }
+        ebml_put_master(&track, 0xE1, &grandchildren);
+        ebml_put_master(&children, 0xAE, &track);
+    }
+    ebml_put_master(&tracks, MKV_TRACKS_ID, &children);
+
+    ebml_buf_t chapter_list = { NULL, 0, 0 };
+    if (nr_of_chapters > 1) {
+        ebml_buf_t edition = { NULL, 0, 0 };
+        ebml_buf_t atom = { NULL, 0, 0 };
+        unsigned int chapter;
+        for (chapter=0; chapter<nr_of_chapters; chapter++) {
+            char name[32];
+            (void) snprintf(name, sizeof(name), "Chapter %u", chapter+1);
+            ebml_put_string(&grandchildren, 0x85, name);             /* ChapString */
+            ebml_put_uint(&atom, 0x73C4, chapter+1, 0);              /* ChapterUID */
+            ebml_put_uint(&atom, 0x91, (uint64_t)(uint32_t)(chapters[chapter] - start_ptm)
+                                       * 100000 / 9, 0);             /* ChapterTimeStart (ns) */
+            ebml_put_master(&atom, 0x80, &grandchildren);            /* ChapterDisplay */
+            ebml_put_master(&edition, 0xB6, &atom);                  /* ChapterAtom */
+        }
+        ebml_put_master(&children, 0x45B9, &edition);                /* EditionEntry */
+        ebml_put_master(&chapter_list, MKV_CHAPTERS_ID, &children);
+        ebml_free(&atom);
+        ebml_free(&edition);
+    }
+
+    /* SeekHead, with space reserved for the Cues */
+    uint64_t info_pos = 0;
+    ebml_buf_t seek = { NULL, 0, 0 };
+    ebml_put_uint(&seek, MKV_SEEKID_ID, MKV_INFO_ID, 0);
+    ebml_put_uint(&seek, MKV_SEEKPOSITION_ID, info_pos, 8); /* updated below */
+    ebml_put_master(&children, MKV_SEEK_ID, &seek);
+    ebml_put_uint(&seek, MKV_SEEKID_ID, MKV_TRACKS_ID, 0);
+    ebml_put_uint(&seek, MKV_SEEKPOSITION_ID, 0, 8);
+    ebml_put_master(&children, MKV_SEEK_ID, &seek);
+    if (chapter_list.len) {
+        ebml_put_uint(&seek, MKV_SEEKID_ID, MKV_CHAPTERS_ID, 0);
+        ebml_put_uint(&seek, MKV_SEEKPOSITION_ID, 0, 8);
+        ebml_put_master(&children, MKV_SEEK_ID, &seek);
+    }
+    size_t seek_void = children.len;
+    ebml_put_id(&children, MKV_VOID_ID);
+    ebml_put_size(&children, MKV_SEEK_ENTRY_LEN - 2, 1);
+    uint8_t zeros[MKV_SEEK_ENTRY_LEN - 2] = { 0 };
+    ebml_append(&children, zeros, sizeof(zeros));
+
+    /* Fill in the positions now the SeekHead size is known */
+    ebml_buf_t seekhead = { NULL, 0, 0 };
+    ebml_put_id(&seekhead, MKV_SEEKHEAD_ID);
+    ebml_put_size(&seekhead, children.len, 0);
+    info_pos = seekhead.len + children.len;
+    uint64_t tracks_pos = info_pos + info.len;
+    uint64_t chapters_pos = tracks_pos + tracks.len;
+    for (i=0; i<8; i++) {
+        /* SeekPositions are the last 8 bytes of each Seek */
+        children.data[MKV_SEEK_ENTRY_LEN - 8 + i] = info_pos >> (8 * (7-i));
+        children.data[2*MKV_SEEK_ENTRY_LEN - 8 + i] = tracks_pos >> (8 * (7-i));
+        if (chapter_list.len) {
+            children.data[3*MKV_SEEK_ENTRY_LEN - 8 + i] = chapters_pos >> (8 * (7-i));
+        }
+    }
+    mkv_mux.seek_void = mkv_mux.segment_start + seekhead.len + seek_void;
+    ebml_append(&seekhead, children.data, children.len);
+
+    ebml_append(out, seekhead.data, seekhead.len);
+    ebml_append(out, info.data, info.len);
+    ebml_append(out, tracks.data, tracks.len);
+    ebml_append(out, chapter_list.data, chapter_list.len);
+
+    ebml_free(&seekhead);
+    ebml_free(&chapter_list);
+    ebml_free(&seek);
+    ebml_free(&tracks);
+    ebml_free(&track);
+    ebml_free(&info);
+    ebml_free(&grandchildren);
+    ebml_free(&children);
+
+    return mkv_write(fd, out);
+}
+
+static int64_t mkv_time(int64_t pts)
+{
+    int64_t time = ((uint64_t)pts - mkv_mux.origin) & MPEG_TIME_MASK;
+    if (time > (int64_t)(MPEG_TIME_MASK / 2)) {
+        time = 0; /* before the start of the video */
+    }
+    return time / 90;
+}
+
+static void mkv_flush_cluster(void)
+{
+    if (mkv_mux.cluster_time < 0) {
+        return;
+    }
+    if (mkv_mux.cue_time >= 0) {
+        ebml_buf_t positions = { NULL, 0, 0 };
+        ebml_buf_t point = { NULL, 0, 0 };
+        ebml_put_uint(&positions, 0xF7, MKV_VIDEO_TRACK, 0); /* CueTrack */
+        ebml_put_uint(&positions, 0xF1, mkv_mux.pos + mkv_mux.out.len - mkv_mux.segment_start, 0);
+        ebml_put_uint(&point, 0xB3, mkv_mux.cue_time, 0);    /* CueTime */
+        ebml_put_master(&point, 0xB7, &positions);           /* CueTrackPositions */
+        ebml_put_master(&mkv_mux.cues, 0xBB, &point);        /* CuePoint */
+        ebml_free(&positions);
+        ebml_free(&point);
+    }
+    ebml_buf_t timecode = { NULL, 0, 0 };
+    ebml_put_uint(&timecode, 0xE7, mkv_mux.cluster_time, 0);
+    ebml_put_id(&mkv_mux.out, MKV_CLUSTER_ID);
+    ebml_put_size(&mkv_mux.out, timecode.len + mkv_mux.cluster.len, 0);
+    ebml_append(&mkv_mux.out, timecode.data, timecode.len);
+    ebml_append(&mkv_mux.out, mkv_mux.cluster.data, mkv_mux.cluster.len);
+    ebml_free(&timecode);
+    mkv_mux.cluster.len = 0;
+    mkv_mux.cluster_time = mkv_mux.cue_time = -1;
+}
+
+/* Add any pending frame for the track to the cluster as a SimpleBlock.
+ * Data without a time is dropped. */
+static void mkv_flush_frame(unsigned int track)
+{
+    mkv_frame_t* frame = &mkv_mux.frames[track - MKV_VIDEO_TRACK];
+    if (frame->pts < 0) {
+        frame->data.len = 0;
+        return;
+    }
+    int64_t time = mkv_time(frame->pts);
+    if (mkv_mux.cluster_time >= 0 &&
+        (time - mkv_mux.cluster_time > INT16_MAX || time - mkv_mux.cluster_time < INT16_MIN)) {
+        mkv_flush_cluster();
+    }
+    if (mkv_mux.cluster_time < 0) {
+        mkv_mux.cluster_time = time;
+    }
+    if (frame->keyframe && mkv_mux.cue_time < 0) {
+        mkv_mux.cue_time = time;
+    }
+    int16_t relative_time = time - mkv_mux.cluster_time;
+    uint8_t header[4] = { 0x80 | track, (uint16_t)relative_time >> 8, relative_time & 0xFF,
+                          frame->keyframe ? 0x80 : 0x00 };
+    ebml_put_id(&mkv_mux.cluster, 0xA3); /* SimpleBlock */
+    ebml_put_size(&mkv_mux.cluster, sizeof(header) + frame->data.len, 0);
+    ebml_append(&mkv_mux.cluster, header, sizeof(header));
+    ebml_append(&mkv_mux.cluster, frame->data.data, frame->data.len);
+    frame->data.len = 0;
+    frame->pts = -1;
+}
+
+/* Return the offset of the first audio frame in the payload */
+static unsigned int mkv_access_unit_start(const uint8_t* payload, unsigned int len)
+{
+    unsigned int offset;
+    for (offset=0; offset+1<len; offset++) { /* MPEG audio sync */
+        if (payload[offset] == 0xFF && (payload[offset+1] & 0xE0) == 0xE0) {
+            return offset;
+        }
+    }
+    return 0;
+}
+
+/* Write the first len bytes of the video frame as a block, keeping the rest */
+static void mkv_flush_picture(size_t len)
+{
+    ebml_buf_t* data = &mkv_mux.frames[0].data;
+    size_t rest = data->len - len;
+    data->len = len;
+    mkv_flush_frame(MKV_VIDEO_TRACK);
+    memmove(data->data, data->data + len, rest);
+    data->len = rest;
+    mkv_mux.video_pes = mkv_mux.video_pes > len ? mkv_mux.video_pes - len : 0;
+}
+
+/* Start a new picture in the video frame at offset, finding its time */
+static void mkv_start_picture(size_t offset, int temporal_ref, bool keyframe)
+{
+    mkv_frame_t* frame = &mkv_mux.frames[0];
+    int64_t last_pts = frame->pts;
+    if (mkv_mux.video_pts >= 0 && offset >= mkv_mux.video_pes) {
+        frame->pts = mkv_mux.video_pts;
+        mkv_mux.gop_pts = (mkv_mux.video_pts - (uint64_t)temporal_ref * mkv_mux.frame_ticks)
+                          & MPEG_TIME_MASK;
+        mkv_mux.video_pts = -1;
+    } else if (mkv_mux.gop_pts >= 0) {
+        frame->pts = (mkv_mux.gop_pts + (uint64_t)temporal_ref * mkv_mux.frame_ticks)
+                     & MPEG_TIME_MASK;
+    } else if (last_pts >= 0) {
+        frame->pts = (last_pts + mkv_mux.frame_ticks) & MPEG_TIME_MASK;
+    } else {
+        frame->pts = -1; /* dropped until a PTS is seen */
+    }
+    frame->keyframe = keyframe;
+    mkv_mux.temporal_ref = temporal_ref;
+    mkv_mux.next_unit = 0;
+}
+
+/* Add a video PES payload, writing a block for each complete picture */
+static void mkv_video(const uint8_t* payload, unsigned int len, int64_t pts)
+{
+    ebml_buf_t* data = &mkv_mux.frames[0].data;
+    if (pts >= 0) {
+        /* The PTS applies to the first picture starting in this packet */
+        mkv_mux.video_pts = pts;
+        mkv_mux.video_pes = data->len;
+    }
+    ebml_append(data, payload, len);
+
+    size_t offset = mkv_mux.video_scanned;
+    for (; offset+6<=data->len; offset++) {
+        const uint8_t* code = data->data + offset;
+        if (code[0] || code[1] || code[2] != 0x01) {
+            continue;
+        }
+        if (code[3] == SEQUENCE_ID || code[3] == GOP_ID) {
+            /* These headers belong with the following picture */
+            if (mkv_mux.temporal_ref >= 0 && !mkv_mux.next_unit) {
+                mkv_mux.next_unit = offset;
+            }
+            if (code[3] == GOP_ID) {
+                mkv_mux.gop_pts = -1;
+            }
+        } else if (code[3] == PICTURE_ID) {
+            int temporal_ref = (code[4] << 2) | (code[5] >> 6);
+            bool keyframe = ((code[5] >> 3) & 0x07) == 1; /* I picture */
+            if (temporal_ref == mkv_mux.temporal_ref && !mkv_mux.next_unit) {
+                /* The second field of the picture */
+                if (mkv_mux.video_pts >= 0 && offset >= mkv_mux.video_pes) {
+                    mkv_mux.video_pts = -1;
+                }
+                continue;
+            }
+            if (mkv_mux.temporal_ref >= 0) {
+                size_t unit = mkv_mux.next_unit ? mkv_mux.next_unit : offset;
+                mkv_flush_picture(unit);
+                offset -= unit;
+            }
+            mkv_start_picture(offset, temporal_ref, keyframe);
+        }
+    }
+    mkv_mux.video_scanned = offset;
+}
+
+/* Write any remaining video, which is complete at the end of a VOBU */
+static void mkv_flush_video(void)
+{
+    mkv_flush_frame(MKV_VIDEO_TRACK);
+    mkv_mux.video_pts = -1;
+    mkv_mux.video_scanned = mkv_mux.next_unit = 0;
+    mkv_mux.temporal_ref = -1;
+}
+
+static void mkv_pes(uint8_t stream_id, uint8_t* pes, unsigned int pes_len,
+                    unsigned int header_len, void* context)
+{
+    (void) context;
+    uint8_t* payload = pes + header_len;
+    unsigned int payload_len = pes_len - header_len;
+    unsigned int track = 0;
+    int audio = -1;
+    int access_unit = -1; /* offset of the first access unit, if known */
+
+    if (stream_id == VIDEO_STREAM_0) {
+        track = MKV_VIDEO_TRACK;
+    } else if (stream_id == PRIVATE_STREAM_1 && payload_len > 4) {
+        uint8_t sub_stream_id = payload[0];
+        if (sub_stream_id >= 0x80 && sub_stream_id <= 0x87) {
+            audio = sub_stream_id - 0x80;
+            /* DVD first access unit pointer, relative to the last byte of the field */
+            access_unit = ((payload[2] << 8) | payload[3]) - 1;
+            payload += 4;
+            payload_len -= 4;
+            if (audio < mkv_mux.nr_of_audio_streams && mkv_mux.audio_coding[audio] != AUDIO_AC3) {
+                return;
+            }
+        }
+    } else if ((stream_id & 0xE0) == 0xC0) {
+        audio = stream_id - 0xC0;
+        if (audio < mkv_mux.nr_of_audio_streams && mkv_mux.audio_coding[audio] == AUDIO_AC3) {
+            return;
+        }
+    }
+    if (audio >= 0) {
+        if (audio >= mkv_mux.nr_of_audio_streams || !mkv_audio_supported(mkv_mux.audio_coding[audio])) {
+            return;
+        }
+        track = MKV_AUDIO_TRACK + audio;
+    }
+    if (!track) {
+        return;
+    }
+
+    mkv_frame_t* frame = &mkv_mux.frames[track - MKV_VIDEO_TRACK];
+    int64_t pts = get_pes_pts(pes, header_len);
+    if (track == MKV_VIDEO_TRACK) {
+        mkv_video(payload, payload_len, pts);
+        return;
+    }
+    if (pts >= 0) {
+        /* The PTS applies to the first access unit starting in this packet */
+        if (access_unit < 0 || (unsigned int)access_unit > payload_len) {
+            access_unit = mkv_access_unit_start(payload, payload_len);
+        }
+        if (frame->pts >= 0) {
+            ebml_append(&frame->data, payload, access_unit);
+        }
+        mkv_flush_frame(track);
+        frame->pts = pts;
+        frame->keyframe = true;
+        payload += access_unit;
+        payload_len -= access_unit;
+    }
+    if (frame->pts >= 0) {
+        ebml_append(&frame->data, payload, payload_len);
+    }
+}
+
+static void mkv_flush_frames(void)
+{
+    mkv_flush_video();
+    unsigned int track;
+    for (track=MKV_AUDIO_TRACK; track<MKV_AUDIO_TRACK+MAX_AUDIO_STREAMS; track++) {
+        mkv_flush_frame(track);
+    }
+}
+
+/* An output_func_t to write the frames in the packs to a matroska file */
+static int mkv_packs(int fd, const uint8_t* buf, unsigned int len)
+{
+    if (!mkv_mux.origin_mapped) {
+        /* The packs may have been rebased by now */
+        mkv_mux.origin = nav_ptm(mkv_mux.origin);
+        mkv_mux.origin_mapped = true;
+    }
+    unsigned int offset;
+    for (offset=0; offset+DVD_SECTOR_SIZE<=len; offset+=DVD_SECTOR_SIZE) {
+        uint8_t* pack = (uint8_t*) buf + offset;
+        if (find_mpeg_header(pack, MPEG_HEADER_LEN, PACK_ID) != 0 || drop_pack(pack)) {
+            continue;
+        }
+        unsigned int first_pes = 14 + (pack[13] & 0x07);
+        if (find_mpeg_header(pack + first_pes, MPEG_HEADER_LEN, PRIVATE_STREAM_2) == 0) {
+            /* Start a new cluster at each VOBU */
+            mkv_flush_frames();
+            mkv_flush_cluster();
+        }
+        walk_pack(pack, DVD_SECTOR_SIZE, mkv_pes, NULL);
+    }
+    return mkv_write(fd, &mkv_mux.out);
+}
+
+/* Write the remaining frames and the Cues, and update the headers if possible */
+static int mkv_end(int fd)
+{
+    mkv_flush_frames();
+    mkv_flush_cluster();
+    off_t cues_pos = mkv_mux.pos + mkv_mux.out.len - mkv_mux.segment_start;
+    bool have_cues = mkv_mux.cues.len != 0;
+    if (have_cues) {
+        ebml_put_master(&mkv_mux.out, MKV_CUES_ID, &mkv_mux.cues);
+    }
+    int ret = mkv_write(fd, &mkv_mux.out);
+
+    if (!ret && lseek(fd, 0, SEEK_CUR) == mkv_mux.pos) { /* seekable */
+        ebml_buf_t seek = { NULL, 0, 0 };
+        ebml_buf_t entry = { NULL, 0, 0 };
+        if (have_cues) {
+            ebml_put_uint(&seek, MKV_SEEKID_ID, MKV_CUES_ID, 0);
+            ebml_put_uint(&seek, MKV_SEEKPOSITION_ID, cues_pos, 8);
+            ebml_put_master(&entry, MKV_SEEK_ID, &seek);
+        }
+        ebml_buf_t size = { NULL, 0, 0 };
+        ebml_put_size(&size, mkv_mux.pos - mkv_mux.segment_start, 8);
+        if (pwrite(fd, entry.data, entry.len, mkv_mux.seek_void) != (ssize_t)entry.len ||
+            pwrite(fd, size.data, size.len, mkv_mux.segment_start - 8) != (ssize_t)size.len) {
+            ret = -1;
+        }
+        ebml_free(&seek);
+        ebml_free(&entry);
+        ebml_free(&size);
+    }
+
+    ebml_free(&mkv_mux.cluster);
+    ebml_free(&mkv_mux.cues);
+    ebml_free(&mkv_mux.out);
+    unsigned int i;
+    for (i=0; i<sizeof(mkv_mux.frames)/sizeof(mkv_mux.frames[0]); i++) {
+        ebml_free(&mkv_mux.frames[i].data);
+    }
+    return ret;
+}
+
+/*********************************************************************************
+ * DVD-Video output
+ *********************************************************************************/
+
+/*
+Write the programs as a VIDEO_TS directory, which can be written to a disc
+to play in DVD-Video players. Each program set is a title set with a single
+title, where each program is a VOB with a single cell, and a chapter.
+Programs not in a set are a title set each, as are programs selected
+individually. A title set is also started if the VOB format changes, or if
+it would need more VOB files or chapters than DVD-Video supports.
+VOBs are split into files on VOBU boundaries, starting a new file at least
+every 1GiB and for each program. NAV packs are generated in the VOBs,
+and the IFO tables are generated from the VOBU times measured for them,
+so no rescan of the VOBs is needed. Sectors that can't be read are
+written as zeros, so the VOBs match the tables. There are no menus, and the first play PGC
+just starts the first title.
+*/
+
+#define VIDEO_TS_DIR "VIDEO_TS"
+#define VTS_MAX 99
+#define VTS_VOB_SECTORS ((1024*1024*1024) / DVD_SECTOR_SIZE) /* split VOBs at 1GiB */
+#define VTS_VOBS_MAX 9
+#define VTS_CELLS_MAX 99   /* as each is a chapter */
+#define VTS_ATR_LEN 0x21E  /* VTS attributes, copied from the VTSI_MAT */
+#define PGC_LEN 0xEC       /* PGC header */
+#define PGC_CMD_LEN 8
+#define TMAP_ENTRIES_MAX 500
+#define VTS_NAME_LEN (sizeof(VIDEO_TS_DIR "/VTS_00_0.IFO") + 12) /* room for any int */
+
+typedef struct {
+    uint32_t sectors;         /* of the whole title set */
+    uint16_t nr_of_chapters;
+    uint8_t  attr[VTS_ATR_LEN - 8]; /* VTSI_MAT from 0x100 */
+} vts_t;
+
+typedef struct {
+    uint32_t first_sector;    /* of the VOB in the title set VOBs */
+    uint32_t last_vobu;       /* start sector of the last VOBU in the title set VOBs */
+    uint32_t last_sector;
+    uint32_t duration;
+} vts_cell_t;
+
+/* The title sets written, and the one being accumulated */
+typedef struct {
+    vts_t*       vts;
+    vts_cell_t*  cells;
+    nav_vobu_t*  vobus;       /* with times from the start of the title, and an extra entry for the end */
+    struct tm    tm;          /* of the first program of the title set */
+    unsigned int nr_of_cells;
+    unsigned int nr_of_vobus;
+    unsigned int nr_of_files; /* VTS_xx_y.VOB files */
+    int          nr_of_vts;
+    int          vob_format;  /* index of the attributes of the title set */
+    int          psi;         /* program set of the title set, or 0 */
+    uint8_t      frame_rate;  /* BCD time flags */
+    uint8_t      unused[7];
+} video_ts_t;
+static video_ts_t video_ts;
+
+static void put_be16(uint8_t* buf, uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value;
+}
+
+static uint32_t sectors(size_t len)
+{
+    return (len + DVD_SECTOR_SIZE - 1) / DVD_SECTOR_SIZE;
+}
+
+/* DVD-VR also has 544 and 480 pixel wide resolutions,
+ * which DVD-Video doesn't support. */
+static bool video_ts_supported(uint16_t video_attr)
+{
+    return ((video_attr >> 3) & 0x07) <= 3;
+}
+
+/* Convert DVD-VR video attributes to DVD-Video */
+static uint16_t video_ts_video_attr(uint16_t video_attr)
+{
+    uint16_t attr = video_attr & 0xF038; /* compression, TV system, resolution */
+    if (video_attr & 0x0C00) {
+        attr |= 0x0C00;                  /* 16:9, pan-scan and letterbox allowed */
+    } else {
+        attr |= 0x0300;                  /* 4:3 */
+    }
+    return attr;
+}
+
+/* Return whether a program with the VOB files specified,
+ * can be added to the title set being accumulated */
+static bool video_ts_continues(int psi, int vob_format, unsigned int nr_of_files)
+{
+    return video_ts.nr_of_cells && psi && psi == video_ts.psi
+           && vob_format == video_ts.vob_format
+           && video_ts.nr_of_cells < VTS_CELLS_MAX
+           && video_ts.nr_of_files + nr_of_files <= VTS_VOBS_MAX;
+}
+
+/* Note the attributes of a title set being started */
+static void video_ts_start(int psi, int vob_format, const struct tm* tm)
+{
+    video_ts.psi = psi;
+    video_ts.vob_format = vob_format;
+    video_ts.tm = *tm;
+}
+
+/* Return the sectors in the VOBs of the title set being accumulated */
+static uint32_t video_ts_sectors(void)
+{
+    return video_ts.nr_of_vobus ? video_ts.vobus[video_ts.nr_of_vobus].sector : 0;
+}
+
+/* Add the VOB of a program, as written from the NAV table,
+ * as a cell in the title set being accumulated */
+static bool add_vts_cell(unsigned int nr_of_files)
+{
+    video_ts.nr_of_files += nr_of_files;
+    if (!mpeg_nav.nr_of_vobus) {
+        return true;
+    }
+    vts_cell_t* new_cells = realloc(video_ts.cells, (video_ts.nr_of_cells + 1) * sizeof(vts_cell_t));
+    if (!new_cells) {
+        fprintf(stderr, "Error allocating space for VTS cells\n");
+        return false;
+    }
+    video_ts.cells = new_cells;
+    nav_vobu_t* new_vobus = realloc(video_ts.vobus,
+                                    (video_ts.nr_of_vobus + mpeg_nav.nr_of_vobus + 1) * sizeof(nav_vobu_t));
+    if (!new_vobus) {
+        fprintf(stderr, "Error allocating space for VTS VOBUs\n");
+        return false;
+    }
+    video_ts.vobus = new_vobus;
+
+    /* Continue from the end entry of the previous cell */
+    uint32_t first_sector = video_ts_sectors();
+    uint32_t first_ptm = video_ts.nr_of_vobus ? video_ts.vobus[video_ts.nr_of_vobus].ptm : 0;
+    unsigned int vobu;
+    for (vobu=0; vobu<=mpeg_nav.nr_of_vobus; vobu++) {
+        nav_vobu_t* vts_vobu = &video_ts.vobus[video_ts.nr_of_vobus + vobu];
+        vts_vobu->sector = first_sector + mpeg_nav.played[vobu].sector;
+        vts_vobu->ptm = first_ptm + (mpeg_nav.played[vobu].ptm - mpeg_nav.played[0].ptm);
+    }
+    video_ts.nr_of_vobus += mpeg_nav.nr_of_vobus;
+
+    vts_cell_t* cell = &video_ts.cells[video_ts.nr_of_cells++];
+    cell->first_sector = first_sector;
+    cell->last_vobu = video_ts.vobus[video_ts.nr_of_vobus-1].sector;
+    cell->last_sector = video_ts.vobus[video_ts.nr_of_vobus].sector - 1;
+    cell->duration = mpeg_nav.played[mpeg_nav.nr_of_vobus].ptm - mpeg_nav.played[0].ptm;
+    video_ts.frame_rate = mpeg_nav.frame_rate;
+    return true;
+}
+
+/* Write a PGC with the pre commands specified, returning its length.
+ * A title PGC has a program and cell for each VOB of the title set. */
+static unsigned int put_pgc(uint8_t* pgc, const uint8_t* commands, unsigned int nr_of_commands,
+                            int nr_of_audio_streams, bool title)
 {
-    if (mb_src && (MB_CUR_MAX > 1)) {
-        char* cleaned = mb_clean_name(src);
-        free(src);
-        return cleaned;
+    unsigned int offset = PGC_LEN;
+    int audio;
+    for (audio=0; audio<nr_of_audio_streams; audio++) {
+        put_be16(pgc + 0x0C + audio*2, 0x8000 | (audio << 8)); /* audio control */
+    }
+    put_be16(pgc + 0xE4, offset);                        /* command table */
+    put_be16(pgc + offset, nr_of_commands);              /* pre commands */
+    put_be16(pgc + offset + 6, PGC_CMD_LEN * (1 + nr_of_commands) - 1);
+    memcpy(pgc + offset + PGC_CMD_LEN, commands, PGC_CMD_LEN * nr_of_commands);
+    offset += PGC_CMD_LEN * (1 + nr_of_commands);
+    if (!title) {
+        return offset;
     }
 
-    char* c = src;
-    while (*c) {
-        size_t good = strcspn(c, " /:?\\");
-        if (good)
-            c+=good;
-        else
-            *c++='-';
+    unsigned int nr_of_cells = video_ts.nr_of_cells;
+    uint32_t duration = video_ts.vobus[video_ts.nr_of_vobus].ptm;
+    pgc[0x02] = nr_of_cells;                             /* programs */
+    pgc[0x03] = nr_of_cells;                             /* cells */
+    put_bcd_time(pgc + 0x04, duration, video_ts.frame_rate);
+    put_be16(pgc + 0xE6, offset);                        /* program map */
+    unsigned int cell;
+    for (cell=0; cell<nr_of_cells; cell++) {
+        pgc[offset + cell] = cell + 1;                   /* entry cell */
     }
-    return src;
+    offset += (nr_of_cells + 3) & ~3U;
+    put_be16(pgc + 0xE8, offset);                        /* cell playback */
+    for (cell=0; cell<nr_of_cells; cell++) {
+        const vts_cell_t* vts_cell = &video_ts.cells[cell];
+        put_bcd_time(pgc + offset + 0x04, vts_cell->duration, video_ts.frame_rate);
+        put_be32(pgc + offset + 0x08, vts_cell->first_sector);
+        put_be32(pgc + offset + 0x10, vts_cell->last_vobu);
+        put_be32(pgc + offset + 0x14, vts_cell->last_sector);
+        offset += 24;
+    }
+    put_be16(pgc + 0xEA, offset);                        /* cell position */
+    for (cell=0; cell<nr_of_cells; cell++) {
+        put_be16(pgc + offset, cell + 1);                /* VOB id */
+        pgc[offset + 3] = 1;                             /* cell id */
+        offset += 4;
+    }
+    return offset;
 }
 
-static char* get_label_base(const psi_t* psi)
+/* Write an IFO file and its backup */
+static bool write_ifo(const char* base, const uint8_t* ifo, uint32_t ifo_sectors, struct tm* tm)
 {
-    char* title_local = text_field_convert(psi->title, sizeof(psi->title));
-    if (title_local && *title_local &&
-        strncmp(title_local, psi->label, sizeof(psi->label))) { /* if title != label */
-        title_local = clean_name(title_local, true);
-        if (!title_local) {
-          fprintf(stderr, "Error generating file name from title\n");
-          return NULL;
-        } else {
-          return title_local;
+    const char* exts[] = { ".IFO", ".BUP" };
+    unsigned int i;
+    for (i=0; i<sizeof(exts)/sizeof(exts[0]); i++) {
+        char name[VTS_NAME_LEN];
+        (void) snprintf(name, sizeof(name), "%s%s", base, exts[i]);
+        int fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0666);
+        if (fd == -1) {
+            fprintf(stderr, "Error opening [%s] (%s)\n", name, strerror(errno));
+            return false;
+        }
+        ssize_t len = (ssize_t) ifo_sectors * DVD_SECTOR_SIZE;
+        if (write(fd, ifo, len) != len) {
+            fprintf(stderr, "Error writing [%s] (%s)\n", name, strerror(errno));
+            close(fd);
+            return false;
+        }
+        close(fd);
+        if (tm) {
+            touch(name, tm);
         }
     }
-    free(title_local);
+    return true;
+}
 
-    const char* label=psi->label; /* ASCII */
-    if (*label && !STREQ(label, " ")) {
-        char* label_local = my_strndup(label, sizeof(psi->label));
-        label_local = clean_name(label_local, false);
-        return label_local;
+/* Write VTS_xx_0.IFO for the title set being accumulated, from its NAV tables,
+ * and start accumulating the next title set */
+static bool write_vts_ifo(const p_video_attr_t* video_attr, const p_audio_attr_t* audio_attr)
+{
+    if (!video_ts.nr_of_cells) {
+        video_ts.nr_of_files = 0;
+        return true;
+    }
+    vts_t* new_vts = realloc(video_ts.vts, (video_ts.nr_of_vts + 1) * sizeof(vts_t));
+    if (!new_vts) {
+        fprintf(stderr, "Error allocating space for VTS info\n");
+        return false;
+    }
+    video_ts.vts = new_vts;
+    vts_t* vts = &video_ts.vts[video_ts.nr_of_vts];
+
+    /* Each table starts on a sector boundary */
+    unsigned int nr_of_cells = video_ts.nr_of_cells;
+    uint32_t ptt_srpt_len = 12 + 4 * nr_of_cells;
+    uint32_t pgcit_len = 16 + PGC_LEN + PGC_CMD_LEN + ((nr_of_cells + 3) & ~3U) + (24 + 4) * nr_of_cells;
+    uint32_t tmapti_len = 12 + 4 + 4 * TMAP_ENTRIES_MAX;
+    uint32_t c_adt_len = 8 + 12 * nr_of_cells;
+    uint32_t admap_len = 4 + 4 * video_ts.nr_of_vobus;
+    uint32_t ptt_srpt = 1;
+    uint32_t pgcit = ptt_srpt + sectors(ptt_srpt_len);
+    uint32_t tmapti = pgcit + sectors(pgcit_len);
+    uint32_t c_adt = tmapti + sectors(tmapti_len);
+    uint32_t vobu_admap = c_adt + sectors(c_adt_len);
+    uint32_t ifo_sectors = vobu_admap + sectors(admap_len);
+    uint32_t vob_sectors = video_ts_sectors();
+    uint8_t* ifo = calloc(ifo_sectors, DVD_SECTOR_SIZE);
+    if (!ifo) {
+        fprintf(stderr, "Error allocating space for IFO\n");
+        return false;
     }
 
-    return NULL;
+    uint8_t* mat = ifo;
+    memcpy(mat, "DVDVIDEO-VTS", 12);
+    put_be32(mat + 0x0C, 2*ifo_sectors + vob_sectors - 1);  /* last sector of title set */
+    put_be32(mat + 0x1C, ifo_sectors - 1);                  /* last sector of IFO */
+    put_be16(mat + 0x20, 0x0011);                           /* version */
+    put_be32(mat + 0x80, 0x3FF);                            /* end of VTSI_MAT */
+    put_be32(mat + 0xC4, ifo_sectors);                      /* title VOBs */
+    put_be32(mat + 0xC8, ptt_srpt);
+    put_be32(mat + 0xCC, pgcit);
+    put_be32(mat + 0xD4, tmapti);
+    put_be32(mat + 0xE0, c_adt);
+    put_be32(mat + 0xE4, vobu_admap);
+    uint16_t attr = video_ts_video_attr(video_attr->attr);
+    put_be16(mat + 0x100, attr);                            /* menu video */
+    put_be16(mat + 0x200, attr);                            /* title video */
+    mat[0x203] = audio_attr->nr_of_streams;
+    int audio;
+    for (audio=0; audio<audio_attr->nr_of_streams; audio++) {
+        uint8_t* audio_mat = mat + 0x204 + audio*8;
+        audio_mat[0] = audio_attr->coding[audio] << 5;
+        audio_mat[1] = audio_attr->channels[audio] ? (audio_attr->channels[audio] - 1) & 0x07 : 1;
+    }
+
+    uint8_t* ptt = ifo + ptt_srpt*DVD_SECTOR_SIZE;
+    put_be16(ptt, 1);                                       /* titles */
+    put_be32(ptt + 4, ptt_srpt_len - 1);
+    put_be32(ptt + 8, 12);
+    unsigned int cell;
+    for (cell=0; cell<nr_of_cells; cell++) {
+        put_be16(ptt + 12 + cell*4, 1);                     /* PGC */
+        put_be16(ptt + 14 + cell*4, cell + 1);              /* program */
+    }
+
+    uint8_t* pgcs = ifo + pgcit*DVD_SECTOR_SIZE;
+    put_be16(pgcs, 1);                                      /* PGCs */
+    put_be32(pgcs + 8, 0x81000000);                         /* entry PGC for title 1 */
+    put_be32(pgcs + 12, 16);
+    unsigned int pgc_len = put_pgc(pgcs + 16, NULL, 0, audio_attr->nr_of_streams, true);
+    put_be32(pgcs + 4, 16 + pgc_len - 1);
+
+    uint8_t* tmap = ifo + tmapti*DVD_SECTOR_SIZE;
+    uint32_t duration = video_ts.vobus[video_ts.nr_of_vobus].ptm;
+    uint32_t time_unit = MAX(1, (duration / 90000 + TMAP_ENTRIES_MAX - 1) / TMAP_ENTRIES_MAX);
+    unsigned int entries = duration ? ((duration - 1) / 90000) / time_unit : 0;
+    put_be16(tmap, 1);                                      /* time maps */
+    put_be32(tmap + 4, 12 + 4 + 4*entries - 1);
+    put_be32(tmap + 8, 12);
+    tmap[12] = time_unit;
+    put_be16(tmap + 14, entries);
+    unsigned int entry;
+    for (entry=0; entry<entries; entry++) {
+        unsigned int vobu = find_nav_vobu(video_ts.vobus, video_ts.nr_of_vobus,
+                                          (entry+1) * time_unit * 90000);
+        put_be32(tmap + 16 + entry*4, video_ts.vobus[vobu].sector);
+    }
+
+    uint8_t* cells = ifo + c_adt*DVD_SECTOR_SIZE;
+    put_be16(cells, nr_of_cells);                           /* VOB ids */
+    put_be32(cells + 4, c_adt_len - 1);
+    for (cell=0; cell<nr_of_cells; cell++) {
+        uint8_t* cell_adr = cells + 8 + cell*12;
+        put_be16(cell_adr, cell + 1);                       /* VOB id */
+        cell_adr[2] = 1;                                    /* cell id */
+        put_be32(cell_adr + 4, video_ts.cells[cell].first_sector);
+        put_be32(cell_adr + 8, video_ts.cells[cell].last_sector);
+    }
+
+    uint8_t* admap = ifo + vobu_admap*DVD_SECTOR_SIZE;
+    put_be32(admap, admap_len - 1);
+    unsigned int vobu;
+    for (vobu=0; vobu<video_ts.nr_of_vobus; vobu++) {
+        put_be32(admap + 4 + vobu*4, video_ts.vobus[vobu].sector);
+    }
+
+    char ifo_base[VTS_NAME_LEN];
+    (void) snprintf(ifo_base, sizeof(ifo_base), "%s/VTS_%02d_0", VIDEO_TS_DIR, video_ts.nr_of_vts + 1);
+    bool ret = write_ifo(ifo_base, ifo, ifo_sectors, &video_ts.tm);
+    if (ret) {
+        vts->sectors = 2*ifo_sectors + vob_sectors;
+        vts->nr_of_chapters = nr_of_cells;
+        memcpy(vts->attr, mat + 0x100, sizeof(vts->attr));
+        video_ts.nr_of_vts++;
+    }
+    free(ifo);
+    free(video_ts.cells);
+    video_ts.cells = NULL;
+    free(video_ts.vobus);
+    video_ts.vobus = NULL;
+    video_ts.nr_of_cells = 0;
+    video_ts.nr_of_vobus = 0;
+    video_ts.nr_of_files = 0;
+    return ret;
 }
 
-static void print_label(const psi_t* psi)
+/* Write VIDEO_TS.IFO for all title sets written */
+static bool write_vmg_ifo(void)
 {
-    const char* label=psi->label; /* ASCII */
+    if (!video_ts.nr_of_vts) {
+        return true;
+    }
+    enum { VMGI_MAT, TT_SRPT, VTS_ATRT };
+    uint32_t atrt_len = 8 + video_ts.nr_of_vts * (4 + VTS_ATR_LEN);
+    uint32_t ifo_sectors = VTS_ATRT + sectors(atrt_len);
+    uint8_t* ifo = calloc(ifo_sectors, DVD_SECTOR_SIZE);
+    if (!ifo) {
+        fprintf(stderr, "Error allocating space for IFO\n");
+        return false;
+    }
 
-    char* title_local = text_field_convert(psi->title, sizeof(psi->title));
-    if (title_local && *title_local &&
-        strncmp(title_local, label, sizeof(psi->label))) { /* if title != label */
-        fprintf(stdinfo, "title: %s\n", title_local);
+    uint8_t* mat = ifo;
+    memcpy(mat, "DVDVIDEO-VMG", 12);
+    put_be32(mat + 0x0C, 2*ifo_sectors - 1);                /* last sector of VMG */
+    put_be32(mat + 0x1C, ifo_sectors - 1);                  /* last sector of IFO */
+    put_be16(mat + 0x20, 0x0011);                           /* version */
+    put_be16(mat + 0x26, 1);                                /* volumes */
+    put_be16(mat + 0x28, 1);                                /* volume */
+    mat[0x2A] = 1;                                          /* side */
+    put_be16(mat + 0x3E, video_ts.nr_of_vts);
+    memcpy(mat + 0x40, "dvd-vr", 6);                        /* provider */
+    put_be32(mat + 0x80, 0x3FF);                            /* end of VMGI_MAT */
+    put_be32(mat + 0x84, 0x400);                            /* first play PGC */
+    put_be32(mat + 0xC4, TT_SRPT);
+    put_be32(mat + 0xD0, VTS_ATRT);
+    memcpy(mat + 0x100, video_ts.vts[0].attr, 2);           /* menu video */
+    static const uint8_t jump_title_1[PGC_CMD_LEN] = { 0x30, 0x02, 0, 0, 0, 1, 0, 0 };
+    (void) put_pgc(mat + 0x400, jump_title_1, 1, 0, false);
+
+    uint8_t* tt_srpt = ifo + TT_SRPT*DVD_SECTOR_SIZE;
+    put_be16(tt_srpt, video_ts.nr_of_vts);                  /* titles */
+    put_be32(tt_srpt + 4, 8 + 12*video_ts.nr_of_vts - 1);
+    uint32_t vts_sector = 2*ifo_sectors;
+    int title;
+    for (title=0; title<video_ts.nr_of_vts; title++) {
+        uint8_t* tt = tt_srpt + 8 + title*12;
+        tt[0] = 0x3C;                                       /* playback type */
+        tt[1] = 1;                                          /* angles */
+        put_be16(tt + 2, video_ts.vts[title].nr_of_chapters);
+        tt[6] = title + 1;                                  /* VTS */
+        tt[7] = 1;                                          /* title in VTS */
+        put_be32(tt + 8, vts_sector);
+        vts_sector += video_ts.vts[title].sectors;
     }
-    free(title_local);
 
-    if (*label && !STREQ(label, " ")) {
-        fprintf(stdinfo, "label: %.*s\n", (int)sizeof(psi->label), label);
+    uint8_t* atrt = ifo + VTS_ATRT*DVD_SECTOR_SIZE;
+    put_be16(atrt, video_ts.nr_of_vts);
+    put_be32(atrt + 4, atrt_len - 1);
+    int vts;
+    for (vts=0; vts<video_ts.nr_of_vts; vts++) {
+        uint32_t offset = 8 + 4*video_ts.nr_of_vts + vts*VTS_ATR_LEN;
+        put_be32(atrt + 8 + vts*4, offset);
+        put_be32(atrt + offset, VTS_ATR_LEN - 1);
+        memcpy(atrt + offset + 8, video_ts.vts[vts].attr, sizeof(video_ts.vts[vts].attr));
     }
+
+    bool ret = write_ifo(VIDEO_TS_DIR "/VIDEO_TS", ifo, ifo_sectors, NULL);
+    free(ifo);
+    free(video_ts.vts);
+    video_ts.vts = NULL;
+    return ret;
 }
 
 /*********************************************************************************
- * MPEG2 processing routines
+ *                          JSON output
  *********************************************************************************/
 
 /*
-This is to both apply the aspect ratio from the IFO to the sequence header (0xB3)
-and to reset the size of any sequence display extension packets (0xB5) to
-the size of the video, as processing of this is not handled well by players.
-
-For e.g., for 16:9 recordings my camcorder leaves the aspect in the sequence
-header at 4:3 but sets the pan scan width and height appropriately in the
-sequence display extension. ffmpeg for a short time used this to compute the
-aspect, but because many MPEG streams incorrectly set the pan scan widths and
-heights, it was changed back to ignoring these when determining the aspect ratio.
-See: http://svn.ffmpeg.org/ffmpeg?view=rev&revision=15183
-Specifically for widescreen PAL movies my DVD-VR camcorder set:
-  aspect = 2 (4:3)
-  width x height = 720 x 576
-  pan scan width x height = 540 x 576
-*/
-
-#define MPEG_HEADER_LEN 4
-#define SEQUENCE_ID 0xB3
-#define SEQUENCE_EXTENSION_ID 0xB5
-#define VIDEO_STREAM_0 0xE0 /* I've only seen E0 on dvd-vr discs (E0-F possible) */
-#define SEQUENCE_LEN 4 /* length of data we need to parse from sequence packet */
-#define SEQUENCE_EXTENSION_LEN 5 /* length of data we need to parse from sequence extension packet */
-#define VIDEO_STREAM_LEN 3 /* length of data we need to parse from video stream packet */
+ * With --json, a JSON object is written to stdout for the disc, and then
+ * for each program as it's processed, one per line (NDJSON). Each line is
+ * flushed so that a reader on a pipe sees the programs as they complete.
+ * The free form info that's otherwise written to stdout is discarded.
+ *
+ * Text is converted to UTF-8 irrespective of the locale, and numbers are
+ * written without any locale specific formatting. Times are in seconds
+ * and offsets and sizes in bytes.
+ * A program that's skipped, for example as its output couldn't be opened,
+ * is written with just its number and an "error" message, which is
+ * otherwise null.
+ */
 
-/* Return offset to header or -1 if not found */
-static int find_mpeg_header(const uint8_t* buf, const unsigned int bs, const uint8_t type)
+static void json_string(const char* str)
 {
-    unsigned int offset=0;
-    uint32_t header = 0x00000100 + type;
-    NTOHL(header);
-    while (offset <= bs - sizeof (header)) {
-        if (*(uint32_t*)(buf+offset) == header)
-            return offset;
-        offset++;
+    if (!str) {
+        fputs("null", stdout);
+        return;
     }
-    return -1;
+    putchar('"');
+    const unsigned char* c;
+    for (c=(const unsigned char*)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
 }
 
-static int sequence_offset;
-static uint8_t sequence_aspect;
+/* Write a string in the locale encoding, such as a file name,
+ * or null if it can't be converted */
+static void json_local_string(const char* str)
+{
+    char* str_utf8 = NULL;
+    if (str) {
+        size_t len = strlen(str) + 1; /* convert NUL also */
+        str_utf8 = malloc(len * MB_LEN_MAX);
+        if (str_utf8 && !text_convert(str, len, str_utf8, len * MB_LEN_MAX, sys_charset, "UTF-8")) {
+            free(str_utf8);
+            str_utf8 = NULL;
+        }
+    }
+    json_string(str_utf8);
+    free(str_utf8);
+}
 
-/* reset cached values for each program */
-static void init_mpeg2_cache(void)
+/* Write a text field from the disc, or null if it's empty */
+static void json_text_field(const char* field, unsigned int len)
 {
-    sequence_offset = -1;
-    sequence_aspect = -1;
+    char* txt_utf8 = NULL;
+    if (*field && !(len > 1 && *field == ' ' && !field[1])) {
+        txt_utf8 = text_field_convert_to(field, len, "UTF-8");
+    }
+    json_string(txt_utf8 && *txt_utf8 ? txt_utf8 : NULL);
+    free(txt_utf8);
 }
 
-static p_video_attr_t get_sequence_aspect(const uint8_t* buf)
+/* Write a 90KHz time in seconds, to millisecond precision */
+static void print_seconds(uint64_t pts)
 {
-    p_video_attr_t s_video_attr;
-    s_video_attr.width = s_video_attr.height = -1;
-    uint8_t aspect_byte = *(buf + sequence_offset + MPEG_HEADER_LEN + 3);
-    s_video_attr.aspect = aspect_byte >> 4;
-    return s_video_attr;
+    uint64_t ms = pts / 90;
+    printf("%"PRIu64".%03u", ms / 1000, (unsigned int)(ms % 1000));
 }
 
-static void set_sequence_aspect(uint8_t* buf, const unsigned int offset, p_video_attr_t s_video_attr)
+static void json_disc(const ifo_t* ifo)
 {
-    uint8_t aspect_byte = *(buf + offset + MPEG_HEADER_LEN + 3);
-    aspect_byte = (aspect_byte & 0x0F) | ((uint8_t) s_video_attr.aspect) << 4;
-    *(buf + sequence_offset + MPEG_HEADER_LEN + 3) = aspect_byte;
+    printf("{\"type\":\"disc\",\"format\":\"DVD-VR V%d.%d\",\"cprm\":%s",
+           ifo->version>>4, ifo->version&0x0F, ifo->cprm_supported ? "true" : "false");
+    /* The non redundant disc info, as listed by print_disc_info() */
+    fputs(",\"info\":[", stdout);
+    const char* fields[] = { ifo->disc_info2, ifo->disc_info1 };
+    unsigned int field, nr_of_info=0;
+    for (field=0; field<sizeof(fields)/sizeof(fields[0]); field++) {
+        if (field && !strncmp(ifo->disc_info1, ifo->disc_info2, sizeof(ifo->disc_info1))) {
+            break;
+        }
+        char* txt_utf8 = text_field_convert_to(fields[field], sizeof(ifo->disc_info1), "UTF-8");
+        if (txt_utf8 && *txt_utf8 && !disc_info_redundant(txt_utf8)) {
+            if (nr_of_info++) {
+                putchar(',');
+            }
+            json_string(txt_utf8);
+        }
+        free(txt_utf8);
+    }
+    putchar(']');
+    printf(",\"programs\":%u,\"info_tables\":%u,\"playlists\":%u,\"still_groups\":%u}\n",
+           (unsigned int)ifo->nr_of_programs, (unsigned int)ifo->nr_of_pgi,
+           (unsigned int)ifo->nr_of_playlists, (unsigned int)ifo->nr_of_still_groups);
+    fflush(stdout);
 }
 
-static p_video_attr_t get_sequence_display_extension_sizes(const uint8_t* buf, const unsigned int offset)
+/*
+ * Write the info for the range of a program, after it's processed.
+ * sectors is the size of the range in the VRO, and file is the
+ * first file it was extracted to, if any.
+ */
+static void json_program(const ifo_t* ifo, unsigned int program, const vobu_range_t* range,
+                         uint64_t sectors, const char* file, bool read_error)
 {
-    p_video_attr_t e_video_attr;
-    e_video_attr.aspect=-1;
+    const ifo_program_t* info = &ifo->programs[program];
 
-    uint8_t type = *(buf + offset + MPEG_HEADER_LEN);
-    int skip_colour=(type&0x01) ? 3 : 0;
-    const uint8_t* display_size = buf + offset + MPEG_HEADER_LEN + skip_colour + sizeof (type);
-    uint16_t horiz_disp_size  = *(display_size) << 6;
-            horiz_disp_size += *(display_size+1) >> 2;
-    uint16_t vert_disp_size = (*(display_size+1) & 0x01) << 13;
-            vert_disp_size += *(display_size+2) << 5;
-            vert_disp_size += *(display_size+3) >> 3;
+    printf("{\"type\":\"program\",\"program\":%u", program+1);
+    const ifo_psi_t* psi = find_program_text_info(ifo, program+1);
+    fputs(",\"title\":", stdout);
+    if (psi) {
+        json_text_field(psi->title, sizeof(psi->title));
+    } else {
+        json_string(NULL);
+    }
+    fputs(",\"label\":", stdout);
+    if (psi) {
+        json_text_field(psi->label, sizeof(psi->label));
+    } else {
+        json_string(NULL);
+    }
 
-    e_video_attr.width = horiz_disp_size;
-    e_video_attr.height = vert_disp_size;
+    struct tm tm;
+    char date_str[32];
+    fputs(",\"date\":", stdout);
+    if (decode_pgtm(info->timestamp, &tm)) {
+        strftime(date_str, sizeof(date_str), "%Y-%m-%dT%H:%M:%S", &tm);
+        json_string(date_str);
+    } else {
+        json_string(NULL);
+    }
+
+    printf(",\"vob_format\":%u,\"info_table\":%u,\"vobus\":%u",
+           (unsigned int)info->vob_format_id, (unsigned int)info->pgi+1, range->nr_of_vobus);
+    printf(",\"offset\":%"PRIu64",\"size\":%"PRIu64,
+           ((uint64_t)info->vob_offset + range->sector) * DVD_SECTOR_SIZE, sectors * DVD_SECTOR_SIZE);
+    fputs(",\"start\":", stdout);
+    print_seconds((range->start_ptm - info->start_ptm) & 0xFFFFFFFF);
+    fputs(",\"duration\":", stdout);
+    print_seconds((range->end_ptm - range->start_ptm) & 0xFFFFFFFF);
+
+    fputs(",\"chapters\":[", stdout);
+    unsigned int nr_of_chapters;
+    uint32_t* chapters = range_chapters(info, range, &nr_of_chapters);
+    if (chapters) {
+        unsigned int chapter;
+        for (chapter=0; chapter<nr_of_chapters; chapter++) {
+            if (chapter) {
+                putchar(',');
+            }
+            print_seconds((chapters[chapter] - info->start_ptm) & 0xFFFFFFFF);
+        }
+        free(chapters);
+    }
+    putchar(']');
 
-    return e_video_attr;
+    /* Only known if the VRO was read */
+    const char* encryption = NULL;
+    switch (ifo_program_attrs[program].scrambled) {
+    case UNSCRAMBLED:
+        encryption = "clear";
+        break;
+    case SCRAMBLED:
+        encryption = "scrambled";
+        break;
+    case PARTIALLY_SCRAMBLED:
+        encryption = "partially scrambled";
+        break;
+    case SCRAMBLED_UNSET:
+        break;
+    }
+    fputs(",\"encryption\":", stdout);
+    json_string(encryption);
+    fputs(",\"file\":", stdout);
+    json_local_string(file);
+    printf(",\"read_error\":%s,\"error\":null}\n", read_error ? "true" : "false");
+    fflush(stdout);
 }
 
-static void set_sequence_display_extension_sizes(uint8_t* buf, const unsigned int offset, p_video_attr_t e_video_attr)
+static void json_skipped_program(unsigned int program, const char* error)
 {
-    uint16_t horiz_disp_size = e_video_attr.width;
-    uint16_t vert_disp_size = e_video_attr.height;
+    printf("{\"type\":\"program\",\"program\":%u,\"error\":", program+1);
+    json_local_string(error); /* may include a localized system error */
+    fputs("}\n", stdout);
+    fflush(stdout);
+}
 
-    uint8_t type = *(buf + offset + MPEG_HEADER_LEN);
-    int skip_colour=(type&0x01) ? 3 : 0;
-    uint8_t* display_size = buf + offset + MPEG_HEADER_LEN + skip_colour + sizeof (type);
+/*********************************************************************************
+ *                          Bitrate profile
+ *********************************************************************************/
 
-    /* One could precalc this per program, but frequency is low so not worth the effort */
-    *(uint32_t*)display_size = htonl(0x00020000);
-    *(display_size)   |= (horiz_disp_size >> 6);
-    *(display_size+1) |= (horiz_disp_size << 2);
-    *(display_size+1) |= ((vert_disp_size >> 13) & 0x01);
-    *(display_size+2) |= (vert_disp_size >> 5);
-    *(display_size+3) |= (vert_disp_size << 3);
-}
+/*
+ * The duration and bitrate over time of each program, from the IFO alone.
+ * The duration is from the video start and end times, and the bitrate is
+ * given per VOBU from its size and duration in the VOBU info. If the VOBU
+ * durations aren't recorded, they're assumed to be equal as in find_vobu().
+ * The profile is written to stdout as CSV, or as a JSON object per program
+ * in the same stream as --json.
+ */
 
-static void check_mpeg_encryption(uint8_t* buf, const unsigned int bs, const unsigned int program)
+typedef enum {
+    PROFILE_NONE,
+    PROFILE_CSV,
+    PROFILE_JSON
+} profile_format_t;
+
+/* Return the bitrate in kbit/s of sectors played over ptm 90KHz units */
+static uint64_t profile_kbps(uint64_t sectors, uint64_t ptm)
 {
-    /* Note we'll warn below if we've not seen any video stream (E0 doesn't match).
-     * Note also I've only seen AC-3 audio on 0xBD and it has also been
-     * encrypted on discs I've seen.  */
-    if (ifo_program_attrs[program].scrambled != PARTIALLY_SCRAMBLED) {
-        int pes_offset = find_mpeg_header(buf, bs-VIDEO_STREAM_LEN, VIDEO_STREAM_0);
-        if (pes_offset >= 0) {
-            /* extension header is always available for 0xBD and 0xE? types */
-            uint8_t scramble_byte = *(buf + pes_offset + MPEG_HEADER_LEN + 2);
-            bool scrambled;
-            if ((scramble_byte & 0xC0) == 0x80) { /* MPEG2 */
-                scrambled = scramble_byte & 0x30;
-            } else {
-                scrambled = false; /* assuming MPEG1 doesn't support encryption */
-            }
-            if (ifo_program_attrs[program].scrambled != SCRAMBLED_UNSET &&
-                ifo_program_attrs[program].scrambled != scrambled) {
-                ifo_program_attrs[program].scrambled = PARTIALLY_SCRAMBLED;
-            } else {
-                ifo_program_attrs[program].scrambled = scrambled;
-            }
-        }
+    if (!ptm) {
+        return 0;
     }
+    return sectors * DVD_SECTOR_SIZE * 8 * 90 / ptm;
 }
 
-static void fix_mpeg2_aspect(uint8_t* buf, const unsigned int bs, const unsigned int program)
+static void write_profile_header(profile_format_t format)
 {
-    static int sector;
-    bool found_sequence_header = false;
-    const bool look_harder = false; /* Should never need to be set to true as far as I can see */
-
-    p_video_attr_t ifo_video_attr = ifo_video_attrs[ifo_program_attrs[program].video_attr];
-    if (ifo_video_attr.aspect < 2) {
-        sector++;
-        return;
+    if (format == PROFILE_CSV) {
+        printf("program,vobu,start,duration,offset,size,kbps\n");
     }
+}
 
-    p_video_attr_t s_video_attr = { .aspect=ifo_video_attr.aspect, .width=-1, .height=-1 };
-
-    if (sequence_offset == -1) {
-        if ((sequence_offset = find_mpeg_header(buf, bs-SEQUENCE_LEN, SEQUENCE_ID)) >= 0) {
-            found_sequence_header = true;
-#ifndef NDEBUG
-            fprintf(stdinfo,"Found SH  @ %d+%d\n", sector, sequence_offset);
-#endif
-            sequence_aspect = get_sequence_aspect(buf).aspect;
-            if (sequence_aspect != ifo_video_attr.aspect) {
-                set_sequence_aspect(buf, sequence_offset, s_video_attr);
-            }
-        }
-    } else {
-        if (find_mpeg_header(buf+sequence_offset, MPEG_HEADER_LEN, SEQUENCE_ID)==0) {
-            found_sequence_header = true;
-#ifndef NDEBUG
-            fprintf(stdinfo,"Found SH  @ %d+%d\n", sector, sequence_offset);
-#endif
-            if (sequence_aspect!=ifo_video_attr.aspect)
-                set_sequence_aspect(buf, sequence_offset, s_video_attr);
-        } else if (look_harder) {
-        /* I can't see why the sequence headers would be at arbitrary offsets in each sector,
-         * and I've analyzed about 10 different VROs and they all have the same offsets.
-         * So I think that doing this will only redundantly scan every byte of sectors
-         * without sequence headers. */
-            int curr_offset = find_mpeg_header(buf, bs-SEQUENCE_LEN, SEQUENCE_ID);
-            if (curr_offset >= 0) {
-                found_sequence_header = true;
-                sequence_offset = curr_offset;
-#ifndef NDEBUG
-                fprintf(stdinfo,"Found SH @ %d+%d\n", sector, sequence_offset);
-#endif
-                set_sequence_aspect(buf, sequence_offset, s_video_attr);
-            } else {
-            }
+static void write_profile(const ifo_program_t* info, unsigned int program, bool ntsc,
+                          const vobu_range_t* range, profile_format_t format)
+{
+    uint64_t duration = (info->end_ptm - info->start_ptm) & 0xFFFFFFFF;
+    uint64_t start = (range->start_ptm - info->start_ptm) & 0xFFFFFFFF;
+    uint64_t end = (range->end_ptm - info->start_ptm) & 0xFFFFFFFF;
+    uint64_t offset = ((uint64_t)info->vob_offset + range->sector) * DVD_SECTOR_SIZE;
+    unsigned int end_vobu = range->first_vobu + range->nr_of_vobus;
+
+    if (format == PROFILE_JSON) {
+        uint64_t sectors = 0;
+        unsigned int vobu;
+        for (vobu=range->first_vobu; vobu<end_vobu; vobu++) {
+            sectors += info->vobus[vobu].sectors;
         }
+        printf("{\"type\":\"profile\",\"program\":%u,\"start\":", program+1);
+        print_seconds(start);
+        fputs(",\"duration\":", stdout);
+        print_seconds(end - start);
+        printf(",\"size\":%"PRIu64",\"kbps\":%"PRIu64",\"vobus\":[",
+               sectors * DVD_SECTOR_SIZE, profile_kbps(sectors, end - start));
     }
 
-    /* As an optimization, only look for sequence display extension, if there
-     * is a sequence header in this sector. */
-    if (found_sequence_header || look_harder) {
-        if (ifo_video_attr.width <= 0 || ifo_video_attr.height <= 0) {
-            sector++;
-            return;
+    uint64_t time = start;
+    unsigned int vobu;
+    for (vobu=range->first_vobu; vobu<end_vobu; vobu++) {
+        uint64_t vobu_end;
+        if (info->total_fields) {
+            vobu_end = time + fields_to_ptm(info->vobus[vobu].fields, ntsc);
+        } else {
+            vobu_end = duration * (vobu + 1) / info->nr_of_vobus;
         }
-        int extension_offset = look_harder ? 0 : sequence_offset + MPEG_HEADER_LEN + SEQUENCE_LEN;
-        int next_offset;
-        while ((next_offset = find_mpeg_header(buf + extension_offset,
-                                               bs - extension_offset - SEQUENCE_EXTENSION_LEN,
-                                               SEQUENCE_EXTENSION_ID)) >= 0) {
-            extension_offset += next_offset;
-            uint8_t type = *(buf + extension_offset + MPEG_HEADER_LEN);
-            if ((type&0xF0) == 0x20) {
-                p_video_attr_t e_video_attr = get_sequence_display_extension_sizes(buf, extension_offset);
-#ifndef NDEBUG
-                fprintf(stdinfo, "Found SDE @ %d+%d (%d x %d)\n", sector, extension_offset, e_video_attr.width, e_video_attr.height);
-#endif
-                e_video_attr.width = ifo_video_attr.width;
-                e_video_attr.height = ifo_video_attr.height;
-                set_sequence_display_extension_sizes(buf, extension_offset, e_video_attr);
-#ifndef NDEBUG
-                e_video_attr = get_sequence_display_extension_sizes(buf, extension_offset);
-                fprintf(stdinfo, "New   SDE @ %d+%d (%d x %d)\n", sector, extension_offset, e_video_attr.width, e_video_attr.height);
-#endif
-                break; /* Should be only 1 of these per sector */
-            } else {
-#ifndef NDEBUG
-                fprintf(stdinfo, "Found SE  @ %d+%d (type=%d)\n", sector, extension_offset, (type&0xF0)>>4);
-#endif
+        vobu_end = MIN(vobu_end, duration);
+        if (vobu+1 == end_vobu) {
+            vobu_end = end; /* as reported for the range */
+        }
+        vobu_end = MAX(vobu_end, time);
+        uint16_t sectors = info->vobus[vobu].sectors;
+        uint64_t kbps = profile_kbps(sectors, vobu_end - time);
+
+        if (format == PROFILE_JSON) {
+            if (vobu != range->first_vobu) {
+                putchar(',');
             }
-            extension_offset++;
+            fputs("{\"start\":", stdout);
+            print_seconds(time);
+            fputs(",\"duration\":", stdout);
+            print_seconds(vobu_end - time);
+            printf(",\"offset\":%"PRIu64",\"size\":%u,\"kbps\":%"PRIu64"}",
+                   offset, sectors * DVD_SECTOR_SIZE, kbps);
+        } else {
+            printf("%u,%u,", program+1, vobu+1);
+            print_seconds(time);
+            putchar(',');
+            print_seconds(vobu_end - time);
+            printf(",%"PRIu64",%u,%"PRIu64"\n", offset, sectors * DVD_SECTOR_SIZE, kbps);
         }
+        offset += (uint64_t)sectors * DVD_SECTOR_SIZE;
+        time = vobu_end;
     }
 
-    sector++;
-}
-
-/* Haven't had a request to do this yet:
-   http://forum.doom9.org/archive/index.php/t-102969.html
-   Note code there makes incorrect assumptions about offsets I think.  */
-static void add_mpeg_nav(uint8_t* buf, const unsigned int bs)
-{
-    (void) buf; (void) bs;
-}
-
-void process_mpeg2(uint8_t* buf, const unsigned int bs, void* program)
-{
-    fix_mpeg2_aspect(buf, bs, *(const unsigned int*)program);
-    add_mpeg_nav(buf, bs);
-    check_mpeg_encryption(buf, bs, *(const unsigned int*)program);
+    if (format == PROFILE_JSON) {
+        printf("]}\n");
+    }
+    fflush(stdout);
 }
 
 /*********************************************************************************
@@ -1244,8 +6691,36 @@ void process_mpeg2(uint8_t* buf, const unsigned int bs, void* program)
  *********************************************************************************/
 
 unsigned long required_program=0; /* process all programs by default */
+unsigned long required_playlist=0; /* extract this playlist rather than the programs */
+bool fixups=false; /* plan MPEG fixups in a pre-pass and write them to a sidecar */
+bool probe=false; /* sample the VRO to report encryption rather than extracting */
+bool clear_only=false; /* only extract the unscrambled VOBUs */
+bool rebase_time=false; /* rewrite MPEG timestamps to start at 0 */
+bool nav_packs=false; /* convert RDI packs to DVD-Video NAV packs */
+bool strip=false; /* drop padding and RDI packs from the output */
+bool write_index=false; /* write a seek index alongside the vob files */
+bool write_captions=false; /* write closed captions alongside the vob files */
+uint32_t split_sectors=0; /* max sectors per output file, or 0 to not split */
+bool time_range=false; /* only process the VOBUs covering range_start to range_end */
+uint64_t range_start=0, range_end=UINT64_MAX; /* 90KHz units from the start of each program */
+chapter_mode_t chapter_mode=CHAPTERS_NONE;
+
+typedef enum {
+    FORMAT_VOB,
+    FORMAT_ES,
+    FORMAT_TS,
+    FORMAT_MKV,
+    FORMAT_VIDEO_TS
+} output_format_t;
+output_format_t output_format=FORMAT_VOB;
+const char* output_ext=".vob";
+output_func_t output_func=NULL; /* write() the packs by default */
 const char* ifo_name=NULL;
 const char* vro_name=NULL;
+const char* still_vro_name=NULL; /* VR_STILL.VRO to extract the stills from */
+const char* cache_dir=NULL; /* directory to cache the decoded IFO in */
+bool json_output=false; /* write NDJSON to stdout rather than the info */
+profile_format_t profile_format=PROFILE_NONE; /* write the bitrate profile to stdout */
 
 static void usage(char** argv, int error)
 {
@@ -1259,12 +6734,109 @@ static void usage(char** argv, int error)
                    "\n"
                    "  -p, --program=NUM  Only process program NUM rather than all programs.\n"
                    "\n"
+                   "      --playlist=NUM Extract the cells of user defined program set NUM\n"
+                   "                     in playback order to playlistNUM.vob, or to\n"
+                   "                     NAME_playlistNUM.vob. Only vob output is supported,\n"
+                   "                     without the options that modify the program stream.\n"
+                   "\n"
                    "  -n, --name=NAME    Specify a basename to use for extracted vob files\n"
                    "                     rather than using one based on the timestamp.\n"
                    "                     If you pass `-' the vob files will be written to stdout.\n"
                    "                     If you pass `[label]' the names will be based on\n"
                    "                     a sanitized version of the title or label.\n"
                    "\n"
+                   "      --fixups       Find the MPEG fixups needed in a quick pre-pass over\n"
+                   "                     the start of each VOBU, and write them to a NAME.fixups\n"
+                   "                     file alongside each vob. The planned fixups are then\n"
+                   "                     applied while copying, rather than searching all data.\n"
+                   "\n"
+                   "      --probe        Quickly sample the start of each VOBU in the VRO, to\n"
+                   "                     report the time ranges of each program that are\n"
+                   "                     encrypted. Nothing is extracted.\n"
+                   "\n"
+                   "      --clear-only   Probe as above and only extract the runs of unscrambled\n"
+                   "                     VOBUs. Encrypted VOBUs are not read. Each extra run is\n"
+                   "                     written to a separate NAME_2.vob, NAME_3.vob, ... file.\n"
+                   "\n"
+                   "      --rebase-time  Rewrite the SCR, PTS and DTS timestamps so that each\n"
+                   "                     program starts at 0, and is continuous across any\n"
+                   "                     deleted or skipped data.\n"
+                   "\n"
+                   "      --strip        Drop the padding and RDI packs from the output,\n"
+                   "                     and report the bytes saved for each program.\n"
+                   "                     Only supported with vob output, without --nav or\n"
+                   "                     --fixups.\n"
+                   "\n"
+                   "      --audio=LIST   Only output the audio streams in the comma separated\n"
+                   "                     LIST, numbered from 0 as listed. e.g. --audio=0\n"
+                   "                     Not supported with --nav or --fixups.\n"
+                   "\n"
+                   "      --index        Write a seek index of the VOBUs and I frames to\n"
+                   "                     NAME.idx, with their offsets in NAME.vob and PTS.\n"
+                   "                     Each NAME_N.vob part of a split program has its\n"
+                   "                     own NAME_N.idx.\n"
+                   "\n"
+                   "      --start=TIME   Only process the VOBUs of each program from TIME,\n"
+                   "                     given as [[HH:]MM:]SS[.frac] from the program start.\n"
+                   "      --end=TIME     Only process the VOBUs of each program up to TIME,\n"
+                   "                     or for a duration after the start if TIME is +TIME.\n"
+                   "                     The VOBUs are found from the IFO, so nothing before\n"
+                   "                     or after the range is read from the VRO.\n"
+                   "\n"
+                   "      --split-size=SIZE  Start a new NAME_2.vob, NAME_3.vob, ... file before\n"
+                   "                     any VOBU that would take the file over SIZE bytes.\n"
+                   "                     SIZE may have a K, M or G suffix. e.g. 4095M\n"
+                   "                     Only supported with vob or ts output.\n"
+                   "\n"
+                   "      --chapters=MODE  Use the chapter marks from the IFO, which are\n"
+                   "                     always listed, to:\n"
+                   "                       split  Write each chapter to a separate NAME.vob,\n"
+                   "                              NAME_2.vob, ... file, starting at the\n"
+                   "                              VOBU containing the chapter mark.\n"
+                   "                              Only supported with vob or ts output.\n"
+                   "                       marks  Add the chapters to the output.\n"
+                   "                              Only supported with mkv output.\n"
+                   "\n"
+                   "      --captions     Extract any line 21 closed captions in the video to\n"
+                   "                     NAME.scc, and the first caption channel to NAME.srt.\n"
+                   "                     These cover all the parts of a split program,\n"
+                   "                     timed from the start of the program.\n"
+                   "\n"
+                   "      --nav          Convert the RDI pack at the start of each VOBU to a\n"
+                   "                     DVD-Video NAV pack, to support seeking and fast\n"
+                   "                     forward in players. Each VOBU is held in memory\n"
+                   "                     so its NAV pack can describe its pictures.\n"
+                   "                     Not supported with --clear-only, or --format other\n"
+                   "                     than vob or video_ts.\n"
+                   "\n"
+                   "      --format=FMT   Write the programs in the specified format:\n"
+                   "                       vob  MPEG program stream (the default).\n"
+                   "                       es   Elementary streams. NAME.m2v for video, and\n"
+                   "                            NAME.ac3, NAME.mpa or NAME.lpcm for audio.\n"
+                   "                       ts   MPEG transport stream.\n"
+                   "                       mkv  Matroska, with a seek index of the VOBUs.\n"
+                   "                       video_ts  A DVD-Video VIDEO_TS directory with a\n"
+                   "                            title for each program set, with a\n"
+                   "                            chapter for each program. Implies --nav.\n"
+                   "\n"
+                   "      --stills=FILE  Extract the stills listed in the IFO from FILE,\n"
+                   "                     usually VR_STILL.VRO, to NAME_stillNNN.vob files,\n"
+                   "                     including any audio recorded with each still.\n"
+                   "\n"
+                   "      --cache=DIR    Cache the decoded IFO in DIR, keyed by a hash of the\n"
+                   "                     IFO, so later runs over the same disc can skip\n"
+                   "                     decoding it. A changed IFO is decoded again.\n"
+                   "\n"
+                   "      --profile=FMT  Write the duration and bitrate of each VOBU of the\n"
+                   "                     programs, found from the IFO alone, to stdout as:\n"
+                   "                       csv   A line per VOBU.\n"
+                   "                       json  An object per program, as for --json.\n"
+                   "                     Not supported with -n -\n"
+                   "\n"
+                   "      --json         Write the disc and program info to stdout as JSON\n"
+                   "                     objects, one per line, with each program written\n"
+                   "                     as it's processed. Not supported with -n -\n"
+                   "\n"
                    "      --help         Display this help and exit.\n"
                    "      --version      Output version information and exit.\n"
                    ,argv[0]);
@@ -1278,12 +6850,32 @@ static void get_options(int argc, char** argv)
         /* I'm using capitals for long options
          * without a corresponding short option. */
         {"program", required_argument, NULL, 'p'},
+        {"playlist", required_argument, NULL, 'U'},
         {"name", required_argument, NULL, 'n'},
+        {"fixups", no_argument, NULL, 'F'},
+        {"probe", no_argument, NULL, 'P'},
+        {"clear-only", no_argument, NULL, 'C'},
+        {"rebase-time", no_argument, NULL, 'T'},
+        {"nav", no_argument, NULL, 'N'},
+        {"strip", no_argument, NULL, 'S'},
+        {"audio", required_argument, NULL, 'A'},
+        {"index", no_argument, NULL, 'I'},
+        {"captions", no_argument, NULL, 'L'},
+        {"split-size", required_argument, NULL, 'Z'},
+        {"chapters", required_argument, NULL, 'K'},
+        {"start", required_argument, NULL, 'B'},
+        {"end", required_argument, NULL, 'E'},
+        {"format", required_argument, NULL, 'O'},
+        {"stills", required_argument, NULL, 'G'},
+        {"cache", required_argument, NULL, 'M'},
+        {"json", no_argument, NULL, 'J'},
+        {"profile", required_argument, NULL, 'R'},
         {"help", no_argument, NULL, 'H'},
         {"version", no_argument, NULL, 'V'},
         {NULL, 0, NULL, 0}
     };
 
+    const char* end_arg = NULL;
     int opt;
     while ((opt = getopt_long(argc, argv, "p:n:", longopts, NULL)) != -1) {
         switch (opt) {
@@ -1295,8 +6887,123 @@ static void get_options(int argc, char** argv)
             }
             break;
         }
-        case 'n':
-            base_name = optarg;
+        case 'U': {
+            char* trailing;
+            required_playlist = strtoul(optarg, &trailing, 10);
+            if (*trailing || !required_playlist) {
+                usage(argv, EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'n':
+            base_name = optarg;
+            break;
+        case 'F':
+            fixups = true;
+            break;
+        case 'P':
+            probe = true;
+            break;
+        case 'C':
+            clear_only = true;
+            break;
+        case 'T':
+            rebase_time = true;
+            break;
+        case 'N':
+            nav_packs = true;
+            break;
+        case 'S':
+            strip = true;
+            break;
+        case 'I':
+            write_index = true;
+            break;
+        case 'L':
+            write_captions = true;
+            break;
+        case 'B':
+            if (!parse_time(optarg, &range_start)) {
+                usage(argv, EXIT_FAILURE);
+            }
+            time_range = true;
+            break;
+        case 'E':
+            end_arg = optarg;
+            time_range = true;
+            break;
+        case 'Z': {
+            uint64_t sectors = parse_size(optarg) / DVD_SECTOR_SIZE;
+            if (!sectors || sectors > UINT32_MAX) {
+                usage(argv, EXIT_FAILURE);
+            }
+            split_sectors = sectors;
+            break;
+        }
+        case 'G':
+            still_vro_name = optarg;
+            break;
+        case 'M':
+            cache_dir = optarg;
+            break;
+        case 'J':
+            json_output = true;
+            break;
+        case 'R':
+            if (STREQ(optarg, "csv")) {
+                profile_format = PROFILE_CSV;
+            } else if (STREQ(optarg, "json")) {
+                profile_format = PROFILE_JSON;
+            } else {
+                usage(argv, EXIT_FAILURE);
+            }
+            break;
+        case 'K':
+            if (STREQ(optarg, "split")) {
+                chapter_mode = CHAPTERS_SPLIT;
+            } else if (STREQ(optarg, "marks")) {
+                chapter_mode = CHAPTERS_MARKS;
+            } else {
+                usage(argv, EXIT_FAILURE);
+            }
+            break;
+        case 'A': {
+            char* list = optarg;
+            pack_filter.audio_mask = 0;
+            do {
+                char* trailing;
+                unsigned long audio = strtoul(list, &trailing, 10);
+                if (trailing == list || (*trailing && *trailing != ',') ||
+                    audio >= MAX_AUDIO_STREAMS) {
+                    usage(argv, EXIT_FAILURE);
+                }
+                pack_filter.audio_mask |= 1 << audio;
+                list = trailing + 1;
+            } while (list[-1] == ',');
+            break;
+        }
+        case 'O':
+            if (STREQ(optarg, "vob")) {
+                output_format = FORMAT_VOB;
+            } else if (STREQ(optarg, "es")) {
+                output_format = FORMAT_ES;
+                output_ext = ".m2v";
+                output_func = demux_packs;
+            } else if (STREQ(optarg, "ts")) {
+                output_format = FORMAT_TS;
+                output_ext = ".ts";
+                output_func = ts_packs;
+            } else if (STREQ(optarg, "mkv")) {
+                output_format = FORMAT_MKV;
+                output_ext = ".mkv";
+                output_func = mkv_packs;
+            } else if (STREQ(optarg, "video_ts")) {
+                output_format = FORMAT_VIDEO_TS;
+                output_ext = ".VOB";
+                nav_packs = true;
+            } else {
+                usage(argv, EXIT_FAILURE);
+            }
             break;
         case 'V':
             printf("dvd-vr "VERSION);
@@ -1318,15 +7025,155 @@ static void get_options(int argc, char** argv)
 
     ifo_name=argv[optind++];
 
+    /* The end is either a time, or a +duration from the start */
+    if (end_arg) {
+        bool duration = *end_arg == '+';
+        if (!parse_time(end_arg + duration, &range_end)) {
+            usage(argv, EXIT_FAILURE);
+        }
+        if (duration) {
+            range_end += range_start;
+        }
+        if (range_end <= range_start) {
+            usage(argv, EXIT_FAILURE);
+        }
+    }
+
     if (optind < argc) {
         vro_name=argv[optind++];
     }
 
-    if (!STREQ(base_name, TIMESTAMP_FMT) && !vro_name) {
+    if (!STREQ(base_name, TIMESTAMP_FMT) && !vro_name && !still_vro_name) {
+        usage(argv, EXIT_FAILURE);
+    }
+
+    /* Stills are written to separate files named by timestamp or NAME */
+    if (still_vro_name && (STREQ(base_name, "-") || STREQ(base_name, "[label]"))) {
+        usage(argv, EXIT_FAILURE);
+    }
+
+    /* The JSON and profile are written to stdout */
+    if ((json_output || profile_format) && STREQ(base_name, "-")) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if (json_output && profile_format == PROFILE_CSV) {
+        usage(argv, EXIT_FAILURE);
+    }
+
+    /* Fixups are planned from the VRO and written alongside the vob files */
+    if (fixups && (!vro_name || STREQ(base_name, "-"))) {
+        usage(argv, EXIT_FAILURE);
+    }
+
+    /* Probing reads the VRO but doesn't extract */
+    if (probe && (!vro_name || fixups || clear_only || !STREQ(base_name, TIMESTAMP_FMT))) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if (clear_only && !vro_name) {
+        usage(argv, EXIT_FAILURE);
+    }
+
+    /* Elementary streams are written to multiple files */
+    if (output_format == FORMAT_ES && STREQ(base_name, "-")) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if (output_format == FORMAT_VIDEO_TS && !STREQ(base_name, TIMESTAMP_FMT)) {
+        usage(argv, EXIT_FAILURE); /* file names are fixed */
+    }
+    if (nav_packs && ((output_format != FORMAT_VOB && output_format != FORMAT_VIDEO_TS) || clear_only)) {
+        /* The search pointers assume the whole VOB is output */
+        usage(argv, EXIT_FAILURE);
+    }
+
+    /* Stripping changes the sector offsets of the VOB */
+    bool audio_filtered = pack_filter.audio_mask != 0xFF;
+    if (strip && output_format != FORMAT_VOB) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if ((strip || audio_filtered) && (nav_packs || fixups)) {
+        usage(argv, EXIT_FAILURE);
+    }
+    pack_filter.strip = strip;
+    if ((strip || audio_filtered) && output_format == FORMAT_VOB) {
+        output_func = filter_packs;
+    }
+
+    /* The index is of the offsets in the vob file */
+    if (write_index && (!vro_name || output_format != FORMAT_VOB || STREQ(base_name, "-"))) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if (write_index) {
+        seek_index.enabled = true;
+        output_func = filter_packs;
+    }
+
+    /* Captions are written alongside the output */
+    if (write_captions && (!vro_name || STREQ(base_name, "-") || output_format == FORMAT_VIDEO_TS)) {
+        usage(argv, EXIT_FAILURE);
+    }
+
+    /* Parts are NAME_2.vob etc. like the clear runs, and only
+     * formats that can be simply concatenated are supported */
+    if (split_sectors && (!vro_name || STREQ(base_name, "-") || clear_only ||
+                          (output_format != FORMAT_VOB && output_format != FORMAT_TS))) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if (chapter_mode == CHAPTERS_SPLIT && (!vro_name || STREQ(base_name, "-") || clear_only ||
+                                           split_sectors || (output_format != FORMAT_VOB &&
+                                                             output_format != FORMAT_TS))) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if (chapter_mode == CHAPTERS_MARKS && (!vro_name || output_format != FORMAT_MKV)) {
+        usage(argv, EXIT_FAILURE);
+    }
+    if (output_format == FORMAT_VIDEO_TS) {
+        split_sectors = VTS_VOB_SECTORS;
+    }
+
+    /* The cells of a playlist are written as is to a single vob */
+    if (required_playlist && (!vro_name || STREQ(base_name, "-") || STREQ(base_name, "[label]") ||
+                              required_program || probe || clear_only || fixups || time_range ||
+                              output_format != FORMAT_VOB || output_func || nav_packs ||
+                              rebase_time || write_captions || split_sectors || chapter_mode)) {
         usage(argv, EXIT_FAILURE);
     }
 }
 
+static const ifo_program_t* sorted_programs;
+static int compare_vob_offsets(const void* p1, const void* p2)
+{
+    const ifo_program_t* info1 = &sorted_programs[*(const unsigned int*)p1];
+    const ifo_program_t* info2 = &sorted_programs[*(const unsigned int*)p2];
+    if (info1->vob_offset != info2->vob_offset) {
+        return info1->vob_offset < info2->vob_offset ? -1 : 1;
+    }
+    return *(const unsigned int*)p1 < *(const unsigned int*)p2 ? -1 : 1;
+}
+
+/*
+ * Return the order to process the programs in, which is the order they're listed,
+ * or if vro_order, the order they're stored in the VRO. The programs of multiple
+ * VRO info tables can be interleaved in the VRO, so this allows them all to be
+ * extracted in a single forward pass. The returned array must be free()d.
+ */
+static unsigned int* schedule_programs(const ifo_t* ifo, bool vro_order)
+{
+    unsigned int* order = malloc(ifo->nr_of_programs * sizeof(unsigned int) + 1);
+    if (!order) {
+        fprintf(stderr, "Error allocating space for program order\n");
+        return NULL;
+    }
+    unsigned int program;
+    for (program=0; program<ifo->nr_of_programs; program++) {
+        order[program] = program;
+    }
+    if (vro_order) {
+        sorted_programs = ifo->programs;
+        qsort(order, ifo->nr_of_programs, sizeof(unsigned int), compare_vob_offsets);
+    }
+    return order;
+}
+
 int main(int argc, char** argv)
 {
     setlocale(LC_ALL,"");
@@ -1336,34 +7183,18 @@ int main(int argc, char** argv)
 
     if (STREQ(base_name, "-")) {
         stdinfo = stderr;
+    } else if (json_output || profile_format) {
+        stdinfo = fopen("/dev/null", "w"); /* only the JSON or profile is written to stdout */
+        if (!stdinfo) {
+            fprintf(stderr, "Error opening /dev/null (%s)\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
     } else {
         stdinfo = stdout; /* allow users to grep metadata etc. */
     }
 
-    int fd=open(ifo_name,O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Error opening [%s] (%s)\n", ifo_name, strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-
-    rtav_vmgi_t* rtav_vmgi_ptr=mmap(0,sizeof(rtav_vmgi_t),PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
-    if (rtav_vmgi_ptr == MAP_FAILED) {
-        fprintf(stderr, "Failed to MMAP ifo file (%s)\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    if (strncmp("DVD_RTR_VMG0",rtav_vmgi_ptr->mat.id,sizeof(rtav_vmgi_ptr->mat.id))) {
-        fprintf(stderr, "invalid DVD-VR IFO identifier\n");
-        exit(EXIT_FAILURE);
-    }
-
-    uint32_t vmg_size = NTOHL(rtav_vmgi_ptr->mat.vmg_ea) + 1;
-    if (munmap(rtav_vmgi_ptr, sizeof(rtav_vmgi_t)) !=0) {
-        fprintf(stderr, "Failed to unmap ifo file (%s)\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
-    rtav_vmgi_ptr=mmap(0,vmg_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
-    if (rtav_vmgi_ptr == MAP_FAILED) {
-        fprintf(stderr, "Failed to re MMAP ifo file (%s)\n", strerror(errno));
+    ifo_t ifo;
+    if (!parse_ifo(ifo_name, cache_dir, &ifo)) {
         exit(EXIT_FAILURE);
     }
 
@@ -1378,52 +7209,43 @@ int main(int argc, char** argv)
         posix_fadvise(vro_fd, 0, 0, POSIX_FADV_SEQUENTIAL);/* More readahead done */
 #endif //POSIX_FADV_SEQUENTIAL
     }
+    bool extract = vro_fd != -1 && !probe && !required_playlist;
+    if (extract && output_format == FORMAT_VIDEO_TS &&
+        mkdir(VIDEO_TS_DIR, 0777) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error creating [%s] (%s)\n", VIDEO_TS_DIR, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
-    NTOHS(rtav_vmgi_ptr->mat.version);
-    rtav_vmgi_ptr->mat.version &= 0x00FF;
-    fprintf(stdinfo, "format: DVD-VR V%d.%d\n",
-            rtav_vmgi_ptr->mat.version>>4,rtav_vmgi_ptr->mat.version&0x0F);
-    if (rtav_vmgi_ptr->mat.cprm.supported) {
+    fprintf(stdinfo, "format: DVD-VR V%d.%d\n", ifo.version>>4, ifo.version&0x0F);
+    if (ifo.cprm_supported) {
         fprintf(stdinfo, "Encryption: CPRM supported\n");
         /* Note programs may not actually be encrypted.
          * That's indicated per AV pack in 2 PES scrambling control bits */
     }
 
-    disc_charset=parse_txt_encoding(rtav_vmgi_ptr->mat.txt_encoding);
-
-    print_disc_info(rtav_vmgi_ptr);
+    disc_charset=parse_txt_encoding(ifo.txt_encoding);
 
-    NTOHL(rtav_vmgi_ptr->mat.pgit_sa);
-    pgiti_t* pgiti = (pgiti_t*) ((char*)rtav_vmgi_ptr + rtav_vmgi_ptr->mat.pgit_sa);
-    NTOHL(pgiti->pgit_ea);
-
-    NTOHL(rtav_vmgi_ptr->mat.def_psi_sa);
-    psi_gi_t *def_psi_gi = (psi_gi_t*) ((char*)rtav_vmgi_ptr + rtav_vmgi_ptr->mat.def_psi_sa);
+    print_disc_info(&ifo);
 
 #ifndef NDEBUG
-    NTOHS(def_psi_gi->nr_of_programs);
-    if ((def_psi_gi->nr_of_psi > 1) && (def_psi_gi->nr_of_psi != def_psi_gi->nr_of_programs)) {
-        print_psi(def_psi_gi);
+    if ((ifo.nr_of_psi > 1) && (ifo.nr_of_psi != ifo.nr_of_psi_programs)) {
+        print_psi(&ifo);
     }
-    fprintf(stdinfo, "Number of info tables for VRO: %d\n",pgiti->nr_of_pgi);
-    fprintf(stdinfo, "Number of vob formats: %d\n",pgiti->nr_of_vob_formats);
-    fprintf(stdinfo, "pgit_ea: %08"PRIX32"\n",pgiti->pgit_ea);
+    fprintf(stdinfo, "Number of info tables for VRO: %d\n",ifo.nr_of_pgi);
+    fprintf(stdinfo, "Number of vob formats: %d\n",ifo.nr_of_vob_formats);
+    fprintf(stdinfo, "pgit_ea: %08"PRIX32"\n",ifo.pgit_ea);
 #endif//NDEBUG
 
-    if (pgiti->nr_of_pgi == 0) {
+    if (ifo.nr_of_pgi == 0) {
         fprintf(stderr, "Error: couldn't find info table for VRO\n");
         exit(EXIT_FAILURE);
     }
-    if (pgiti->nr_of_pgi > 1) {
-        fprintf(stderr, "Warning: Only processing 1 of the %"PRIu8" VRO info tables\n",
-                pgiti->nr_of_pgi);
-    }
 
-    vob_format_t* vob_format = (vob_format_t*) (pgiti+1);
     int vob_type;
-    int vob_types=pgiti->nr_of_vob_formats;
+    int vob_types=ifo.nr_of_vob_formats;
     ifo_video_attrs=malloc(vob_types * sizeof(p_video_attr_t));
-    if (!ifo_video_attrs) {
+    ifo_audio_attrs=malloc(vob_types * sizeof(p_audio_attr_t));
+    if (!ifo_video_attrs || !ifo_audio_attrs) {
         fprintf(stderr, "Error allocating space for video type attributes\n");
         exit(EXIT_FAILURE);
     }
@@ -1432,24 +7254,34 @@ int main(int argc, char** argv)
         if (vob_types>1) {
             fprintf(stdinfo, "VOB format %d...\n",vob_type+1);
         }
-        NTOHS(vob_format->video_attr);
+        const ifo_vob_format_t* vob_format = &ifo.vob_formats[vob_type];
         if (!parse_video_attr(vob_format->video_attr, &ifo_video_attrs[vob_type])) {
             fprintf(stderr, "Error parsing video_attr\n");
         }
-        if (!parse_audio_attr(vob_format->audio_attr0)) {
+        if (!parse_audio_attr(vob_format->audio_attr[0], 0)) {
             fprintf(stderr, "Error parsing audio_attr0\n");
         }
-        vob_format++;
+        if (vob_format->nr_of_audio_streams > 1 && !parse_audio_attr(vob_format->audio_attr[1], 1)) {
+            fprintf(stderr, "Error parsing audio_attr1\n");
+        }
+        ifo_audio_attrs[vob_type].nr_of_streams = MIN(vob_format->nr_of_audio_streams, MAX_AUDIO_STREAMS);
+        ifo_audio_attrs[vob_type].coding[0] = get_audio_coding(vob_format->audio_attr[0]);
+        ifo_audio_attrs[vob_type].coding[1] = get_audio_coding(vob_format->audio_attr[1]);
+        ifo_audio_attrs[vob_type].channels[0] = get_audio_channels(vob_format->audio_attr[0]);
+        ifo_audio_attrs[vob_type].channels[1] = get_audio_channels(vob_format->audio_attr[1]);
+    }
+
+    if (json_output) {
+        json_disc(&ifo);
     }
+    write_profile_header(profile_format);
 
-    pgi_gi_t* pgi_gi = (pgi_gi_t*) vob_format;
-    NTOHS(pgi_gi->nr_of_programs);
-    fprintf(stdinfo, "\nNumber of programs: %d\n", pgi_gi->nr_of_programs);
-    if (required_program && required_program>pgi_gi->nr_of_programs) {
+    fprintf(stdinfo, "\nNumber of programs: %d\n", ifo.nr_of_programs);
+    if (required_program && required_program>ifo.nr_of_programs) {
         fprintf(stderr, "Error: couldn't find specified program (%lu)\n", required_program);
         exit(EXIT_FAILURE);
     }
-    ifo_program_attrs=malloc(pgi_gi->nr_of_programs * sizeof(p_program_attr_t));
+    ifo_program_attrs=malloc(ifo.nr_of_programs * sizeof(p_program_attr_t));
     if (!ifo_program_attrs) {
         fprintf(stderr, "Error allocating space for program attributes\n");
         exit(EXIT_FAILURE);
@@ -1458,22 +7290,45 @@ int main(int argc, char** argv)
     struct tm now_tm;
     time_t now=time(0);
     (void) gmtime_r(&now, &now_tm);//used if no timestamp in program
-    unsigned int program;
-    typedef uint32_t vvobi_sa_t;
-    vvobi_sa_t* vvobi_sa=(vvobi_sa_t*)(pgi_gi+1);
-    for (program=0; program<pgi_gi->nr_of_programs; program++) {
+    /* Output to stdout and VIDEO_TS titles are in program order */
+    unsigned int* order = schedule_programs(&ifo, extract && ifo.nr_of_pgi > 1 &&
+                                                  !STREQ(base_name, "-") &&
+                                                  output_format != FORMAT_VIDEO_TS);
+    if (!order) {
+        exit(EXIT_FAILURE);
+    }
+    unsigned int program, ordered;
+    for (ordered=0; ordered<ifo.nr_of_programs; ordered++) {
+        program = order[ordered];
 
         if (required_program && program+1!=required_program) {
-            vvobi_sa++;
             continue;
         }
-
-        NTOHL(*vvobi_sa);
+        const ifo_program_t* info = &ifo.programs[program];
+        if (!info->nr_of_vobus) { /* e.g. its info couldn't be read */
+            fprintf(stderr, "Warning: skipping program %d as it has no VOBUs\n", program+1);
+            if (json_output) {
+                json_skipped_program(program, "no VOBUs");
+            }
+            continue;
+        }
+        vobu_range_t range = { .first_vobu=0, .nr_of_vobus=info->nr_of_vobus, .sector=0,
+                               .start_ptm=info->start_ptm, .end_ptm=info->end_ptm };
+        bool ntsc = program_ntsc(&ifo, info);
+        if (time_range) {
+            if (!find_vobu_range(info, ntsc, range_start, range_end, &range)) {
+                fprintf(stderr, "Warning: program %d ends before the start time\n", program+1);
+                if (json_output) {
+                    json_skipped_program(program, "ends before the start time");
+                }
+                continue;
+            }
+        }
 
         putc('\n', stdinfo);
         fprintf(stdinfo, "num  : %d\n", program+1);
 
-        psi_t* psi=find_program_text_info(def_psi_gi, program+1);
+        const ifo_psi_t* psi=find_program_text_info(&ifo, program+1);
         if (psi) {
             print_label(psi);
         } else {
@@ -1481,11 +7336,10 @@ int main(int argc, char** argv)
         }
 
 #ifndef NDEBUG
-        fprintf(stdinfo, "VVOB info (%d) address: %"PRIu32"\n",program+1,*vvobi_sa);
+        fprintf(stdinfo, "VVOB info (%d) address: %"PRIu32"\n",program+1,info->vvobi_sa);
 #endif//NDEBUG
-        vvob_t* vvob = (vvob_t*) (((uint8_t*)pgiti) + *vvobi_sa);
         struct tm tm;
-        bool ts_ok = parse_pgtm(vvob->vob_timestamp,&tm);
+        bool ts_ok = parse_pgtm(info->timestamp,&tm);
         char vob_base[(sizeof(psi->title)*MB_LEN_MAX)+4/*#123*/+1/*NUL*/];
         if (STREQ(base_name, TIMESTAMP_FMT)) { //use timestamp to give unique filename
             if (ts_ok) {
@@ -1520,58 +7374,109 @@ int main(int argc, char** argv)
         }
 
         int vob_fd=-1;
-        char vob_name[sizeof(vob_base)+32];
-        if (vro_fd!=-1) {
+        unsigned int part_base=0; /* VOB files of the title set before this program */
+        char out_base[sizeof(vob_base)+24]; /* output file names without extension */
+        char vob_name[sizeof(out_base)+32];
+        char first_name[sizeof(vob_name)]; /* vob_name changes for each part */
+        if (extract) {
             if (STREQ(base_name, "-")) {
                 vob_fd=fileno(stdout);
+            } else if (output_format == FORMAT_VIDEO_TS) {
+                int vob_format = info->vob_format_id-1;
+                if (!video_ts_supported(ifo_video_attrs[vob_format].attr)) {
+                    fprintf(stderr, "Error: the video resolution of program %d isn't supported by DVD-Video\n",
+                            program+1);
+                    if (json_output) {
+                        json_skipped_program(program, "video resolution not supported by DVD-Video");
+                    }
+                    continue;
+                }
+                /* Programs of a set are chapters of a title, so continue its title set */
+                int psi = program < ifo.nr_of_indexed_programs ? ifo.program_psis[program] : 0;
+                unsigned int nr_of_files = 0;
+                free(plan_splits(info->vobus + range.first_vobu, range.nr_of_vobus,
+                                 VTS_VOB_SECTORS, &nr_of_files));
+                if (!video_ts_continues(psi, vob_format, nr_of_files)) {
+                    if (!write_vts_ifo(&ifo_video_attrs[video_ts.vob_format],
+                                       &ifo_audio_attrs[video_ts.vob_format])) {
+                        exit(EXIT_FAILURE);
+                    }
+                    if (video_ts.nr_of_vts == VTS_MAX) {
+                        fprintf(stderr, "Error: DVD-Video supports at most %d title sets\n", VTS_MAX);
+                        exit(EXIT_FAILURE);
+                    }
+                    video_ts_start(psi, vob_format, &tm);
+                }
+                part_base = video_ts.nr_of_files;
+                (void) snprintf(out_base,sizeof(out_base),"%s/VTS_%02d",VIDEO_TS_DIR,video_ts.nr_of_vts+1);
+                (void) snprintf(vob_name,sizeof(vob_name),"%s_%u%s",out_base,part_base+1,output_ext);
+                vob_fd=open(vob_name,O_WRONLY|O_CREAT|O_EXCL,0666);
             } else {
-                (void) snprintf(vob_name,sizeof(vob_name),"%s.vob",vob_base);
+                (void) snprintf(out_base,sizeof(out_base),"%s",vob_base);
+                (void) snprintf(vob_name,sizeof(vob_name),"%s%s",out_base,output_ext);
                 vob_fd=open(vob_name,O_WRONLY|O_CREAT|O_EXCL,0666);
                 if (vob_fd == -1 && errno == EEXIST && STREQ(base_name, TIMESTAMP_FMT)) {
                     /* JVC DVD recorder can generate duplicate timestamps at least :( */
                     /* FIXME: The second time ripping a disc will duplicate the first VOB with duplicate timestamp.
                     * Would need to scan all program info first and change format if any duplicate timestamps. */
-                    (void) snprintf(vob_name,sizeof(vob_name),"%s#%03d.vob",vob_base, program+1);
+                    (void) snprintf(out_base,sizeof(out_base),"%s#%03d",vob_base, program+1);
+                    (void) snprintf(vob_name,sizeof(vob_name),"%s%s",out_base,output_ext);
                     vob_fd=open(vob_name,O_WRONLY|O_CREAT|O_EXCL,0666);
                 }
             }
             if (vob_fd == -1) {
-                fprintf(stderr, "Error opening [%s] (%s)\n", vob_name, strerror(errno));
-                vvobi_sa++;
+                const char* open_error = strerror(errno);
+                fprintf(stderr, "Error opening [%s] (%s)\n", vob_name, open_error);
+                if (json_output) {
+                    json_skipped_program(program, open_error);
+                }
                 continue;
             }
+            memcpy(first_name, vob_name, sizeof(first_name));
         }
 
         if (vob_types>1) {
-            fprintf(stdinfo, "vob format: %d\n", vvob->vob_format_id);
+            fprintf(stdinfo, "vob format: %d\n", info->vob_format_id);
+        }
+        if (ifo.nr_of_pgi>1) {
+            fprintf(stdinfo, "info table: %d\n", info->pgi+1);
         }
-        ifo_program_attrs[program].video_attr = vvob->vob_format_id-1;
+        ifo_program_attrs[program].video_attr = info->vob_format_id-1;
         ifo_program_attrs[program].scrambled = SCRAMBLED_UNSET;
 
-        NTOHS(vvob->vob_attr);
-        int skip=0;
-        if (vvob->vob_attr & 0x80) {
-            skip+=sizeof(adj_vob_t);
 #ifndef NDEBUG
+        if (info->vob_attr & 0x80) {
             fprintf(stdinfo, "skipping adjacent VOB info\n");
-#endif//NDEBUG
         }
-        skip+=sizeof(uint16_t); /* ?? */
-        vobu_map_t* vobu_map = (vobu_map_t*) (((uint8_t*)(vvob+1)) + skip);
-        NTOHS(vobu_map->nr_of_time_info);
-        NTOHS(vobu_map->nr_of_vobu_info);
-        NTOHS(vobu_map->time_offset);
-        NTOHL(vobu_map->vob_offset);
-#ifndef NDEBUG
-        fprintf(stdinfo, "num time infos:   %"PRIu16"\n",vobu_map->nr_of_time_info);
-        fprintf(stdinfo, "num VOBUs: %"PRIu16"\n",vobu_map->nr_of_vobu_info);
-        fprintf(stdinfo, "time offset:      %"PRIu16"\n",vobu_map->time_offset); /* What units? */
-        fprintf(stdinfo, "vob offset:     %"PRIu32"*%d\n",vobu_map->vob_offset,DVD_SECTOR_SIZE);  /* offset in the VRO file of the VOB */
+        fprintf(stdinfo, "num time infos:   %"PRIu16"\n",info->nr_of_time_infos);
+        fprintf(stdinfo, "num VOBUs: %"PRIu16"\n",info->nr_of_vobus);
+        fprintf(stdinfo, "time offset:      %"PRIu16"\n",info->time_offset); /* What units? */
+        fprintf(stdinfo, "vob offset:     %"PRIu32"*%d\n",info->vob_offset,DVD_SECTOR_SIZE);  /* offset in the VRO file of the VOB */
 #endif//NDEBUG
-        off_t vob_offset = vobu_map->vob_offset;
+        char duration[16];
+        format_pts(duration, sizeof(duration), (info->end_ptm - info->start_ptm) & 0xFFFFFFFF);
+        fprintf(stdinfo, "duration: %s\n", duration);
+        if (time_range) {
+            char start[16], end[16];
+            format_pts(start, sizeof(start), (range.start_ptm - info->start_ptm) & 0xFFFFFFFF);
+            format_pts(end, sizeof(end), (range.end_ptm - info->start_ptm) & 0xFFFFFFFF);
+            fprintf(stdinfo, "range: %s - %s\n", start, end);
+        }
+        unsigned int nr_of_chapters;
+        uint32_t* chapters = range_chapters(info, &range, &nr_of_chapters);
+        if (!chapters) {
+            exit(EXIT_FAILURE);
+        }
+        if (nr_of_chapters > 1) {
+            print_chapters(info, chapters, nr_of_chapters);
+        } else if (chapter_mode != CHAPTERS_NONE) {
+            fprintf(stderr, "Warning: program %d has no chapters to %s\n", program+1,
+                    chapter_mode == CHAPTERS_SPLIT ? "split at" : "mark");
+        }
+        off_t vob_offset = (off_t)info->vob_offset + range.sector;
         if (vob_offset > OFF_T_MAX / DVD_SECTOR_SIZE)
         {
-            fprintf(stderr, "Overflow in extracting VOB at offset %"PRIu32"*%d\n",vobu_map->vob_offset,DVD_SECTOR_SIZE);
+            fprintf(stderr, "Overflow in extracting VOB at offset %"PRIdMAX"*%d\n",(intmax_t)vob_offset,DVD_SECTOR_SIZE);
             exit(EXIT_FAILURE);
         }
         vob_offset *= DVD_SECTOR_SIZE;
@@ -1581,26 +7486,208 @@ int main(int argc, char** argv)
                 exit(EXIT_FAILURE);
             }
         }
-        vobu_info_t* vobu_info = (vobu_info_t*) (((uint8_t*)(vobu_map+1)) + vobu_map->nr_of_time_info*sizeof(time_info_t));
+        const ifo_vobu_t* vobu_info = info->vobus + range.first_vobu;
         int vobus;
         uint64_t tot=0;
         int display_char;
         bool processed_some_video = false;
         int error=0;
-        if (vro_fd != -1) {
+        fixup_list_t fixup_list;
+        init_fixup_list(&fixup_list);
+        planned_context_t planned = { .fixups=&fixup_list, .program=program, .sector=0, .next=0 };
+        if (extract && fixups) {
+            if (!plan_mpeg2_fixups(vro_fd, vob_offset, vobu_info, range.nr_of_vobus,
+                                   program, &fixup_list)) {
+                exit(EXIT_FAILURE);
+            }
+            char fixups_name[sizeof(out_base)+8];
+            (void) snprintf(fixups_name, sizeof(fixups_name), "%s.fixups", out_base);
+            if (!write_fixups(fixups_name, &fixup_list)) {
+                exit(EXIT_FAILURE);
+            }
+#ifndef NDEBUG
+            fprintf(stdinfo, "fixups: %u\n", fixup_list.nr_of_fixups);
+#endif//NDEBUG
+        }
+        vobu_probe_t* probes = NULL;
+        scrambled_t probed_scrambled = SCRAMBLED_UNSET;
+        if (vro_fd != -1 && (probe || clear_only)) {
+            probes = probe_vobus(vro_fd, vob_offset, vobu_info, range.nr_of_vobus);
+            if (!probes) {
+                exit(EXIT_FAILURE);
+            }
+            probed_scrambled = print_scrambled_ranges(probes, info, ntsc, &range);
+            if (probe) {
+                ifo_program_attrs[program].scrambled = probed_scrambled;
+                processed_some_video = true;
+            }
+        }
+        split_part_t* parts = NULL;
+        unsigned int nr_of_parts = 0, part = 0;
+        bool preallocate = output_func == NULL; /* output is the same size as the input */
+        if (extract && split_sectors) {
+            parts = plan_splits(vobu_info, range.nr_of_vobus, split_sectors, &nr_of_parts);
+            if (!parts) {
+                exit(EXIT_FAILURE);
+            }
+            if (output_format == FORMAT_VIDEO_TS && part_base + nr_of_parts > VTS_VOBS_MAX) {
+                fprintf(stderr, "Error: program is too large for a DVD-Video title set\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (extract && chapter_mode == CHAPTERS_SPLIT) {
+            parts = plan_chapter_splits(info, ntsc, &range, chapters,
+                                        nr_of_chapters, &nr_of_parts);
+            if (!parts) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (chapter_mode != CHAPTERS_MARKS) {
+            nr_of_chapters = 0; /* not marked in the output */
+        }
+        if (extract) {
             percent_display(PERCENT_START, 0, 0);
             init_mpeg2_cache();
+            init_time_rebase(rebase_time, range.start_ptm);
+            pack_filter.dropped = 0;
+            index_start();
+            if (!init_mpeg_nav(nav_packs, vobu_info, range.nr_of_vobus,
+                               range.start_ptm, range.end_ptm,
+                               &ifo_video_attrs[ifo_program_attrs[program].video_attr])) {
+                exit(EXIT_FAILURE);
+            }
+            if (output_format == FORMAT_VIDEO_TS) {
+                set_mpeg_nav_vob(video_ts_sectors(), video_ts.nr_of_cells + 1);
+            }
+        }
+        if (extract && !captions_start(write_captions, out_base,
+                                       &ifo_video_attrs[ifo_program_attrs[program].video_attr])) {
+            exit(EXIT_FAILURE);
         }
-        for (vobus=0; vobus<vobu_map->nr_of_vobu_info; vobus++) {
-            uint16_t vobu_size = vobu_info->vobu_size;
-            NTOHS(vobu_size); vobu_size&=0x03FF;
-            if (vro_fd != -1) {
+        if (extract && output_format == FORMAT_ES) {
+            if (!demux_start(out_base, &tm)) {
+                exit(EXIT_FAILURE);
+            }
+        } else if (extract && output_format == FORMAT_TS) {
+            ts_start(&ifo_video_attrs[ifo_program_attrs[program].video_attr],
+                     &ifo_audio_attrs[ifo_program_attrs[program].video_attr]);
+        } else if (extract && output_format == FORMAT_MKV) {
+            if (mkv_start(vob_fd, &ifo_video_attrs[ifo_program_attrs[program].video_attr],
+                          &ifo_audio_attrs[ifo_program_attrs[program].video_attr],
+                          range.start_ptm, range.end_ptm, chapters, nr_of_chapters)) {
+                fprintf(stderr, "Error writing output [%s]\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        char run_base[sizeof(out_base)];
+        if (extract && clear_only && vob_fd != fileno(stdout)) {
+            memcpy(run_base, out_base, sizeof(run_base));
+        }
+        char part_base_name[sizeof(out_base)+12]; /* output file name of the part without extension */
+        if (extract && parts) {
+            memcpy(part_base_name, out_base, sizeof(out_base));
+        }
+        bool keep = true, kept = false; /* whether to copy this and the previous VOBU */
+        int clear_runs = 0;
+        uint64_t kept_tot = 0;
+        for (vobus=0; vobus<range.nr_of_vobus; vobus++) {
+            uint16_t vobu_size = vobu_info->sectors;
+            if (extract && clear_only) {
+                /* VOBUs without video sampled are assumed same as previous */
+                if (probes[vobus].scrambled != SCRAMBLED_UNSET) {
+                    keep = probes[vobus].scrambled == UNSCRAMBLED;
+                }
+                if (keep && !kept && clear_runs++ && vob_fd != fileno(stdout)) {
+                    /* start a new file for each run of unscrambled VOBUs */
+                    if (output_format == FORMAT_MKV && mkv_end(vob_fd)) {
+                        fprintf(stderr, "Error writing output [%s]\n", strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    if (write_index) {
+                        if (!index_end(out_base, &tm)) {
+                            exit(EXIT_FAILURE);
+                        }
+                        index_start();
+                    }
+                    close(vob_fd);
+                    touch(vob_name, &tm);
+                    (void) snprintf(out_base, sizeof(out_base), "%.*s_%d",
+                                    (int)sizeof(vob_base)+4/*#123*/, run_base, clear_runs);
+                    (void) snprintf(vob_name, sizeof(vob_name), "%s%s", out_base, output_ext);
+                    vob_fd=open(vob_name,O_WRONLY|O_CREAT|O_EXCL,0666);
+                    if (vob_fd == -1) {
+                        fprintf(stderr, "Error opening [%s] (%s)\n", vob_name, strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                    if (output_format == FORMAT_ES) {
+                        demux_end();
+                        if (!demux_start(out_base, &tm)) {
+                            exit(EXIT_FAILURE);
+                        }
+                    } else if (output_format == FORMAT_MKV &&
+                               mkv_start(vob_fd, &ifo_video_attrs[ifo_program_attrs[program].video_attr],
+                                         &ifo_audio_attrs[ifo_program_attrs[program].video_attr],
+                                         range.start_ptm, range.end_ptm,
+                                         chapters, nr_of_chapters)) {
+                        fprintf(stderr, "Error writing output [%s]\n", strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                kept = keep;
+            }
+            if (parts && part < nr_of_parts && parts[part].first_vobu == (unsigned int)vobus) {
+                if (part) { /* start the next planned part */
+                    close_part(vob_fd, vob_name, preallocate, &tm);
+                    if (write_index) { /* with offsets in the part */
+                        if (!index_end(part_base_name, &tm)) {
+                            exit(EXIT_FAILURE);
+                        }
+                        index_start();
+                    }
+                    (void) snprintf(part_base_name, sizeof(part_base_name), "%s_%u",
+                                    out_base, part_base+part+1);
+                    (void) snprintf(vob_name, sizeof(vob_name), "%s%s", part_base_name, output_ext);
+                    vob_fd=open(vob_name,O_WRONLY|O_CREAT|O_EXCL,0666);
+                    if (vob_fd == -1) {
+                        fprintf(stderr, "Error opening [%s] (%s)\n", vob_name, strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                if (preallocate && !preallocate_part(vob_fd, vob_name, parts[part].sectors)) {
+                    exit(EXIT_FAILURE);
+                }
+                part++;
+            }
+            if (extract && !keep) {
+                /* Don't read or write encrypted VOBUs */
+                if (lseek(vro_fd, vobu_size*DVD_SECTOR_SIZE, SEEK_CUR) == (off_t)-1) {
+                    fprintf(stderr, "Error skipping in VRO [%s]\n", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                planned.sector = tot + vobu_size;
+                mark_time_discontinuity();
+                percent_display(PERCENT_UPDATE, ((vobus+1)*100)/range.nr_of_vobus, 'E');
+            } else if (extract) {
+                kept_tot += vobu_size;
                 off_t curr_offset = lseek(vro_fd, 0, SEEK_CUR);
                 if (curr_offset == (off_t)-1) {
                     fprintf(stderr, "Error determining VRO offset [%s]\n", strerror(errno));
                     exit(EXIT_FAILURE);
                 }
-                int ret = stream_data(vro_fd, vob_fd, vobu_size, DVD_SECTOR_SIZE, process_mpeg2, &program);
+                set_mpeg_nav_vobu(vobus);
+                index_vobu();
+                /* The NAV pack is written once the whole VOBU has been processed */
+                output_func_t vobu_output_func = nav_packs ? buffer_mpeg_nav : output_func;
+                int ret;
+                if (fixups) {
+                    ret = stream_data(vro_fd, vob_fd, vobu_size, DVD_SECTOR_SIZE,
+                                      process_mpeg2_planned, &planned, vobu_output_func);
+                } else {
+                    ret = stream_data(vro_fd, vob_fd, vobu_size, DVD_SECTOR_SIZE, process_mpeg2, &program,
+                                      vobu_output_func);
+                }
+                if (ret != -2 && nav_packs && !write_mpeg_nav_vobu(vob_fd, ret == 0)) {
+                    ret = -2;
+                }
                 if (ret == -2) { /* write error */
                     exit(EXIT_FAILURE);
                 } else if (ret == -1) { /* read error */
@@ -1612,6 +7699,14 @@ int main(int argc, char** argv)
                         exit(EXIT_FAILURE);
                     }
                     off_t skip_len = (curr_offset + vobu_size*DVD_SECTOR_SIZE) - new_offset;
+                    if (nav_packs) {
+                        uint32_t sectors_read = (new_offset - curr_offset) / DVD_SECTOR_SIZE;
+                        if (!zero_fill_part(vob_fd, vobu_size - sectors_read)) {
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    planned.sector = tot + vobu_size; /* resync planned fixups to next VOBU */
+                    mark_time_discontinuity();
                     if (skip_len) {
 #ifndef NDEBUG
                         fprintf(stderr, "Warning: Skipping %"PRIdMAX" bytes\n", skip_len);
@@ -1631,26 +7726,59 @@ int main(int argc, char** argv)
                     processed_some_video = true;
                 }
 
-                int percent=((vobus+1)*100)/vobu_map->nr_of_vobu_info;
+                int percent=((vobus+1)*100)/range.nr_of_vobus;
                 percent_display(PERCENT_UPDATE, percent, display_char);
             }
             tot+=vobu_size;
             vobu_info++;
         }
-        if (vro_fd != -1) {
+        if (extract) {
             if (!error) {
                 percent_display(PERCENT_END, 0, 0);
             } else {
                 /* Leave the percent display showing read errors */
                 putc('\n', stderr);
             }
+            if (output_format == FORMAT_ES) {
+                demux_end();
+            } else if (output_format == FORMAT_MKV && mkv_end(vob_fd)) {
+                fprintf(stderr, "Error writing output [%s]\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
             if (vob_fd != fileno(stdout)) {
-                close(vob_fd);
-                touch(vob_name, &tm);
+                if (clear_only && !clear_runs) {
+                    close(vob_fd);
+                    unlink(vob_name); /* nothing unscrambled to extract */
+                } else {
+                    close_part(vob_fd, vob_name, parts && preallocate, &tm);
+                    if (write_index && !index_end(parts ? part_base_name : out_base, &tm)) {
+                        exit(EXIT_FAILURE);
+                    }
+                }
             }
         }
+        if (extract && !captions_end(&tm)) {
+            exit(EXIT_FAILURE);
+        }
+        if (extract && output_format == FORMAT_VIDEO_TS && !add_vts_cell(MAX(nr_of_parts, 1))) {
+            exit(EXIT_FAILURE);
+        }
+        free_fixup_list(&fixup_list);
+        free_mpeg_nav();
 
         fprintf(stdinfo, "size : %'"PRIu64"\n",tot*DVD_SECTOR_SIZE);
+        if (extract && output_func == filter_packs) {
+            fprintf(stdinfo, "stripped: %'"PRIu64"\n", pack_filter.dropped);
+        }
+        if (extract && clear_only) {
+            fprintf(stdinfo, "clear: %'"PRIu64" in %d file(s)\n", kept_tot*DVD_SECTOR_SIZE, clear_runs);
+            if (probed_scrambled != SCRAMBLED_UNSET) {
+                ifo_program_attrs[program].scrambled = probed_scrambled;
+            }
+        }
+        free(probes);
+        free(parts);
+        free(chapters);
 
         if (ifo_program_attrs[program].scrambled == SCRAMBLED) {
             fprintf(stderr, "Warning: program is encrypted\n");
@@ -1661,13 +7789,121 @@ int main(int argc, char** argv)
             fprintf(stderr, "  (preferably with a sample vob file)\n");
         }
 
-        vvobi_sa++;
+        if (json_output) {
+            bool extracted = extract && vob_fd != fileno(stdout) && !(clear_only && !clear_runs);
+            json_program(&ifo, program, &range, tot, extracted ? first_name : NULL, error);
+        }
+        if (profile_format) {
+            write_profile(info, program, ntsc, &range, profile_format);
+        }
+    }
+
+    if (extract && output_format == FORMAT_VIDEO_TS &&
+        (!write_vts_ifo(&ifo_video_attrs[video_ts.vob_format], &ifo_audio_attrs[video_ts.vob_format])
+         || !write_vmg_ifo())) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (ifo.nr_of_playlists) {
+        print_playlists(&ifo);
+    }
+    if (required_playlist && required_playlist>ifo.nr_of_playlists) {
+        fprintf(stderr, "Error: couldn't find specified playlist (%lu)\n", required_playlist);
+        exit(EXIT_FAILURE);
+    }
+    if (required_playlist) {
+        const ifo_playlist_t* playlist = &ifo.playlists[required_playlist-1];
+        unsigned int nr_of_pieces;
+        uint64_t out_sectors;
+        playlist_piece_t* pieces = plan_playlist(&ifo, playlist, &nr_of_pieces, &out_sectors);
+        if (!pieces) {
+            exit(EXIT_FAILURE);
+        }
+        if (out_sectors > OFF_T_MAX / DVD_SECTOR_SIZE || out_sectors > UINT32_MAX) {
+            fprintf(stderr, "Error: playlist is too large\n");
+            exit(EXIT_FAILURE);
+        }
+        char vob_name[strlen(base_name) + sizeof("_playlist123.vob")];
+        if (STREQ(base_name, TIMESTAMP_FMT)) {
+            (void) snprintf(vob_name, sizeof(vob_name), "playlist%02lu%s", required_playlist, output_ext);
+        } else {
+            (void) snprintf(vob_name, sizeof(vob_name), "%s_playlist%02lu%s", base_name,
+                            required_playlist, output_ext);
+        }
+        /* Use the timestamp of the first program played */
+        struct tm tm = now_tm;
+        if (playlist->nr_of_cells) {
+            (void) decode_pgtm(ifo.programs[playlist->cells[0].program].timestamp, &tm);
+        }
+        putc('\n', stdinfo);
+        int vob_fd=open(vob_name,O_WRONLY|O_CREAT|O_EXCL,0666);
+        if (vob_fd == -1) {
+            fprintf(stderr, "Error opening [%s] (%s)\n", vob_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (!preallocate_part(vob_fd, vob_name, out_sectors)) {
+            exit(EXIT_FAILURE);
+        }
+        bool read_error;
+        if (!extract_playlist(vro_fd, vob_fd, pieces, nr_of_pieces, &read_error)) {
+            exit(EXIT_FAILURE);
+        }
+        /* The output is written with pwrite(), so set the size explicitly */
+        if (lseek(vob_fd, (off_t)out_sectors * DVD_SECTOR_SIZE, SEEK_SET) == (off_t)-1) {
+            fprintf(stderr, "Error seeking within [%s] (%s)\n", vob_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        close_part(vob_fd, vob_name, true, &tm);
+        fprintf(stdinfo, "playlist: %s\n", vob_name);
+        fprintf(stdinfo, "size : %'"PRIu64"\n", out_sectors*DVD_SECTOR_SIZE);
+
+        unsigned int p;
+        for (p=0; p<nr_of_pieces; p++) {
+            scrambled_t scrambled = ifo_program_attrs[pieces[p].program].scrambled;
+            if (scrambled == SCRAMBLED || scrambled == PARTIALLY_SCRAMBLED) {
+                fprintf(stderr, "Warning: playlist is encrypted\n");
+                break;
+            }
+        }
+        free(pieces);
+        if (read_error) {
+            fprintf(stderr, "Warning: parts of the playlist couldn't be read, and are zero filled\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    unsigned int nr_of_stills = 0;
+    if (ifo.nr_of_still_groups) {
+        nr_of_stills = print_stills(&ifo);
+    }
+    if (still_vro_name && !nr_of_stills) {
+        fprintf(stderr, "Error: couldn't find the still info\n");
+        exit(EXIT_FAILURE);
+    }
+    if (still_vro_name) {
+        int still_fd=open(still_vro_name,O_RDONLY);
+        if (still_fd == -1) {
+            fprintf(stderr, "Error opening [%s] (%s)\n", still_vro_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(still_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif //POSIX_FADV_SEQUENTIAL
+        putc('\n', stdinfo);
+        if (!extract_stills(still_fd, &ifo, STREQ(base_name, TIMESTAMP_FMT) ? NULL : base_name,
+                            &now_tm, nr_of_stills)) {
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stdinfo, "stills extracted: %u\n", nr_of_stills);
+        close(still_fd);
     }
 
+    free_index();
+    free(order);
     free(ifo_program_attrs);
+    free(ifo_audio_attrs);
     free(ifo_video_attrs);
-    munmap(rtav_vmgi_ptr, vmg_size);
-    close(fd);
+    free_ifo(&ifo);
     if (vro_fd != -1)
         close(vro_fd);
 